@@ -0,0 +1,67 @@
+#include <stdlib.h>
+
+#include "arena.h"
+#include "xmalloc.h"
+
+
+#define ARENA_BLOCK_SIZE 16384
+/** Everything handed out is aligned to this. */
+#define ARENA_ALIGN 16
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	/* The data follows, at ARENA_ALIGN from the start. */
+};
+
+#define BLOCK_DATA(b) ((char *)(b) + ARENA_ALIGN)
+
+
+/**
+ * \return size bytes, not zeroed.  Requests bigger than a block get a block
+ * of their own, behind the current one so that it can still be filled.
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_block *b;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	b = a->blocks;
+	if (b && a->used + size <= b->size) {
+		a->used += size;
+		return BLOCK_DATA(b) + a->used - size;
+	}
+	if (size > ARENA_BLOCK_SIZE / 4) {
+		b = xmalloc(ARENA_ALIGN + size);
+		b->size = size;
+		if (a->blocks) {
+			b->next = a->blocks->next;
+			a->blocks->next = b;
+		} else {
+			b->next = NULL;
+			a->blocks = b;
+			a->used = size;
+		}
+		return BLOCK_DATA(b);
+	}
+	b = xmalloc(ARENA_ALIGN + ARENA_BLOCK_SIZE);
+	b->size = ARENA_BLOCK_SIZE;
+	b->next = a->blocks;
+	a->blocks = b;
+	a->used = size;
+	return BLOCK_DATA(b);
+}
+
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *b;
+	struct arena_block *next;
+
+	for (b = a->blocks; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	a->blocks = NULL;
+	a->used = 0;
+}
@@ -0,0 +1,25 @@
+/* Allocate many small things that are all freed together. */
+
+#ifndef __arena_h__
+#define __arena_h__
+
+#include <stddef.h>
+
+struct arena_block;
+
+/**
+ * Memory is taken from large blocks, in order, and only given back when the
+ * whole arena is freed.  Use it for things that live and die together, such
+ * as everything parsed from one reading of the configuration file.
+ */
+struct arena {
+	struct arena_block *blocks;	/* Newest first */
+	size_t used;			/* Of the newest block */
+};
+
+#define ARENA_INIT { NULL, 0 }
+
+extern void *arena_alloc(struct arena *a, size_t size);
+extern void arena_free(struct arena *a);
+
+#endif
@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "autoscale.h"
+#include "config.h"
+#include "log.h"
+#include "manager.h"
+#include "procinfo.h"
+#include "xmalloc.h"
+
+
+/** No change is made while the measured value is this close (as a fraction)
+    to the target, so that noise does not cause flapping. */
+#define AUTOSCALE_TOLERANCE 0.1
+/** How long to wait for a queue length from a socket. */
+#define QUEUE_TIMEOUT_MS 200
+
+static int parse_seconds(struct config *config, struct config_option *o,
+			 int *ms);
+static int parse_count(struct config *config, struct config_option *o,
+		       int *n);
+static void resize(struct pool *p, double total, int reporting,
+		   long long now);
+static double read_queue_file(struct autoscale *as, const char *name);
+static void start_queue_socket(struct autoscale *as, const char *name,
+			       long long now);
+static double queue_value(struct autoscale *as, const char *name,
+			  char *buf, ssize_t len);
+static int ceil_positive(double x);
+
+
+void autoscale_init(struct autoscale *as)
+{
+	memset(as, 0, sizeof(struct autoscale));
+	as->min_instances = -1;		/* Not given */
+	as->metric = SCALE_LOAD;
+	as->target = 1.0;
+	as->interval_ms = 10000;
+	as->up_cooldown_ms = 30000;
+	as->down_cooldown_ms = 300000;
+	as->queue_fd = -1;
+}
+
+
+/**
+ * Handle one autoscaling option from a pool section.
+ *
+ * \return 1 if the option was ours, 0 if it was not, or -1 if it had an
+ * error (which has been logged).
+ */
+int autoscale_option(struct autoscale *as, struct config *config,
+		     struct config_option *o)
+{
+	char *endptr;
+
+	if (! strcmp(o->key, "min-instances"))
+		return parse_count(config, o, &as->min_instances) ? -1 : 1;
+	if (! strcmp(o->key, "max-instances"))
+		return parse_count(config, o, &as->max_instances) ? -1 : 1;
+	if (! strcmp(o->key, "scale-interval"))
+		return parse_seconds(config, o, &as->interval_ms) ? -1 : 1;
+	if (! strcmp(o->key, "scale-up-cooldown"))
+		return parse_seconds(config, o, &as->up_cooldown_ms) ? -1 : 1;
+	if (! strcmp(o->key, "scale-down-cooldown"))
+		return parse_seconds(config, o, &as->down_cooldown_ms) ? -1 : 1;
+	if (! strcmp(o->key, "scale-target")) {
+		as->target = o->value ? strtod(o->value, &endptr) : 0;
+		if (! o->value || *endptr || as->target <= 0) {
+			logparent(CM_ERROR, "%s:%d: bad scale-target\n",
+				  config->path, o->line);
+			return -1;
+		}
+		return 1;
+	}
+	if (! strcmp(o->key, "scale-metric")) {
+		if (o->value && ! strcmp(o->value, "load")) {
+			as->metric = SCALE_LOAD;
+		} else if (o->value && ! strcmp(o->value, "cpu")) {
+			as->metric = SCALE_CPU;
+		} else if (o->value && (! strncmp(o->value, "queue:file:", 11)
+					|| ! strncmp(o->value, "queue:unix:", 11))) {
+			as->metric = SCALE_QUEUE;
+			free(as->queue);
+			as->queue = xstrdup(o->value + 6);
+		} else {
+			logparent(CM_ERROR, "%s:%d: bad scale-metric\n",
+				  config->path, o->line);
+			return -1;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Check the autoscaling settings of a pool when its section has been read,
+ * and choose the number of instances to start with.
+ *
+ * Load and CPU use are only measured on running instances, so a pool scaled
+ * on them keeps at least one, or it could never grow again.  Only a pool
+ * scaled on a queue can go down to none.
+ *
+ * \return 0 if the settings are OK, -1 if not (which has been logged).
+ */
+int autoscale_finish(struct autoscale *as, struct config *config,
+		     const char *section, int line, int *instances)
+{
+	if (! as->max_instances) {
+		if (as->min_instances >= 0 || as->queue) {
+			logparent(CM_ERROR, "%s:%d: %s: autoscaling needs "
+				  "max-instances\n", config->path, line,
+				  section);
+			return -1;
+		}
+		as->min_instances = 0;
+		return 0;
+	}
+	if (as->min_instances < 0) {
+		as->min_instances = (as->metric == SCALE_QUEUE) ? 0 : 1;
+	} else if (! as->min_instances && as->metric != SCALE_QUEUE) {
+		logparent(CM_ERROR, "%s:%d: %s: min-instances must be at least "
+			  "1 unless scale-metric is a queue\n", config->path,
+			  line, section);
+		return -1;
+	}
+	if (as->min_instances > as->max_instances) {
+		logparent(CM_ERROR, "%s:%d: %s: min-instances is more than "
+			  "max-instances\n", config->path, line, section);
+		return -1;
+	}
+	if (*instances < 0)
+		*instances = as->min_instances;
+	if (*instances < as->min_instances)
+		*instances = as->min_instances;
+	if (*instances > as->max_instances)
+		*instances = as->max_instances;
+	return 0;
+}
+
+
+/**
+ * Carry the timing state over a reload, so that a reload does not reset the
+ * cool-down periods.
+ */
+void autoscale_keep_state(struct autoscale *as, const struct autoscale *old)
+{
+	as->next_sample_ms = old->next_sample_ms;
+	as->last_scale_ms = old->last_scale_ms;
+}
+
+
+void autoscale_free(struct autoscale *as)
+{
+	free(as->queue);
+	as->queue = NULL;
+	if (as->queue_fd >= 0)
+		close(as->queue_fd);
+	as->queue_fd = -1;
+}
+
+
+/**
+ * Measure the load on an autoscaled pool, and change its size if the load per
+ * instance is too far from the target.
+ *
+ * The number of instances wanted is the current number scaled by the ratio of
+ * the load per instance to the target (or for a queue, the queue length
+ * divided by the target).  It grows at most once per up_cooldown_ms and
+ * shrinks at most once per down_cooldown_ms, both counted from the last
+ * change, and nothing changes while the load is within AUTOSCALE_TOLERANCE of
+ * the target.
+ *
+ * A queue length from a socket arrives later, in autoscale_handle_fds().
+ *
+ * \return the next time this wants to be called, or 0.
+ */
+long long autoscale_check(struct pool *p, struct managed *list,
+			  long long now)
+{
+	struct autoscale *as = &p->autoscale;
+	struct managed *m;
+	long long ticks;
+	double ticks_per_sec;
+	double total = 0;
+	int reporting = 0;
+
+	if (! as->max_instances)
+		return 0;
+	if (as->queue_fd >= 0) {
+		if (now < as->queue_deadline_ms)
+			return as->queue_deadline_ms;
+		close(as->queue_fd);
+		as->queue_fd = -1;
+		queue_value(as, p->name, NULL, -1);
+	}
+	if (now < as->next_sample_ms)
+		return as->next_sample_ms;
+	as->next_sample_ms = now + as->interval_ms;
+	ticks_per_sec = sysconf(_SC_CLK_TCK);
+
+	switch (as->metric) {
+	case SCALE_LOAD:
+		for (m = list; m; m = m->next) {
+			if (m->pool == p && ! m->removed && m->child_pid > 0
+			    && m->has_load) {
+				total += m->load;
+				reporting++;
+			}
+		}
+		break;
+	case SCALE_CPU:
+		for (m = list; m; m = m->next) {
+			if (m->pool != p || m->removed || m->child_pid <= 0)
+				continue;
+			ticks = procinfo_cpu_ticks(m->child_pid);
+			if (ticks >= 0 && m->cpu_ticks >= 0
+			    && now > m->cpu_sample_ms) {
+				total += (ticks - m->cpu_ticks) / ticks_per_sec
+					/ ((now - m->cpu_sample_ms) / 1000.0);
+				reporting++;
+			}
+			m->cpu_ticks = ticks;
+			m->cpu_sample_ms = now;
+		}
+		break;
+	case SCALE_QUEUE:
+		if (! strncmp(as->queue, "unix:", 5)) {
+			start_queue_socket(as, p->name, now);
+			return as->queue_fd >= 0 ? as->queue_deadline_ms
+				: as->next_sample_ms;
+		}
+		total = read_queue_file(as, p->name);
+		if (total < 0)
+			return as->next_sample_ms;
+		break;
+	}
+	resize(p, total, reporting, now);
+	return as->next_sample_ms;
+}
+
+
+void autoscale_fill_fds(struct autoscale *as, fd_set *read_fds, int *nfds)
+{
+	if (as->queue_fd < 0)
+		return;
+	FD_SET(as->queue_fd, read_fds);
+	if (as->queue_fd > *nfds)
+		*nfds = as->queue_fd;
+}
+
+
+/**
+ * Read a queue length that a socket has sent, and resize the pool to suit.
+ */
+void autoscale_handle_fds(struct pool *p, fd_set *read_fds, long long now)
+{
+	struct autoscale *as = &p->autoscale;
+	char buf[64];
+	double total;
+	ssize_t len;
+
+	if (as->queue_fd < 0 || ! FD_ISSET(as->queue_fd, read_fds))
+		return;
+	len = read(as->queue_fd, buf, sizeof(buf) - 1);
+	if (-1 == len && (errno == EAGAIN || errno == EINTR))
+		return;
+	close(as->queue_fd);
+	as->queue_fd = -1;
+	total = queue_value(as, p->name, buf, len);
+	if (total >= 0)
+		resize(p, total, 0, now);
+}
+
+
+/**
+ * Change the size of a pool, given the total of the metric over the
+ * reporting instances, or the queue length.
+ */
+static void resize(struct pool *p, double total, int reporting,
+		   long long now)
+{
+	struct autoscale *as = &p->autoscale;
+	double value;
+	double ratio;
+	int current = p->instances;
+	int wanted;
+
+	wanted = current;
+	if (as->metric == SCALE_QUEUE) {
+		value = total / (current ? current : 1);
+		wanted = ceil_positive(total / as->target);
+	} else if (reporting) {
+		value = total / reporting;
+		wanted = ceil_positive(current * value / as->target);
+	} else {
+		value = 0;
+	}
+	ratio = value / as->target;
+	if (ratio > 1 - AUTOSCALE_TOLERANCE && ratio < 1 + AUTOSCALE_TOLERANCE)
+		wanted = current;
+	if (wanted < as->min_instances)
+		wanted = as->min_instances;
+	if (wanted > as->max_instances)
+		wanted = as->max_instances;
+
+	if (wanted > current
+	    && now - as->last_scale_ms < as->up_cooldown_ms)
+		wanted = current;
+	if (wanted < current
+	    && now - as->last_scale_ms < as->down_cooldown_ms)
+		wanted = current;
+	if (wanted != current) {
+		logparent(CM_INFO, "%s: %.2f per instance, target %.2f\n",
+			  p->name, value, as->target);
+		as->last_scale_ms = now;
+		manager_scale(p->name, wanted);
+	}
+}
+
+
+static int parse_seconds(struct config *config, struct config_option *o,
+			 int *ms)
+{
+	char *endptr;
+	double secs;
+
+	secs = o->value ? strtod(o->value, &endptr) : 0;
+	if (! o->value || *endptr || secs < 0 || secs > 86400) {
+		logparent(CM_ERROR, "%s:%d: bad %s\n",
+			  config->path, o->line, o->key);
+		return -1;
+	}
+	*ms = (int)(secs * 1000);
+	return 0;
+}
+
+
+static int parse_count(struct config *config, struct config_option *o,
+		       int *n)
+{
+	char *endptr;
+
+	*n = o->value ? (int)strtol(o->value, &endptr, 10) : -1;
+	if (! o->value || *endptr || *n < 0 || *n > MANAGER_MAX_INSTANCES) {
+		logparent(CM_ERROR, "%s:%d: bad %s\n",
+			  config->path, o->line, o->key);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Read a queue length, which is a number at the start of a file.
+ *
+ * \return the length, or -1 if it can't be read.
+ */
+static double read_queue_file(struct autoscale *as, const char *name)
+{
+	char buf[64];
+	ssize_t len = -1;
+	int fd;
+
+	fd = open(as->queue + 5, O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+	}
+	return queue_value(as, name, buf, len);
+}
+
+
+/**
+ * Connect to a unix socket server that sends a queue length when we connect.
+ * The connection is made without waiting, as a unix socket connects at once
+ * or not at all, and the length is read when select() says it has arrived.
+ */
+static void start_queue_socket(struct autoscale *as, const char *name,
+			       long long now)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd >= 0) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, as->queue + 5, sizeof(sun.sun_path) - 1);
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (-1 == fd) {
+		queue_value(as, name, NULL, -1);
+		return;
+	}
+	as->queue_fd = fd;
+	as->queue_deadline_ms = now + QUEUE_TIMEOUT_MS;
+}
+
+
+/**
+ * Make sense of what was read from a queue, len bytes of buf.
+ *
+ * \return the length, or -1 if there isn't one.  Failures are logged when
+ * they start and stop, not every time.
+ */
+static double queue_value(struct autoscale *as, const char *name,
+			  char *buf, ssize_t len)
+{
+	char *endptr;
+	double value;
+
+	if (len > 0) {
+		buf[len] = '\0';
+		value = strtod(buf, &endptr);
+		if (endptr != buf && value >= 0) {
+			if (as->queue_failed)
+				logparent(CM_INFO, "%s: can read %s again\n",
+					  name, as->queue);
+			as->queue_failed = 0;
+			return value;
+		}
+	}
+	if (! as->queue_failed)
+		logparent(CM_WARN, "%s: cannot read a queue length from %s\n",
+			  name, as->queue);
+	as->queue_failed = 1;
+	return -1;
+}
+
+
+/**
+ * Round x up to an int, clamped to 0 .. INT_MAX.  A huge queue length can
+ * make x too big for an int, and converting it would be undefined.
+ */
+static int ceil_positive(double x)
+{
+	int i;
+
+	if (! (x > 0))		/* Also NaN */
+		return 0;
+	if (x >= INT_MAX)
+		return INT_MAX;
+	i = (int)x;
+	return (x > i) ? i + 1 : i;
+}
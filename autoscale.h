@@ -0,0 +1,56 @@
+/* Change the size of a pool to suit its load. */
+
+#ifndef __autoscale_h__
+#define __autoscale_h__
+
+#include <sys/select.h>
+
+struct config;
+struct config_option;
+struct pool;
+struct managed;
+
+enum scale_metric {
+	SCALE_LOAD,		/* LOAD= from the children */
+	SCALE_CPU,		/* CPU use of the children */
+	SCALE_QUEUE,		/* A queue length from a file or socket */
+};
+
+/**
+ * Autoscaling settings and state for a pool.  max_instances is 0 when the
+ * pool is not autoscaled.
+ */
+struct autoscale {
+	int min_instances;
+	int max_instances;
+	enum scale_metric metric;
+	char *queue;			/* "file:PATH" or "unix:PATH" */
+	double target;			/* Per instance */
+	int interval_ms;
+	int up_cooldown_ms;
+	int down_cooldown_ms;
+	long long next_sample_ms;
+	long long last_scale_ms;
+	int queue_failed;		/* Set while the queue can't be read */
+	/** Connected to a unix:PATH queue, waiting for it to send the
+	    length until queue_deadline_ms, or -1. */
+	int queue_fd;
+	long long queue_deadline_ms;
+};
+
+extern void autoscale_init(struct autoscale *as);
+extern int autoscale_option(struct autoscale *as, struct config *config,
+			    struct config_option *o);
+extern int autoscale_finish(struct autoscale *as, struct config *config,
+			    const char *section, int line, int *instances);
+extern void autoscale_keep_state(struct autoscale *as,
+				 const struct autoscale *old);
+extern void autoscale_free(struct autoscale *as);
+extern long long autoscale_check(struct pool *p, struct managed *list,
+				 long long now);
+extern void autoscale_fill_fds(struct autoscale *as, fd_set *read_fds,
+			       int *nfds);
+extern void autoscale_handle_fds(struct pool *p, fd_set *read_fds,
+				 long long now);
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "config.h"
+#include "log.h"
+#include "xmalloc.h"
+
+
+static char *read_file(const char *path);
+static int parse_line(struct config *config, struct config_section **section,
+		      char *line, int lineno);
+static int valid_name(const char *name);
+static void add_option(struct config *config, struct config_section *section,
+		       char *key, char *value, int line);
+static char *trim(char *s);
+
+
+/**
+ * Read and parse a configuration file.
+ *
+ * The whole file is read with one read() and parsed in place, in one pass,
+ * so even a file with thousands of sections is read in a few milliseconds.
+ * The sections and their options come from one arena, so they are freed in a
+ * few calls to free() however many there are.
+ *
+ * \return the configuration, or NULL if the file cannot be read or has an
+ * error (which has been logged).
+ */
+struct config *config_read(const char *path)
+{
+	struct config *config;
+	struct config_section *section;
+	char *line;
+	char *next;
+	int lineno;
+
+	config = xmalloc(sizeof(struct config));
+	memset(config, 0, sizeof(struct config));
+	config->path = xstrdup(path);
+	config->text = read_file(path);
+	if (! config->text) {
+		config_free(config);
+		return NULL;
+	}
+
+	section = &config->defaults;
+	config->tail = &config->sections;
+	for (line = config->text, lineno = 1; line; line = next, lineno++) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (parse_line(config, &section, line, lineno)) {
+			config_free(config);
+			return NULL;
+		}
+	}
+	return config;
+}
+
+
+void config_free(struct config *config)
+{
+	if (! config)
+		return;
+	arena_free(&config->arena);
+	free(config->text);
+	free(config->path);
+	free(config);
+}
+
+
+/**
+ * Read a whole file into a null-terminated buffer.
+ */
+static char *read_file(const char *path)
+{
+	struct stat statbuf;
+	char *text;
+	size_t len = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (-1 == fd) {
+		logparent(CM_ERROR, "cannot open %s: %s\n",
+			  path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &statbuf)) {
+		logparent(CM_ERROR, "cannot stat %s: %s\n",
+			  path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	text = xmalloc(statbuf.st_size + 1);
+	while (len < statbuf.st_size) {
+		ret = read(fd, text + len, statbuf.st_size - len);
+		if (-1 == ret && errno == EINTR)
+			continue;
+		if (-1 == ret) {
+			logparent(CM_ERROR, "cannot read %s: %s\n",
+				  path, strerror(errno));
+			free(text);
+			close(fd);
+			return NULL;
+		}
+		if (0 == ret)
+			break;
+		len += ret;
+	}
+	close(fd);
+	text[len] = '\0';
+	return text;
+}
+
+
+/**
+ * Parse one line, which is blank, a comment, "[name]", "key" or
+ * "key = value".
+ *
+ * \return 0 if the line is OK, -1 for an error (which has been logged).
+ */
+static int parse_line(struct config *config, struct config_section **section,
+		      char *line, int lineno)
+{
+	struct config_section *s;
+	char *key;
+	char *value;
+	char *p;
+
+	line = trim(line);
+	if (! *line || *line == '#')
+		return 0;
+
+	if (*line == '[') {
+		p = strchr(line, ']');
+		if (! p || p[1]) {
+			logparent(CM_ERROR, "%s:%d: bad section line: %s\n",
+				  config->path, lineno, line);
+			return -1;
+		}
+		*p = '\0';
+		line = trim(line + 1);
+		if (! valid_name(line)) {
+			logparent(CM_ERROR, "%s:%d: bad section name: %s\n",
+				  config->path, lineno, line);
+			return -1;
+		}
+		s = arena_alloc(&config->arena, sizeof(struct config_section));
+		memset(s, 0, sizeof(struct config_section));
+		s->name = line;
+		s->line = lineno;
+		*section = s;
+		*config->tail = s;
+		config->tail = &s->next;
+		config->n_sections++;
+		return 0;
+	}
+
+	key = line;
+	for (p = key; *p && *p != '=' && ! isspace((unsigned char)*p); p++)
+		;
+	value = p;
+	while (isspace((unsigned char)*value))
+		value++;
+	if (*value == '=') {
+		*p = '\0';
+		value = trim(value + 1);
+	} else if (*value) {
+		logparent(CM_ERROR, "%s:%d: expected '=' after %.*s\n",
+			  config->path, lineno, (int)(p - key), key);
+		return -1;
+	} else {
+		*p = '\0';
+		value = NULL;
+	}
+	if (! *key) {
+		logparent(CM_ERROR, "%s:%d: missing option name\n",
+			  config->path, lineno);
+		return -1;
+	}
+	add_option(config, *section, key, value, lineno);
+	return 0;
+}
+
+
+/**
+ * Section names are used in log messages, metrics and commands, so keep them
+ * simple.
+ */
+static int valid_name(const char *name)
+{
+	const char *p;
+
+	if (! *name)
+		return 0;
+	for (p = name; *p; p++) {
+		if (! isalnum((unsigned char)*p) && ! strchr("-_.@%", *p))
+			return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Add an option to a section.  The options array is in the arena, so when it
+ * is full it is copied to one twice the size, and the old one is left until
+ * the whole configuration is freed.
+ */
+static void add_option(struct config *config, struct config_section *section,
+		       char *key, char *value, int line)
+{
+	struct config_option *options;
+	struct config_option *o;
+
+	if (section->n_options == section->max_options) {
+		section->max_options = section->max_options * 2 + 8;
+		options = arena_alloc(&config->arena, section->max_options
+				      * sizeof(struct config_option));
+		if (section->n_options)
+			memcpy(options, section->options, section->n_options
+			       * sizeof(struct config_option));
+		section->options = options;
+	}
+	o = &section->options[section->n_options++];
+	o->key = key;
+	o->value = value;
+	o->line = line;
+}
+
+
+/**
+ * Remove leading and trailing white space, in place.
+ */
+static char *trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+	return s;
+}
+
+
+/**
+ * Split a command line into words, like a (very) simple shell.  Words are
+ * separated by white space, and can be quoted with '...' or "...".  A
+ * backslash outside single quotes quotes the next character.
+ *
+ * \return a NULL-terminated array of words, allocated with xmalloc() in one
+ * block, so free() frees the lot.  *n_words is set to the number of words.
+ */
+char **config_split_words(const char *s, int *n_words)
+{
+	size_t len = strlen(s);
+	char **words;
+	char *out;
+	int n = 0;
+	int in_word = 0;
+	char quote = '\0';
+
+	/* There are at most len/2+1 words, and the text gets no longer. */
+	words = xmalloc((len / 2 + 2) * sizeof(char *) + len + 1);
+	out = (char *)(words + len / 2 + 2);
+	for (; *s; s++) {
+		if (! quote && isspace((unsigned char)*s)) {
+			if (in_word) {
+				*out++ = '\0';
+				in_word = 0;
+			}
+			continue;
+		}
+		if (! in_word) {
+			words[n++] = out;
+			in_word = 1;
+		}
+		if (quote == *s) {
+			quote = '\0';
+		} else if (! quote && (*s == '\'' || *s == '"')) {
+			quote = *s;
+		} else if (*s == '\\' && quote != '\'' && s[1]) {
+			*out++ = *++s;
+		} else {
+			*out++ = *s;
+		}
+	}
+	if (in_word)
+		*out = '\0';
+	words[n] = NULL;
+	*n_words = n;
+	return words;
+}
@@ -0,0 +1,47 @@
+/* Read the configuration file. */
+
+#ifndef __config_h__
+#define __config_h__
+
+#include "arena.h"
+
+/**
+ * One "key = value" line.  value is NULL for a line with only a key.
+ */
+struct config_option {
+	char *key;
+	char *value;
+	int line;
+};
+
+/**
+ * A [name] section, or the defaults at the top of the file (name is NULL).
+ */
+struct config_section {
+	char *name;
+	int line;
+	struct config_option *options;
+	int n_options;
+	int max_options;
+	struct config_section *next;
+};
+
+/**
+ * A whole configuration file.  All the strings point into text, and the
+ * sections (apart from the defaults) and options are in arena.
+ */
+struct config {
+	char *path;
+	char *text;
+	struct arena arena;
+	struct config_section defaults;
+	struct config_section *sections;
+	struct config_section **tail;
+	int n_sections;
+};
+
+extern struct config *config_read(const char *path);
+extern void config_free(struct config *config);
+extern char **config_split_words(const char *s, int *n_words);
+
+#endif
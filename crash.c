@@ -0,0 +1,675 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "crash.h"
+#include "log.h"
+#include "proc.h"
+#include "procinfo.h"
+#include "xmalloc.h"
+
+
+/** How much of each /proc file goes in a record. */
+#define CRASH_PROC_LEN 16384
+/** Processes writing records or replies at once. */
+#define CRASH_MAX_WRITERS 4
+#define CRASH_NAME_LEN 256
+
+static int is_crash(int status, int requested);
+static void record_name(char *buf, size_t len, pid_t pid);
+static void write_record(const char *path, pid_t pid, int status,
+			 const struct rusage *ru, long long run_ms,
+			 const struct ring *output, char **args,
+			 const char *dir);
+static void describe_core(char *buf, size_t len, pid_t pid, int status,
+			  const char *dir, const char *comm);
+static void write_proc(int fd, pid_t pid, const char *name, ssize_t n,
+		       const char *text);
+static void prune(void);
+static int is_record_name(const char *name);
+static int select_record(const struct dirent *d);
+static void list_records(int fd);
+static void show_record(int fd, const char *id);
+static int open_reply(char *arg, char **rest);
+static void send_error(int fd, const char *message);
+static void set_prefix(void);
+static pid_t start_writer(void);
+
+static char *crash_dir = NULL;
+static int keep = CRASH_KEEP;
+/** Prefix of this child's record names, for select_record(). */
+static char prefix[CRASH_NAME_LEN - 64];
+
+/** What /proc showed about the child before it was reaped.  The lengths are
+    -1 when a file could not be read. */
+static pid_t snap_pid = 0;
+static char snap_status[CRASH_PROC_LEN];
+static char snap_limits[CRASH_PROC_LEN];
+static char snap_maps[CRASH_PROC_LEN];
+static ssize_t snap_status_len = -1;
+static ssize_t snap_limits_len = -1;
+static ssize_t snap_maps_len = -1;
+
+static pid_t writers[CRASH_MAX_WRITERS];
+
+
+void crash_set_dir(const char *dir)
+{
+	free(crash_dir);
+	crash_dir = xstrdup(dir);
+}
+
+
+int crash_set_keep(const char *arg)
+{
+	char *endptr;
+	long n;
+
+	n = strtol(arg, &endptr, 10);
+	if (! *arg || *endptr || n < 1)
+		return -1;
+	keep = n;
+	return 0;
+}
+
+
+/**
+ * Look at /proc for a child that has exited but not been reaped.  Its memory
+ * has gone by now, so maps is usually empty, but status and limits are still
+ * there.
+ */
+void crash_snapshot(pid_t pid)
+{
+	if (! crash_dir)
+		return;
+	snap_pid = pid;
+	snap_status_len = procinfo_read(pid, "status", snap_status,
+					sizeof(snap_status));
+	snap_limits_len = procinfo_read(pid, "limits", snap_limits,
+					sizeof(snap_limits));
+	snap_maps_len = procinfo_read(pid, "maps", snap_maps,
+				      sizeof(snap_maps));
+}
+
+
+/**
+ * Write a crash record if the child died abnormally.  The record is written
+ * by another process, so the main loop does not wait for the disk.
+ *
+ * \param requested set if we had asked the child to stop, so that SIGKILL
+ * from us is not a crash.
+ * \param dir the child's working directory, or NULL for ours.
+ */
+void crash_child_exited(pid_t pid, int status, int requested,
+			const struct rusage *ru, long long run_ms,
+			const struct ring *output, char **args,
+			const char *dir)
+{
+	char name[CRASH_NAME_LEN];
+	char path[1024];
+
+	if (! crash_dir || ! is_crash(status, requested))
+		return;
+	set_prefix();
+	record_name(name, sizeof(name), pid);
+	snprintf(path, sizeof(path), "%s/%s", crash_dir, name);
+	logparent(CM_WARN, "writing crash record %s\n", path);
+	if (start_writer())
+		return;
+	write_record(path, pid, status, ru, run_ms, output, args, dir);
+	prune();
+	_exit(0);
+}
+
+
+/**
+ * Handle the crashes and crash commands.  arg starts with the FIFO that the
+ * reply goes to, which the sender has made and opened.
+ */
+void crash_command(char c, char *arg)
+{
+	char *rest;
+	int fd;
+
+	fd = open_reply(arg, &rest);
+	if (-1 == fd)
+		return;
+	if (! crash_dir) {
+		send_error(fd, "crash records are not kept (no --crash-dir)\n");
+		return;
+	}
+	set_prefix();
+	switch (start_writer()) {
+	case -1:
+		send_error(fd, "cannot start a process to reply; try again\n");
+		return;
+	case 0:
+		break;
+	default:
+		close(fd);
+		return;
+	}
+	if (c == 'k')
+		list_records(fd);
+	else
+		show_record(fd, rest);
+	_exit(0);
+}
+
+
+/**
+ * Send message as the reply to a command that wants one.
+ */
+void crash_reply_error(char *arg, const char *message)
+{
+	char *rest;
+	int fd;
+
+	fd = open_reply(arg, &rest);
+	if (-1 == fd)
+		return;
+	send_error(fd, message);
+}
+
+
+/**
+ * Write a one-line error as the whole reply, and close the reply fd.
+ */
+static void send_error(int fd, const char *message)
+{
+	/* Short enough to fit in the pipe, so this does not block. */
+	write_all(fd, message, strlen(message));
+	close(fd);
+}
+
+
+int crash_reaped(pid_t pid, int status)
+{
+	int i;
+
+	for (i = 0; i < CRASH_MAX_WRITERS; i++) {
+		if (writers[i] == pid) {
+			writers[i] = 0;
+			if (! WIFEXITED(status) || WEXITSTATUS(status))
+				logparent(CM_WARN, "crash record writer[%d] "
+					  "failed\n", (int)pid);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Signals that mean the child crashed, rather than being stopped.  SIGKILL
+ * that we did not send is most likely the OOM killer.
+ */
+static int is_crash(int status, int requested)
+{
+	if (! WIFSIGNALED(status))
+		return 0;
+	if (WCOREDUMP(status))
+		return 1;
+	switch (WTERMSIG(status)) {
+	case SIGSEGV:
+	case SIGBUS:
+	case SIGILL:
+	case SIGFPE:
+	case SIGABRT:
+	case SIGSYS:
+	case SIGTRAP:
+	case SIGXCPU:
+	case SIGXFSZ:
+		return 1;
+	case SIGKILL:
+		return ! requested;
+	default:
+		return 0;
+	}
+}
+
+
+/**
+ * Records are named "<child>-<date>-<time>-<pid>", so they sort oldest
+ * first, and several children can share a directory.
+ */
+static void record_name(char *buf, size_t len, pid_t pid)
+{
+	char when[32];
+	time_t t;
+
+	t = time(NULL);
+	strftime(when, sizeof(when), "%Y%m%d-%H%M%S", localtime(&t));
+	snprintf(buf, len, "%s%s-%d", prefix, when, (int)pid);
+}
+
+
+/**
+ * In the writer process.  The record is written under a temporary name and
+ * renamed, so a reader never sees part of one.
+ */
+static void write_record(const char *path, pid_t pid, int status,
+			 const struct rusage *ru, long long run_ms,
+			 const struct ring *output, char **args,
+			 const char *dir)
+{
+	char tmp[1100];
+	char when[64];
+	char comm[64];
+	char core[2200];
+	char out[8192];
+	const char *p;
+	size_t n;
+	time_t t;
+	int fd;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0640);
+	if (-1 == fd) {
+		logparent(CM_WARN, "cannot open %s: %s\n", tmp,
+			  strerror(errno));
+		_exit(1);
+	}
+
+	/* The kernel's name for it, which core_pattern's %e uses. */
+	p = args[0];
+	if (strrchr(p, '/'))
+		p = strrchr(p, '/') + 1;
+	snprintf(comm, sizeof(comm), "%.15s", p);
+	if (snap_pid == pid && snap_status_len > 0
+	    && ! strncmp(snap_status, "Name:\t", 6))
+		snprintf(comm, sizeof(comm), "%.*s",
+			 (int)strcspn(snap_status + 6, "\n"), snap_status + 6);
+	describe_core(core, sizeof(core), pid, status, dir, comm);
+
+	t = time(NULL);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S %z", localtime(&t));
+	/* The first line is the summary given by the crashes command. */
+	dprintf(fd, "%s %s[%d] killed by signal %d (%s)%s\n", when,
+		get_child_log_name(), (int)pid, WTERMSIG(status),
+		strsignal(WTERMSIG(status)),
+		WCOREDUMP(status) ? ", core dumped" : "");
+	dprintf(fd, "command:");
+	for (i = 0; args[i]; i++)
+		dprintf(fd, " %s", args[i]);
+	dprintf(fd, "\nran for: %.3f seconds\n", run_ms / 1000.0);
+	dprintf(fd, "rusage: user %ld.%06lds, system %ld.%06lds, "
+		"max RSS %ld KiB, major faults %ld, minor faults %ld, "
+		"context switches %ld voluntary %ld involuntary\n",
+		(long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec,
+		(long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec,
+		ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt, ru->ru_nvcsw,
+		ru->ru_nivcsw);
+	dprintf(fd, "core: %s\n", core);
+
+	n = ring_copy(output, out, sizeof(out));
+	dprintf(fd, "\n--- last %zu bytes of output ---\n", n);
+	write_all(fd, out, n);
+	if (n && out[n - 1] != '\n')
+		write_all(fd, "\n", 1);
+
+	if (snap_pid == pid) {
+		write_proc(fd, pid, "status", snap_status_len, snap_status);
+		write_proc(fd, pid, "limits", snap_limits_len, snap_limits);
+		write_proc(fd, pid, "maps", snap_maps_len, snap_maps);
+	} else {
+		dprintf(fd, "\n--- /proc/%d was gone before it could be read "
+			"---\n", (int)pid);
+	}
+
+	if (close(fd)) {
+		logparent(CM_WARN, "cannot write %s: %s\n", tmp,
+			  strerror(errno));
+		unlink(tmp);
+		_exit(1);
+	}
+	if (rename(tmp, path)) {
+		logparent(CM_WARN, "cannot rename %s to %s: %s\n", tmp, path,
+			  strerror(errno));
+		unlink(tmp);
+		_exit(1);
+	}
+}
+
+
+/**
+ * Say where the core dump went, following /proc/sys/kernel/core_pattern.
+ */
+static void describe_core(char *buf, size_t len, pid_t pid, int status,
+			  const char *dir, const char *comm)
+{
+	char pattern[512];
+	char file[1024];
+	char cwd[512];
+	char path[2048];
+	char host[256];
+	struct stat st;
+	size_t n = 0;
+	int has_pid = 0;
+	int uses_pid = 0;
+	const char *p;
+	int fd;
+	ssize_t ret;
+
+	if (! WCOREDUMP(status)) {
+		snprintf(buf, len, "none");
+		return;
+	}
+	fd = open("/proc/sys/kernel/core_pattern", O_RDONLY|O_CLOEXEC);
+	ret = fd >= 0 ? read(fd, pattern, sizeof(pattern) - 1) : -1;
+	if (fd >= 0)
+		close(fd);
+	if (ret <= 0) {
+		snprintf(buf, len, "dumped, but core_pattern is unknown");
+		return;
+	}
+	pattern[ret] = '\0';
+	pattern[strcspn(pattern, "\n")] = '\0';
+	if (pattern[0] == '|') {
+		snprintf(buf, len, "piped to %.*s", (int)strcspn(pattern + 1, " "),
+			 pattern + 1);
+		return;
+	}
+
+	if (gethostname(host, sizeof(host)))
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = '\0';
+	for (p = pattern; *p && n < sizeof(file) - 32; p++) {
+		if (*p != '%') {
+			file[n++] = *p;
+			continue;
+		}
+		switch (*++p) {
+		case '%':
+			file[n++] = '%';
+			break;
+		case 'p':
+		case 'P':
+		case 'i':
+		case 'I':
+			n += snprintf(file + n, sizeof(file) - n, "%d",
+				      (int)pid);
+			has_pid = 1;
+			break;
+		case 's':
+			n += snprintf(file + n, sizeof(file) - n, "%d",
+				      WTERMSIG(status));
+			break;
+		case 'e':
+			n += snprintf(file + n, sizeof(file) - n, "%s", comm);
+			break;
+		case 'h':
+			n += snprintf(file + n, sizeof(file) - n, "%s", host);
+			break;
+		default:
+			/* Times, uids and so on, which we can't know
+			   exactly. */
+			snprintf(buf, len, "dumped to a file named by "
+				 "core_pattern %s", pattern);
+			return;
+		}
+		if (! *p)
+			break;
+	}
+	file[n] = '\0';
+	fd = open("/proc/sys/kernel/core_uses_pid", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		char c = '0';
+		if (read(fd, &c, 1) == 1)
+			uses_pid = c == '1';
+		close(fd);
+	}
+	if (uses_pid && ! has_pid)
+		snprintf(file + n, sizeof(file) - n, ".%d", (int)pid);
+	if (file[0] == '/') {
+		snprintf(path, sizeof(path), "%s", file);
+	} else {
+		if (! dir) {
+			if (! getcwd(cwd, sizeof(cwd)))
+				strcpy(cwd, ".");
+			dir = cwd;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, file);
+	}
+	if (stat(path, &st))
+		snprintf(buf, len, "%s (not found: %s)", path, strerror(errno));
+	else
+		snprintf(buf, len, "%s (%lld bytes)", path,
+			 (long long)st.st_size);
+}
+
+
+static void write_proc(int fd, pid_t pid, const char *name, ssize_t n,
+		       const char *text)
+{
+	if (n < 0) {
+		dprintf(fd, "\n--- /proc/%d/%s could not be read ---\n",
+			(int)pid, name);
+		return;
+	}
+	if (! n) {
+		dprintf(fd, "\n--- /proc/%d/%s was empty (the process had "
+			"already exited) ---\n", (int)pid, name);
+		return;
+	}
+	dprintf(fd, "\n--- /proc/%d/%s ---\n", (int)pid, name);
+	write_all(fd, text, n);
+}
+
+
+/**
+ * Remove this child's oldest records, so that no more than keep are left.
+ */
+static void prune(void)
+{
+	struct dirent **names;
+	char path[1024];
+	int n;
+	int i;
+
+	n = scandir(crash_dir, &names, select_record, alphasort);
+	if (n < 0)
+		return;
+	for (i = 0; i < n; i++) {
+		if (i < n - keep) {
+			snprintf(path, sizeof(path), "%s/%s", crash_dir,
+				 names[i]->d_name);
+			unlink(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+}
+
+
+/**
+ * Is name one of this child's records?  The prefix alone is not enough, as
+ * child "web" has the prefix of child "web-api", so the rest must have the
+ * shape that record_name() gives it.  Temporary files do not.
+ */
+static int is_record_name(const char *name)
+{
+	size_t len = strlen(prefix);
+	const char *shape;
+	const char *p;
+
+	if (strncmp(name, prefix, len))
+		return 0;
+	p = name + len;
+	for (shape = "NNNNNNNN-NNNNNN-N"; *shape; shape++, p++) {
+		if ('N' == *shape ? (*p < '0' || *p > '9') : *p != *shape)
+			return 0;
+	}
+	while (*p >= '0' && *p <= '9')
+		p++;
+	return ! *p;
+}
+
+
+/**
+ * For scandir(): this child's records.
+ */
+static int select_record(const struct dirent *d)
+{
+	return is_record_name(d->d_name);
+}
+
+
+/**
+ * In the writer process: send one line for each record, newest first.
+ */
+static void list_records(int fd)
+{
+	struct dirent **names;
+	char path[1024];
+	char line[512];
+	ssize_t ret;
+	int rfd;
+	int n;
+
+	n = scandir(crash_dir, &names, select_record, alphasort);
+	if (n < 0) {
+		dprintf(fd, "cannot read %s: %s\n", crash_dir,
+			strerror(errno));
+		return;
+	}
+	if (! n)
+		dprintf(fd, "no crash records for %s\n", get_child_log_name());
+	while (n--) {
+		snprintf(path, sizeof(path), "%s/%s", crash_dir,
+			 names[n]->d_name);
+		rfd = open(path, O_RDONLY|O_CLOEXEC);
+		ret = rfd >= 0 ? read(rfd, line, sizeof(line) - 1) : -1;
+		if (rfd >= 0)
+			close(rfd);
+		if (ret < 0)
+			ret = 0;
+		line[ret] = '\0';
+		line[strcspn(line, "\n")] = '\0';
+		dprintf(fd, "%s  %s\n", names[n]->d_name, line);
+		free(names[n]);
+	}
+	free(names);
+}
+
+
+/**
+ * In the writer process: send the record called id.
+ */
+static void show_record(int fd, const char *id)
+{
+	char path[1024];
+	char buf[4096];
+	ssize_t n;
+	int rfd;
+
+	if (! is_record_name(id)) {
+		dprintf(fd, "no crash record %s for %s\n", id,
+			get_child_log_name());
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s", crash_dir, id);
+	rfd = open(path, O_RDONLY|O_CLOEXEC);
+	if (-1 == rfd) {
+		dprintf(fd, "cannot open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	while ((n = read(rfd, buf, sizeof(buf))) > 0)
+		write_all(fd, buf, n);
+	close(rfd);
+}
+
+
+/**
+ * Open the reply FIFO named at the start of arg, and point *rest at what
+ * follows it.  Only a FIFO is accepted, so a command cannot be used to write
+ * over a file.
+ *
+ * \return the fd, or -1.
+ */
+static int open_reply(char *arg, char **rest)
+{
+	struct stat st;
+	char *space;
+	int fd;
+
+	space = strchr(arg, ' ');
+	if (space) {
+		*space = '\0';
+		*rest = space + 1;
+	} else {
+		*rest = arg + strlen(arg);
+	}
+	if (lstat(arg, &st) || ! S_ISFIFO(st.st_mode)) {
+		logparent(CM_WARN, "reply pipe %s is not a FIFO\n", arg);
+		return -1;
+	}
+	fd = open(arg, O_WRONLY|O_NONBLOCK|O_CLOEXEC);
+	if (-1 == fd) {
+		logparent(CM_WARN, "cannot open reply pipe %s: %s\n", arg,
+			  strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) || ! S_ISFIFO(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	/* The writer process can take its time, so let it block. */
+	fcntl(fd, F_SETFL, 0);
+	return fd;
+}
+
+
+/**
+ * The child's name, made safe for a file name.  It is not known until the
+ * options have all been read.
+ */
+static void set_prefix(void)
+{
+	if (! prefix[0])
+		get_child_file_prefix(prefix, sizeof(prefix));
+}
+
+
+/**
+ * Fork a process to write a record or a reply.
+ *
+ * \return 0 in the new process, its pid in ours, or -1 if it can't be
+ * started.
+ */
+static pid_t start_writer(void)
+{
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < CRASH_MAX_WRITERS; i++) {
+		if (! writers[i])
+			break;
+	}
+	if (i == CRASH_MAX_WRITERS) {
+		logparent(CM_WARN, "too many crash records being written\n");
+		return -1;
+	}
+	pid = fork();
+	if (-1 == pid) {
+		logparent(CM_WARN, "cannot fork to write a crash record: %s\n",
+			  strerror(errno));
+		return -1;
+	}
+	if (pid) {
+		writers[i] = pid;
+		return pid;
+	}
+	reset_child_signals();
+	return 0;
+}
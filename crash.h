@@ -0,0 +1,25 @@
+/* Write a record of each crash of the child, and send them on request. */
+
+#ifndef __crash_h__
+#define __crash_h__
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "ring.h"
+
+/** Records kept for each child, unless --crash-keep says otherwise. */
+#define CRASH_KEEP 20
+
+extern void crash_set_dir(const char *dir);
+extern int crash_set_keep(const char *arg);
+extern void crash_snapshot(pid_t pid);
+extern void crash_child_exited(pid_t pid, int status, int requested,
+			       const struct rusage *ru, long long run_ms,
+			       const struct ring *output, char **args,
+			       const char *dir);
+extern void crash_command(char c, char *arg);
+extern void crash_reply_error(char *arg, const char *message);
+extern int crash_reaped(pid_t pid, int status);
+
+#endif
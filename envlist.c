@@ -30,9 +30,10 @@ void envlist_add(struct envlist *envp, char *envvar)
 		envp->env = xmalloc(sizeof(char*)*envp->maxlen);
 
 	} else if (envp->len == envp->maxlen-2) {
-		/* Extend the existing array */
+		/* Extend the existing array, doubling it so that a long list
+		   is not copied over and over. */
 		char **new_env;
-		envp->maxlen += 10;
+		envp->maxlen *= 2;
 		new_env = xrealloc(envp->env, sizeof(char*)*envp->maxlen);
 		envp->env = new_env;
 	}
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "freeze.h"
+#include "log.h"
+#include "procinfo.h"
+
+
+static int cgroup_path(pid_t pid, char *buf, size_t len);
+static int own_cgroup(pid_t pid, char *path, size_t len);
+static int write_freeze(const char *cgroup, const char *value);
+static int signal_group(pid_t pid, int sig);
+
+
+/**
+ * Freeze a process and everything it has started.
+ *
+ * If the process is in a cgroup (v2) of its own, that is, one that does not
+ * also hold us, the whole cgroup is frozen with cgroup.freeze.  Otherwise its
+ * process group is sent SIGSTOP.  The child is a session leader, so its
+ * process group is everything it has started that has not moved to another
+ * one.
+ *
+ * \return how it was frozen, or FREEZE_NONE if it could not be (which has
+ * been logged).
+ */
+enum freeze_method freeze_process(pid_t pid)
+{
+	char cgroup[1024];
+
+	if (! own_cgroup(pid, cgroup, sizeof(cgroup))
+	    && ! write_freeze(cgroup, "1"))
+		return FREEZE_CGROUP;
+	if (! signal_group(pid, SIGSTOP))
+		return FREEZE_SIGNAL;
+	logparent(CM_WARN, "cannot stop %d: %s\n", (int)pid, strerror(errno));
+	return FREEZE_NONE;
+}
+
+
+/**
+ * Let a process go on after freeze_process().
+ *
+ * \return 0, or -1 if it could not be done (which has been logged).
+ */
+int thaw_process(pid_t pid, enum freeze_method method)
+{
+	char cgroup[1024];
+
+	switch (method) {
+	case FREEZE_NONE:
+		return 0;
+	case FREEZE_CGROUP:
+		if (! cgroup_path(pid, cgroup, sizeof(cgroup))
+		    && ! write_freeze(cgroup, "0"))
+			return 0;
+		logparent(CM_WARN, "cannot thaw the cgroup of %d\n", (int)pid);
+		return -1;
+	case FREEZE_SIGNAL:
+		if (! signal_group(pid, SIGCONT))
+			return 0;
+		logparent(CM_WARN, "cannot continue %d: %s\n",
+			  (int)pid, strerror(errno));
+		return -1;
+	}
+	return -1;
+}
+
+
+/**
+ * Find the cgroup v2 path of a process, from the "0::" line in
+ * /proc/<pid>/cgroup.
+ *
+ * \return 0, or -1 if there is no cgroup v2 path (eg on a cgroup v1 only
+ * system).
+ */
+static int cgroup_path(pid_t pid, char *buf, size_t len)
+{
+	char text[4096];
+	char *line;
+	char *end;
+
+	if (procinfo_read(pid, "cgroup", text, sizeof(text)) <= 0)
+		return -1;
+	for (line = text; line && *line; line = end) {
+		end = strchr(line, '\n');
+		if (end)
+			*end++ = '\0';
+		if (! strncmp(line, "0::", 3) && strlen(line + 3) < len) {
+			strcpy(buf, line + 3);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Get the cgroup of a process if it is safe to freeze all of it: it is not
+ * the root cgroup, and we are not in it or below it.
+ *
+ * \return 0, or -1 if the process does not have a cgroup of its own.
+ */
+static int own_cgroup(pid_t pid, char *path, size_t len)
+{
+	char ours[1024];
+	size_t n;
+
+	if (cgroup_path(pid, path, len) || cgroup_path(getpid(), ours,
+						       sizeof(ours)))
+		return -1;
+	if (! strcmp(path, "/"))
+		return -1;
+	n = strlen(path);
+	if (! strncmp(ours, path, n) && (ours[n] == '\0' || ours[n] == '/'))
+		return -1;
+	return 0;
+}
+
+
+/**
+ * Write to cgroup.freeze in a cgroup.  The kernel freezes (or thaws) the
+ * processes after the write returns, but only takes a moment.
+ */
+static int write_freeze(const char *cgroup, const char *value)
+{
+	char path[1200];
+	int fd;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s%s/cgroup.freeze",
+		 FREEZE_CGROUP_ROOT, cgroup);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return -1;
+	if (write(fd, value, strlen(value)) != (ssize_t)strlen(value))
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+
+/**
+ * Signal the process group of pid, or only pid if it has left its group.
+ */
+static int signal_group(pid_t pid, int sig)
+{
+	if (getpgid(pid) == pid && ! kill(-pid, sig))
+		return 0;
+	return kill(pid, sig);
+}
@@ -0,0 +1,20 @@
+/* Pause a process without stopping it, and let it go on again. */
+
+#ifndef __freeze_h__
+#define __freeze_h__
+
+#include <sys/types.h>
+
+/** Where the cgroup v2 hierarchy is mounted. */
+#define FREEZE_CGROUP_ROOT "/sys/fs/cgroup"
+
+enum freeze_method {
+	FREEZE_NONE,		/* Not frozen */
+	FREEZE_SIGNAL,		/* SIGSTOP to the process group */
+	FREEZE_CGROUP,		/* cgroup.freeze in its own cgroup */
+};
+
+extern enum freeze_method freeze_process(pid_t pid);
+extern int thaw_process(pid_t pid, enum freeze_method method);
+
+#endif
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE		/* For pipe2() */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "hook.h"
+#include "log.h"
+#include "mstime.h"
+#include "proc.h"
+#include "qos.h"
+#include "slab.h"
+#include "xmalloc.h"
+
+
+/** Hook runs waiting for a free slot.  More than this are dropped. */
+#define HOOK_MAX_QUEUED 32
+/** A hook that has not exited this long after SIGTERM gets SIGKILL. */
+#define HOOK_KILL_MS 5000
+#define HOOK_LINE_LEN 512
+/** Room for a run's copy of the event's environment variables. */
+#define HOOK_MAX_VARS 8
+#define HOOK_VARS_LEN 512
+
+/**
+ * A hook command from the command line.
+ */
+struct hook {
+	enum hook_event event;
+	char *command;
+	int timeout_ms;
+	struct hook *next;
+};
+
+/**
+ * One run of a hook, waiting or running.  vars are the event's environment
+ * variables, "NAME=value", NULL terminated, copied into var_data.
+ */
+struct hook_run {
+	struct hook *hook;
+	char *vars[HOOK_MAX_VARS + 1];
+	char var_data[HOOK_VARS_LEN];
+	pid_t pid;			/* -1 while it is waiting */
+	int fd;				/* Its output, or -1 */
+	long long start_ms;
+	long long term_ms;		/* When we sent SIGTERM, or 0 */
+	char line[HOOK_LINE_LEN];
+	size_t line_len;
+	struct hook_run *next;
+};
+
+static const char *event_names[HOOK_N_EVENTS] = {
+	"pre-start",
+	"post-start",
+	"exit",
+	"restart-throttled",
+	"circuit-open",
+};
+
+static int start_run(struct hook_run *r, long long now);
+static void read_output(struct hook_run *r);
+static void log_line(struct hook_run *r);
+static void free_run(struct hook_run *r);
+
+static struct hook *hooks = NULL;
+static struct hook **hooks_tail = &hooks;
+static int concurrency = HOOK_CONCURRENCY;
+/** Hooks that are running, and hooks waiting for one of them to finish, in
+    the order they were asked for. */
+static struct hook_run *running = NULL;
+static int n_running = 0;
+static struct hook_run *queue = NULL;
+static struct hook_run **queue_tail = &queue;
+static int n_queued = 0;
+/** Runs are reused, so a steady stream of events does not allocate. */
+static struct slab runs = SLAB_INIT(struct hook_run, 8);
+
+
+/**
+ * Add a hook from the command line: "event[:timeout]=command".
+ *
+ * \return 0, or -1 if it can't be parsed (which has been logged).
+ */
+int hook_add(const char *arg)
+{
+	const char *equals = strchr(arg, '=');
+	const char *colon;
+	struct hook *h;
+	char *endptr;
+	double secs = HOOK_TIMEOUT;
+	size_t len;
+	int i;
+
+	if (! equals || ! equals[1]) {
+		logparent(CM_ERROR, "hook needs event=command: %s\n", arg);
+		return -1;
+	}
+	colon = memchr(arg, ':', equals - arg);
+	len = (colon ? colon : equals) - arg;
+	if (colon) {
+		secs = strtod(colon + 1, &endptr);
+		if (endptr != equals || secs <= 0) {
+			logparent(CM_ERROR, "strange hook timeout: %s\n", arg);
+			return -1;
+		}
+	}
+	for (i = 0; i < HOOK_N_EVENTS; i++) {
+		if (strlen(event_names[i]) == len
+		    && ! strncmp(arg, event_names[i], len))
+			break;
+	}
+	if (i == HOOK_N_EVENTS) {
+		logparent(CM_ERROR, "unknown hook event: %s\n", arg);
+		return -1;
+	}
+	h = xmalloc(sizeof(struct hook));
+	h->event = i;
+	h->command = xstrdup(equals + 1);
+	h->timeout_ms = (int)(secs * 1000);
+	h->next = NULL;
+	*hooks_tail = h;
+	hooks_tail = &h->next;
+	return 0;
+}
+
+
+void hook_set_concurrency(int n)
+{
+	concurrency = n;
+}
+
+
+/**
+ * Run the hooks for an event, or queue them if too many hooks are running
+ * already.  vars is copied.
+ */
+void hook_run(enum hook_event event, char **vars)
+{
+	struct hook_run *r;
+	struct hook *h;
+	size_t used;
+	size_t len;
+	int n_vars;
+	int i;
+
+	for (h = hooks; h; h = h->next) {
+		if (h->event != event)
+			continue;
+		if (n_queued >= HOOK_MAX_QUEUED) {
+			logparent(CM_WARN, "too many hooks waiting, not running "
+				  "the %s hook\n", event_names[event]);
+			continue;
+		}
+		r = slab_alloc(&runs);
+		r->hook = h;
+		r->pid = -1;
+		r->fd = -1;
+		used = 0;
+		n_vars = 0;
+		for (i = 0; vars && vars[i]; i++) {
+			len = strlen(vars[i]) + 1;
+			if (n_vars == HOOK_MAX_VARS
+			    || used + len > HOOK_VARS_LEN) {
+				logparent(CM_WARN, "no room for %s in the "
+					  "%s hook's environment\n", vars[i],
+					  event_names[event]);
+				continue;
+			}
+			r->vars[n_vars++] = memcpy(r->var_data + used, vars[i],
+						   len);
+			used += len;
+		}
+		r->vars[n_vars] = NULL;
+		*queue_tail = r;
+		queue_tail = &r->next;
+		n_queued++;
+	}
+	hook_check(mstime_now());
+}
+
+
+void hook_fill_fds(fd_set *read_fds, int *nfds)
+{
+	struct hook_run *r;
+
+	for (r = running; r; r = r->next) {
+		if (r->fd < 0)
+			continue;
+		FD_SET(r->fd, read_fds);
+		if (r->fd > *nfds)
+			*nfds = r->fd;
+	}
+}
+
+
+void hook_handle_fds(fd_set *read_fds)
+{
+	struct hook_run *r;
+
+	for (r = running; r; r = r->next) {
+		if (r->fd >= 0 && FD_ISSET(r->fd, read_fds))
+			read_output(r);
+	}
+}
+
+
+/**
+ * Start waiting hooks while there is room, and stop hooks that have run for
+ * too long.
+ *
+ * \return the next time this wants to be called, or 0.
+ */
+long long hook_check(long long now)
+{
+	struct hook_run *r;
+	long long next = 0;
+	long long when;
+
+	while (queue && n_running < concurrency) {
+		r = queue;
+		queue = r->next;
+		if (! queue)
+			queue_tail = &queue;
+		n_queued--;
+		if (start_run(r, now)) {
+			free_run(r);
+			continue;
+		}
+		r->next = running;
+		running = r;
+		n_running++;
+	}
+	for (r = running; r; r = r->next) {
+		if (r->pid <= 0)
+			continue;
+		if (! r->term_ms) {
+			when = r->start_ms + r->hook->timeout_ms;
+			if (now >= when) {
+				logparent(CM_WARN, "%s hook[%d] timed out after "
+					  "%d seconds\n",
+					  event_names[r->hook->event],
+					  (int)r->pid,
+					  r->hook->timeout_ms / 1000);
+				kill(-r->pid, SIGTERM);
+				r->term_ms = now;
+				when = now + HOOK_KILL_MS;
+			}
+		} else {
+			when = r->term_ms + HOOK_KILL_MS;
+			if (now >= when) {
+				kill(-r->pid, SIGKILL);
+				continue;
+			}
+		}
+		if (! next || when < next)
+			next = when;
+	}
+	return next;
+}
+
+
+/**
+ * Fork and exec a hook.  It runs in its own process group, so that anything
+ * it starts can be stopped with it, and its output goes to a pipe that we log
+ * from.
+ *
+ * \return 0, or -1 if it could not be started (which has been logged).
+ */
+static int start_run(struct hook_run *r, long long now)
+{
+	int fds[2];
+	pid_t pid;
+	int fd;
+	int i;
+
+	r->start_ms = now;
+	if (pipe2(fds, O_CLOEXEC)) {
+		logparent(CM_WARN, "cannot run the %s hook: %s\n",
+			  event_names[r->hook->event], strerror(errno));
+		return -1;
+	}
+	pid = fork();
+	if (-1 == pid) {
+		logparent(CM_WARN, "cannot run the %s hook: %s\n",
+			  event_names[r->hook->event], strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid) {
+		/* As well as in the child, so that it's done before we might
+		   signal the group. */
+		setpgid(pid, pid);
+		close(fds[1]);
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		r->pid = pid;
+		r->fd = fds[0];
+		return 0;
+	}
+	/* Child */
+	setpgid(0, 0);
+	fd = open("/dev/null", O_RDONLY);
+	if (fd >= 0 && fd != 0) {
+		dup2(fd, 0);
+		close(fd);
+	}
+	dup2(fds[1], 1);
+	dup2(fds[1], 2);
+	reset_child_signals();
+	qos_child(0);
+	setenv("PM_EVENT", event_names[r->hook->event], 1);
+	for (i = 0; r->vars[i]; i++)
+		putenv(r->vars[i]);
+	execl("/bin/sh", "sh", "-c", r->hook->command, (char *)NULL);
+	_exit(127);
+}
+
+
+/**
+ * Read a hook's output and log it a line at a time, like the child's.
+ */
+static void read_output(struct hook_run *r)
+{
+	char buf[512];
+	ssize_t n;
+	ssize_t i;
+
+	while ((n = read(r->fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\n') {
+				log_line(r);
+				continue;
+			}
+			r->line[r->line_len++] = buf[i];
+			if (r->line_len == HOOK_LINE_LEN - 1)
+				log_line(r);
+		}
+	}
+	if (0 == n || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		if (r->line_len)
+			log_line(r);
+		close(r->fd);
+		r->fd = -1;
+	}
+}
+
+
+static void log_line(struct hook_run *r)
+{
+	r->line[r->line_len] = '\0';
+	if (r->line_len && r->line[r->line_len - 1] == '\r')
+		r->line[r->line_len - 1] = '\0';
+	logparent(CM_INFO, "%s hook[%d]: %s\n",
+		  event_names[r->hook->event], (int)r->pid, r->line);
+	r->line_len = 0;
+}
+
+
+/**
+ * \return 1 if pid was a hook, or 0 if not.
+ */
+int hook_reaped(pid_t pid, int status)
+{
+	struct hook_run **rp;
+	struct hook_run *r;
+
+	for (rp = &running; *rp; rp = &(*rp)->next) {
+		if ((*rp)->pid == pid)
+			break;
+	}
+	if (! *rp)
+		return 0;
+	r = *rp;
+	if (r->fd >= 0)
+		read_output(r);
+	if (WIFSIGNALED(status))
+		logparent(CM_WARN, "%s hook[%d] killed by signal %d\n",
+			  event_names[r->hook->event], (int)pid,
+			  WTERMSIG(status));
+	else if (WEXITSTATUS(status))
+		logparent(CM_WARN, "%s hook[%d] exited with status %d\n",
+			  event_names[r->hook->event], (int)pid,
+			  WEXITSTATUS(status));
+	*rp = r->next;
+	n_running--;
+	free_run(r);
+	hook_check(mstime_now());
+	return 1;
+}
+
+
+static void free_run(struct hook_run *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	slab_free(&runs, r);
+}
@@ -0,0 +1,31 @@
+/* Commands run on events in the life of the child. */
+
+#ifndef __hook_h__
+#define __hook_h__
+
+#include <sys/types.h>
+#include <sys/select.h>
+
+enum hook_event {
+	HOOK_PRE_START,
+	HOOK_POST_START,
+	HOOK_EXIT,
+	HOOK_RESTART_THROTTLED,
+	HOOK_CIRCUIT_OPEN,
+	HOOK_N_EVENTS,
+};
+
+/** Default timeout for a hook, in seconds. */
+#define HOOK_TIMEOUT 30
+/** Default for --hook-concurrency. */
+#define HOOK_CONCURRENCY 4
+
+extern int hook_add(const char *arg);
+extern void hook_set_concurrency(int n);
+extern void hook_run(enum hook_event event, char **vars);
+extern void hook_fill_fds(fd_set *read_fds, int *nfds);
+extern void hook_handle_fds(fd_set *read_fds);
+extern long long hook_check(long long now);
+extern int hook_reaped(pid_t pid, int status);
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "hostlimit.h"
+#include "log.h"
+#include "xmalloc.h"
+
+
+/** Identifies a start bucket file, and its layout. */
+#define BUCKET_MAGIC 0x706d7362	/* "pmsb" */
+/** How many times to try for the lock before giving up on it. */
+#define LOCK_TRIES 20
+
+/**
+ * The token bucket, shared by mapping the same file.  Each process-monitor
+ * adds tokens at its own rate when it looks, so they should all be given the
+ * same rate.  Times are from CLOCK_MONOTONIC, which is the same for every
+ * process on the host.
+ */
+struct bucket {
+	unsigned int magic;
+	unsigned int size;
+	double tokens;
+	long long last_ms;
+};
+
+static int open_bucket(void);
+static void bucket_failed(const char *what, int err);
+
+static char *run_dir = NULL;
+static double rate = 0;		/* Tokens per second, 0 when not limited */
+static double burst = 1;
+static int bucket_fd = -1;
+static struct bucket *bucket = NULL;
+/** Set while the bucket can't be used, so that we only complain once. */
+static int failed = 0;
+
+
+void hostlimit_set_run_dir(const char *dir)
+{
+	free(run_dir);
+	run_dir = xstrdup(dir);
+}
+
+
+const char *hostlimit_run_dir(void)
+{
+	return run_dir ? run_dir : HOSTLIMIT_RUN_DIR;
+}
+
+
+/**
+ * Set the host-wide start rate from "RATE" or "RATE:BURST".  The burst, which
+ * is how many children can start at once after a quiet time, defaults to the
+ * rate, and is at least 1.
+ *
+ * \return 0 on success, -1 if arg is not valid.
+ */
+int hostlimit_set_rate(const char *arg)
+{
+	char *endptr;
+
+	rate = strtod(arg, &endptr);
+	if (endptr == arg || rate <= 0)
+		return -1;
+	burst = rate;
+	if (*endptr == ':') {
+		arg = endptr + 1;
+		burst = strtod(arg, &endptr);
+		if (endptr == arg)
+			return -1;
+	}
+	if (*endptr)
+		return -1;
+	if (burst < 1)
+		burst = 1;
+	return 0;
+}
+
+
+/**
+ * Take a token to start a child.
+ *
+ * If the shared bucket can't be used for any reason, we go ahead without it:
+ * it is better to start a child too soon than not at all.
+ *
+ * \return 0 if the child can start now, or how many milliseconds to wait
+ * before trying again.
+ */
+long long hostlimit_take(long long now)
+{
+	long long wait = 0;
+	int tries;
+
+	if (! rate)
+		return 0;
+	if (! bucket && open_bucket())
+		return 0;
+
+	/* Don't wait for ever for a lock held by a stopped process. */
+	for (tries = 0; flock(bucket_fd, LOCK_EX|LOCK_NB); tries++) {
+		if (errno != EWOULDBLOCK || tries == LOCK_TRIES) {
+			bucket_failed("lock", errno);
+			return 0;
+		}
+		usleep(1000);
+	}
+	if (bucket->magic != BUCKET_MAGIC
+	    || bucket->size != sizeof(struct bucket)
+	    || bucket->last_ms > now) {
+		bucket->magic = BUCKET_MAGIC;
+		bucket->size = sizeof(struct bucket);
+		bucket->tokens = burst;
+		bucket->last_ms = now;
+	}
+	bucket->tokens += (now - bucket->last_ms) * rate / 1000;
+	if (bucket->tokens > burst)
+		bucket->tokens = burst;
+	bucket->last_ms = now;
+	if (bucket->tokens >= 1)
+		bucket->tokens -= 1;
+	else
+		wait = (long long)((1 - bucket->tokens) * 1000 / rate) + 1;
+	flock(bucket_fd, LOCK_UN);
+
+	if (failed) {
+		logparent(CM_INFO, "using the host start limit again\n");
+		failed = 0;
+	}
+	return wait;
+}
+
+
+/**
+ * Open and map the bucket file, making the run directory if need be.
+ *
+ * \return 0 on success, -1 on failure (which has been logged, once).
+ */
+static int open_bucket(void)
+{
+	const char *dir = hostlimit_run_dir();
+	char *path;
+	size_t len;
+	struct stat st;
+	void *p;
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		bucket_failed("mkdir", errno);
+		return -1;
+	}
+	len = strlen(dir) + 20;
+	path = xmalloc(len);
+	snprintf(path, len, "%s/start-bucket", dir);
+	bucket_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	free(path);
+	if (-1 == bucket_fd) {
+		bucket_failed("open", errno);
+		return -1;
+	}
+	if (fstat(bucket_fd, &st)
+	    || (st.st_size < sizeof(struct bucket)
+		&& ftruncate(bucket_fd, sizeof(struct bucket)))) {
+		bucket_failed("size", errno);
+		goto error;
+	}
+	p = mmap(NULL, sizeof(struct bucket), PROT_READ|PROT_WRITE, MAP_SHARED,
+		 bucket_fd, 0);
+	if (MAP_FAILED == p) {
+		bucket_failed("map", errno);
+		goto error;
+	}
+	bucket = p;
+	return 0;
+
+ error:
+	close(bucket_fd);
+	bucket_fd = -1;
+	return -1;
+}
+
+
+static void bucket_failed(const char *what, int err)
+{
+	if (! failed)
+		logparent(CM_WARN, "cannot use the host start limit in %s (%s: "
+			  "%s), not limiting starts\n",
+			  hostlimit_run_dir(), what, strerror(err));
+	failed = 1;
+}
@@ -0,0 +1,14 @@
+/* Limit the rate of child starts across all the process-monitors on a host. */
+
+#ifndef __hostlimit_h__
+#define __hostlimit_h__
+
+/** Where process-monitors keep state that they share, by default. */
+#define HOSTLIMIT_RUN_DIR "/run/process-monitor"
+
+extern void hostlimit_set_run_dir(const char *dir);
+extern const char *hostlimit_run_dir(void);
+extern int hostlimit_set_rate(const char *arg);
+extern long long hostlimit_take(long long now);
+
+#endif
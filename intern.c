@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "intern.h"
+#include "xmalloc.h"
+
+
+/** Must be a power of two.  The chains get long with more than a few times
+    this many different strings, which is plenty for the arguments of a
+    thousand children. */
+#define INTERN_BUCKETS 1024
+
+/**
+ * One shared string.  It is freed when the last holder releases it.
+ */
+struct interned {
+	struct interned *next;
+	unsigned long hash;
+	unsigned long refs;
+	char s[];
+};
+
+static unsigned long hash_string(const char *s);
+
+static struct interned *table[INTERN_BUCKETS];
+
+
+/**
+ * Get the shared copy of s, making it if this is the first.  The copy must
+ * not be changed, and is given back with intern_release() rather than
+ * free().
+ *
+ * In config mode every sub-monitor's argv repeats the same option names,
+ * values and program path, so each of those is kept once however many
+ * children use it.  Equal interned strings are also equal pointers.
+ */
+char *intern(const char *s)
+{
+	unsigned long hash = hash_string(s);
+	struct interned *i;
+	size_t len;
+
+	for (i = table[hash & (INTERN_BUCKETS - 1)]; i; i = i->next) {
+		if (i->hash == hash && ! strcmp(i->s, s)) {
+			i->refs++;
+			return i->s;
+		}
+	}
+	len = strlen(s);
+	i = xmalloc(sizeof(struct interned) + len + 1);
+	memcpy(i->s, s, len + 1);
+	i->hash = hash;
+	i->refs = 1;
+	i->next = table[hash & (INTERN_BUCKETS - 1)];
+	table[hash & (INTERN_BUCKETS - 1)] = i;
+	return i->s;
+}
+
+
+/**
+ * Take another hold on an interned string.
+ */
+char *intern_hold(char *s)
+{
+	struct interned *i;
+
+	i = (struct interned *)(s - offsetof(struct interned, s));
+	i->refs++;
+	return s;
+}
+
+
+void intern_release(char *s)
+{
+	struct interned *i;
+	struct interned **ip;
+
+	if (! s)
+		return;
+	i = (struct interned *)(s - offsetof(struct interned, s));
+	if (--i->refs)
+		return;
+	for (ip = &table[i->hash & (INTERN_BUCKETS - 1)]; *ip;
+	     ip = &(*ip)->next) {
+		if (*ip == i) {
+			*ip = i->next;
+			break;
+		}
+	}
+	free(i);
+}
+
+
+/**
+ * FNV-1a, as for hash_args() in manager.c.
+ */
+static unsigned long hash_string(const char *s)
+{
+	unsigned long hash = 2166136261UL;
+
+	for (; *s; s++) {
+		hash ^= (unsigned char)*s;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
@@ -0,0 +1,10 @@
+/* Share one copy of strings that are used many times. */
+
+#ifndef __intern_h__
+#define __intern_h__
+
+extern char *intern(const char *s);
+extern char *intern_hold(char *s);
+extern void intern_release(char *s);
+
+#endif
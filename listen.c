@@ -0,0 +1,536 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "listen.h"
+#include "log.h"
+#include "xmalloc.h"
+
+
+/** The first fd passed to the child, as in sd_listen_fds(3). */
+#define LISTEN_FDS_START 3
+
+static struct listen_socket *listen_sockets = NULL;
+static struct listen_socket **listen_sockets_tail = &listen_sockets;
+static int n_listen_sockets = 0;
+/** Set in the child, so that its exit does not remove our socket paths. */
+static int in_child = 0;
+
+static int open_tcp_socket(struct listen_socket *ls, const char *addr);
+static int open_unix_socket(struct listen_socket *ls, const char *path);
+static void unlink_unix_sockets(void);
+static int count_tcp_connections(const char *file);
+static int tcp_local_matches(const struct listen_socket *ls,
+			     const char *hex, unsigned int port);
+static int same_tcp_addr(const struct sockaddr *bound,
+			 const struct sockaddr *addr);
+static int count_unix_connections(void);
+
+
+/**
+ * Remember a socket specification from the command line.
+ *
+ * The socket is not opened until listen_open_all() is called, so that all
+ * the options have been seen first.
+ *
+ * \param spec one of "unix:PATH", "tcp:PORT", "tcp:HOST:PORT" or
+ * "tcp:[ADDR6]:PORT".  A spec without a "tcp:" or "unix:" prefix is treated as
+ * tcp.
+ */
+void listen_add(const char *spec)
+{
+	struct listen_socket *ls;
+
+	ls = xmalloc(sizeof(struct listen_socket));
+	ls->spec = xstrdup(spec);
+	ls->fd = -1;
+	ls->path = NULL;
+	memset(&ls->addr, 0, sizeof(ls->addr));
+	ls->next = NULL;
+	*listen_sockets_tail = ls;
+	listen_sockets_tail = &ls->next;
+	n_listen_sockets++;
+}
+
+
+int listen_count(void)
+{
+	return n_listen_sockets;
+}
+
+
+/**
+ * Bind and listen on all the sockets given with listen_add().
+ *
+ * This is done before we go into the background, so errors are reported on
+ * our terminal.  Any failure is fatal.
+ */
+void listen_open_all(void)
+{
+	struct listen_socket *ls;
+	int ret;
+
+	for (ls = listen_sockets; ls; ls = ls->next) {
+		if (! strncmp(ls->spec, "unix:", 5))
+			ret = open_unix_socket(ls, ls->spec + 5);
+		else if (! strncmp(ls->spec, "tcp:", 4))
+			ret = open_tcp_socket(ls, ls->spec + 4);
+		else
+			ret = open_tcp_socket(ls, ls->spec);
+		if (ret)
+			exit(1);
+		/* Only the child gets these, and only via
+		   listen_setup_child(). */
+		fcntl(ls->fd, F_SETFD, FD_CLOEXEC);
+		logparent(CM_INFO, "listening on %s (fd %d)\n",
+			  ls->spec, ls->fd);
+	}
+}
+
+
+/**
+ * Arrange for unix domain socket paths to be removed when we exit.
+ *
+ * This is separate from listen_open_all() so that it can be called after we
+ * have gone into the background.  Otherwise the parent that exits in
+ * go_daemon() would remove the paths out from under the daemon.
+ */
+void listen_unlink_at_exit(void)
+{
+	if (listen_sockets)
+		atexit(unlink_unix_sockets);
+}
+
+
+/**
+ * Open a tcp listening socket.
+ *
+ * \param addr "PORT", "HOST:PORT" or "[ADDR6]:PORT".
+ *
+ * \return 0 on success, -1 on failure (which has been logged).
+ */
+static int open_tcp_socket(struct listen_socket *ls, const char *addr)
+{
+	struct addrinfo hints;
+	struct addrinfo *res, *ai;
+	socklen_t addr_len = sizeof(ls->addr);
+	char *host = NULL;
+	char *port;
+	char *copy;
+	char *colon;
+	int gai_ret;
+	int one = 1;
+
+	copy = xstrdup(addr);
+	if (copy[0] == '[') {
+		char *close_bracket = strchr(copy, ']');
+		if (! close_bracket || close_bracket[1] != ':') {
+			logparent(CM_ERROR, "bad listen address: %s\n",
+				  ls->spec);
+			free(copy);
+			return -1;
+		}
+		*close_bracket = '\0';
+		host = copy + 1;
+		port = close_bracket + 2;
+	} else if ((colon = strrchr(copy, ':'))) {
+		*colon = '\0';
+		host = copy;
+		port = colon + 1;
+	} else {
+		port = copy;
+	}
+	if (host && ! *host)
+		host = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	gai_ret = getaddrinfo(host, port, &hints, &res);
+	if (gai_ret) {
+		logparent(CM_ERROR, "cannot resolve %s: %s\n",
+			  ls->spec, gai_strerror(gai_ret));
+		free(copy);
+		return -1;
+	}
+	free(copy);
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		ls->fd = socket(ai->ai_family, ai->ai_socktype,
+				ai->ai_protocol);
+		if (-1 == ls->fd)
+			continue;
+		setsockopt(ls->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (0 == bind(ls->fd, ai->ai_addr, ai->ai_addrlen)
+		    && 0 == listen(ls->fd, SOMAXCONN)) {
+			break;
+		}
+		close(ls->fd);
+		ls->fd = -1;
+	}
+	if (-1 == ls->fd) {
+		logparent(CM_ERROR, "cannot listen on %s: %s\n",
+			  ls->spec, strerror(errno));
+	} else if (getsockname(ls->fd, (struct sockaddr *)&ls->addr,
+			       &addr_len)) {
+		/* Then listen_connections() cannot count its connections. */
+		memset(&ls->addr, 0, sizeof(ls->addr));
+	}
+	freeaddrinfo(res);
+	return (-1 == ls->fd) ? -1 : 0;
+}
+
+
+/**
+ * Open a unix domain listening socket.
+ *
+ * If a socket (but not any other type of file) already exists at path, we
+ * assume it was left behind by a previous instance of ourselves and remove
+ * it.
+ *
+ * \return 0 on success, -1 on failure (which has been logged).
+ */
+static int open_unix_socket(struct listen_socket *ls, const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat statbuf;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		logparent(CM_ERROR, "unix socket path too long: %s\n", path);
+		return -1;
+	}
+	if (0 == stat(path, &statbuf) && S_ISSOCK(statbuf.st_mode)) {
+		unlink(path);
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	ls->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == ls->fd) {
+		logparent(CM_ERROR, "cannot make socket for %s: %s\n",
+			  ls->spec, strerror(errno));
+		return -1;
+	}
+	if (bind(ls->fd, (struct sockaddr *)&sun, sizeof(sun))
+	    || listen(ls->fd, SOMAXCONN)) {
+		logparent(CM_ERROR, "cannot listen on %s: %s\n",
+			  ls->spec, strerror(errno));
+		close(ls->fd);
+		ls->fd = -1;
+		return -1;
+	}
+	ls->path = xstrdup(path);
+	return 0;
+}
+
+
+static void unlink_unix_sockets(void)
+{
+	struct listen_socket *ls;
+
+	if (in_child)
+		return;
+	for (ls = listen_sockets; ls; ls = ls->next) {
+		if (ls->path)
+			unlink(ls->path);
+	}
+}
+
+
+/**
+ * Pass the listening sockets to the child.
+ *
+ * Called in the child after fork() and before exec().  The sockets are placed
+ * on consecutive fds starting at 3, and LISTEN_FDS and LISTEN_PID are set in
+ * the environment, which is the convention used by sd_listen_fds(3).
+ *
+ * Each socket is first copied above the target range so that moving one
+ * socket into place cannot clobber another that has not been moved yet.
+ */
+void listen_setup_child(void)
+{
+	struct listen_socket *ls;
+	int high_fds[n_listen_sockets];
+	char buf[20];
+	int i;
+
+	if (! n_listen_sockets) {
+		unsetenv("LISTEN_FDS");
+		unsetenv("LISTEN_PID");
+		return;
+	}
+
+	for (ls = listen_sockets, i = 0; ls; ls = ls->next, i++) {
+		high_fds[i] = fcntl(ls->fd, F_DUPFD,
+				    LISTEN_FDS_START + n_listen_sockets);
+		if (-1 == high_fds[i]) {
+			logparent(CM_ERROR, "cannot dup socket for %s: %s\n",
+				  ls->spec, strerror(errno));
+			exit(99);
+		}
+	}
+	for (i = 0; i < n_listen_sockets; i++) {
+		/* dup2() leaves FD_CLOEXEC clear on the new fd. */
+		if (-1 == dup2(high_fds[i], LISTEN_FDS_START + i)) {
+			logparent(CM_ERROR, "cannot dup2 socket: %s\n",
+				  strerror(errno));
+			exit(99);
+		}
+		close(high_fds[i]);
+	}
+	/* If we exit before exec(), the atexit() handler must not remove the
+	   parent's socket paths. */
+	in_child = 1;
+
+	snprintf(buf, sizeof(buf), "%d", n_listen_sockets);
+	setenv("LISTEN_FDS", buf, 1);
+	snprintf(buf, sizeof(buf), "%d", (int)getpid());
+	setenv("LISTEN_PID", buf, 1);
+}
+
+
+/**
+ * Watch the listening sockets for connections, while the child is not
+ * running to take them.
+ */
+void listen_fill_fds(fd_set *read_fds, int *nfds)
+{
+	struct listen_socket *ls;
+
+	for (ls = listen_sockets; ls; ls = ls->next) {
+		FD_SET(ls->fd, read_fds);
+		if (ls->fd > *nfds)
+			*nfds = ls->fd;
+	}
+}
+
+
+/**
+ * \return the spec of a listening socket with a connection waiting, or NULL.
+ * The connection is left for the child to accept.
+ */
+const char *listen_ready(fd_set *read_fds)
+{
+	struct listen_socket *ls;
+
+	for (ls = listen_sockets; ls; ls = ls->next) {
+		if (FD_ISSET(ls->fd, read_fds))
+			return ls->spec;
+	}
+	return NULL;
+}
+
+
+/**
+ * \return the spec of the listening socket that a connection to addr would
+ * reach, or NULL.  That socket is ours, so it accepts connections whether or
+ * not the child is running.
+ */
+const char *listen_find(const struct sockaddr *addr)
+{
+	const struct sockaddr_un *sun = (const struct sockaddr_un *)addr;
+	struct listen_socket *ls;
+
+	for (ls = listen_sockets; ls; ls = ls->next) {
+		if (addr->sa_family == AF_UNIX) {
+			if (ls->path && ! strcmp(ls->path, sun->sun_path))
+				return ls->spec;
+		} else if (same_tcp_addr((struct sockaddr *)&ls->addr, addr)) {
+			return ls->spec;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Would a connection to addr reach a socket bound to bound?  It does if the
+ * ports are the same, and bound is the same address or the wildcard address.
+ * An IPv6 wildcard socket also takes IPv4 connections.
+ */
+static int same_tcp_addr(const struct sockaddr *bound,
+			 const struct sockaddr *addr)
+{
+	const struct sockaddr_in *b4 = (const struct sockaddr_in *)bound;
+	const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)bound;
+	const struct sockaddr_in *a4 = (const struct sockaddr_in *)addr;
+	const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)addr;
+
+	if (bound->sa_family == AF_INET && addr->sa_family == AF_INET)
+		return b4->sin_port == a4->sin_port
+			&& (b4->sin_addr.s_addr == htonl(INADDR_ANY)
+			    || b4->sin_addr.s_addr == a4->sin_addr.s_addr);
+	if (bound->sa_family != AF_INET6)
+		return 0;
+	if (addr->sa_family == AF_INET)
+		return b6->sin6_port == a4->sin_port
+			&& IN6_IS_ADDR_UNSPECIFIED(&b6->sin6_addr);
+	if (addr->sa_family == AF_INET6)
+		return b6->sin6_port == a6->sin6_port
+			&& (IN6_IS_ADDR_UNSPECIFIED(&b6->sin6_addr)
+			    || IN6_ARE_ADDR_EQUAL(&b6->sin6_addr,
+						  &a6->sin6_addr));
+	return 0;
+}
+
+
+/**
+ * Count the open connections to our sockets, from /proc/net.  These are the
+ * connections that the child has accepted, and that are still open.
+ *
+ * \return the count, or -1 if it can't be found.
+ */
+int listen_connections(void)
+{
+	int tcp = 0, tcp6 = 0, unix_count = 0;
+
+	tcp = count_tcp_connections("/proc/net/tcp");
+	tcp6 = count_tcp_connections("/proc/net/tcp6");
+	unix_count = count_unix_connections();
+	if (tcp < 0 || unix_count < 0)
+		return -1;
+	return tcp + (tcp6 > 0 ? tcp6 : 0) + unix_count;
+}
+
+
+/**
+ * Count the established connections to our tcp sockets in /proc/net/tcp or
+ * /proc/net/tcp6, which have lines like
+ *
+ *   0: 0100007F:1F90 0100007F:C350 01 ...
+ *
+ * with the local address and port, the remote one, and the state.  Another
+ * program may have a socket with the same port on another address, so both
+ * must match.
+ */
+static int count_tcp_connections(const char *file)
+{
+	struct listen_socket *ls;
+	FILE *f;
+	char line[512];
+	char hex[33];
+	unsigned int port;
+	unsigned int state;
+	int n = 0;
+
+	for (ls = listen_sockets; ls; ls = ls->next) {
+		if (ls->addr.ss_family)
+			break;
+	}
+	if (! ls)
+		return 0;
+	f = fopen(file, "re");
+	if (! f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %*d: %32[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %x",
+			   hex, &port, &state) != 3 || state != 1)
+			continue;	/* Not TCP_ESTABLISHED */
+		for (ls = listen_sockets; ls; ls = ls->next) {
+			if (tcp_local_matches(ls, hex, port)) {
+				n++;
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+
+/**
+ * Is a local address and port from /proc/net/tcp or /proc/net/tcp6 one that
+ * ls accepts connections on?  The address is printed as 32 bit words in host
+ * byte order, one for IPv4 and four for IPv6.
+ */
+static int tcp_local_matches(const struct listen_socket *ls,
+			     const char *hex, unsigned int port)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)&ls->addr;
+	const struct sockaddr_in6 *sin6 =
+		(const struct sockaddr_in6 *)&ls->addr;
+	unsigned char addr[16];
+	const void *bound;
+	size_t len = strlen(hex) / 8 * 4;
+	char word[9];
+	uint32_t w;
+	size_t i;
+
+	if (ls->addr.ss_family == AF_INET) {
+		if (len != 4 || ntohs(sin->sin_port) != port)
+			return 0;
+		if (sin->sin_addr.s_addr == htonl(INADDR_ANY))
+			return 1;
+		bound = &sin->sin_addr;
+	} else if (ls->addr.ss_family == AF_INET6) {
+		/* IPv4 connections to an IPv6 socket are in tcp6 too. */
+		if (len != 16 || ntohs(sin6->sin6_port) != port)
+			return 0;
+		if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr))
+			return 1;
+		bound = &sin6->sin6_addr;
+	} else {
+		return 0;
+	}
+	for (i = 0; i < len; i += 4) {
+		memcpy(word, hex + i * 2, 8);
+		word[8] = '\0';
+		w = (uint32_t)strtoul(word, NULL, 16);
+		memcpy(addr + i, &w, 4);
+	}
+	return ! memcmp(addr, bound, len);
+}
+
+
+/**
+ * Count the connected sockets with our unix socket paths in /proc/net/unix.
+ * A socket accepted from a listening socket has the same path.
+ */
+static int count_unix_connections(void)
+{
+	struct listen_socket *ls;
+	FILE *f;
+	char line[512];
+	char *path;
+	unsigned int state;
+	int pos;
+	int n = 0;
+
+	for (ls = listen_sockets; ls; ls = ls->next) {
+		if (ls->path)
+			break;
+	}
+	if (! ls)
+		return 0;
+	f = fopen("/proc/net/unix", "re");
+	if (! f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		pos = 0;
+		if (sscanf(line, "%*s %*s %*s %*s %*s %x %*s %n",
+			   &state, &pos) != 1 || ! pos || state != 3)
+			continue;	/* Not SS_CONNECTED */
+		path = line + pos;
+		path[strcspn(path, "\n")] = '\0';
+		for (ls = listen_sockets; ls; ls = ls->next) {
+			if (ls->path && ! strcmp(ls->path, path)) {
+				n++;
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return n;
+}
@@ -0,0 +1,32 @@
+/* Listening sockets held by the monitor and passed to the child. */
+
+#ifndef __listen_h__
+#define __listen_h__
+
+#include <sys/select.h>
+#include <sys/socket.h>
+
+/**
+ * One listening socket.  The monitor binds it once at startup and keeps it
+ * open for its whole life, so connections queue in the kernel while the child
+ * is being restarted.
+ */
+struct listen_socket {
+	char *spec;			/* As given on the command line */
+	int fd;				/* Listening fd, or -1 */
+	char *path;			/* unix socket path, or NULL */
+	struct sockaddr_storage addr;	/* tcp address bound, for /proc/net */
+	struct listen_socket *next;
+};
+
+extern void listen_add(const char *spec);
+extern void listen_open_all(void);
+extern void listen_unlink_at_exit(void);
+extern int listen_count(void);
+extern void listen_setup_child(void);
+extern void listen_fill_fds(fd_set *read_fds, int *nfds);
+extern const char *listen_ready(fd_set *read_fds);
+extern const char *listen_find(const struct sockaddr *addr);
+extern int listen_connections(void);
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "log.h"
@@ -163,6 +164,45 @@ const char *get_child_log_name(void)
 }
 
 
+/**
+ * Put the child's name, made safe for a file name and followed by "-", in
+ * buf.  This is the prefix of the names of files we keep for the child.
+ */
+void get_child_file_prefix(char *buf, size_t len)
+{
+	char *p;
+
+	snprintf(buf, len - 1, "%s", child_log_name ? child_log_name : "");
+	for (p = buf; *p; p++) {
+		if (*p == '/' || *p == ' ')
+			*p = '_';
+	}
+	strcat(buf, "-");
+}
+
+
+/**
+ * Write all of buf, unless there is an error.
+ *
+ * \return 0, or -1 with errno set.
+ */
+int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (-1 == ret && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+
 void logchild(int level, char *format, ...)
 {
 	va_list va;
@@ -215,6 +255,7 @@ static void vlogmsg(int level, const char * const name,
 	if (is_daemon) {
 		int syslog_level;
 		switch (level) {
+		default:
 		case CM_INFO:  syslog_level = LOG_INFO;    break;
 		case CM_WARN:  syslog_level = LOG_WARNING; break;
 		case CM_ERROR: syslog_level = LOG_ERR;     break;
@@ -229,12 +270,8 @@ static void vlogmsg(int level, const char * const name,
 		}
 		syslog(syslog_level|LOG_DAEMON, "%s", msg);
 	} else {
-		FILE *f;
-		if (level == CM_INFO)
-			f = stdout;
-		else
-			f = stderr;
-		fprintf(f, "%s", msg);
-		fflush(f);
+		/* write() rather than stdio, so that logging never allocates
+		   stdio buffers, and each message goes out whole. */
+		write_all((level == CM_INFO) ? 1 : 2, msg, strlen(msg));
 	}
 }
@@ -19,6 +19,8 @@ const char *get_parent_log_ident(void);
 const char *get_parent_log_name(void);
 const char *get_child_log_ident(void);
 const char *get_child_log_name(void);
+void get_child_file_prefix(char *buf, size_t len);
+int write_all(int fd, const char *buf, size_t len);
 
 /**
  * Log a message from the parent process.
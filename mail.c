@@ -0,0 +1,453 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "mail.h"
+#include "mstime.h"
+#include "proc.h"
+#include "qos.h"
+#include "ring.h"
+#include "xmalloc.h"
+
+
+/** After the first restart, wait this long for more before sending. */
+#define MAIL_GATHER_MS 10000
+/** Restarts described in full in one digest.  Any more are only counted. */
+#define MAIL_MAX_EVENTS 20
+/** How much of the child's output to put in the digest for each restart. */
+#define MAIL_OUTPUT_LEN 1024
+/** How many messages can be on their way at once, including those waiting
+    to be tried again. */
+#define MAIL_MAX_SENDING 2
+#define MAIL_MAX_ATTEMPTS 5
+/** The wait before the first retry, which doubles for each one after. */
+#define MAIL_RETRY_MS 60000
+/** Kill a sendmail command that takes longer than this. */
+#define MAIL_TIMEOUT_MS 60000
+
+/**
+ * One message being sent.  The text is written to the sendmail command's
+ * standard input as it is ready for it, so a slow command does not hold up
+ * the main loop.
+ */
+struct delivery {
+	char *text;			/* NULL when this slot is free */
+	size_t len;
+	size_t sent;
+	int events;
+	int attempts;
+	pid_t pid;			/* The sendmail command, or -1 */
+	int fd;				/* Its standard input, or -1 */
+	long long start_ms;		/* When the command started */
+	long long retry_ms;		/* When to try again, or 0 */
+	int killed;
+};
+
+static void add_event(const char *format, ...)
+	__attribute__ ((format (printf, 1, 2)));
+static void add_output(const struct ring *output);
+static void send_digest(struct delivery *d, long long now);
+static void start_delivery(struct delivery *d, long long now);
+static void delivery_failed(struct delivery *d, long long now,
+			    const char *reason);
+static void free_delivery(struct delivery *d);
+
+static char *address = NULL;
+static char *command = NULL;
+static int interval_ms = MAIL_INTERVAL * 1000;
+static char *child_name = NULL;
+
+/** The digest being gathered: the text describing each restart, how many
+    restarts there have been, and when the first one was. */
+static char *digest = NULL;
+static size_t digest_len = 0;
+static size_t digest_size = 0;
+static int digest_events = 0;
+static long long digest_ms = 0;
+/** When the last digest was sent, or 0. */
+static long long last_mail_ms = 0;
+
+static struct delivery deliveries[MAIL_MAX_SENDING] = {
+	{ .pid = -1, .fd = -1 },
+	{ .pid = -1, .fd = -1 },
+};
+
+
+void mail_set_address(const char *a)
+{
+	free(address);
+	address = xstrdup(a);
+}
+
+
+void mail_set_command(const char *c)
+{
+	free(command);
+	command = xstrdup(c);
+}
+
+
+void mail_set_interval(int secs)
+{
+	interval_ms = secs * 1000;
+}
+
+
+/**
+ * Add a restart of the child to the digest.
+ *
+ * \param run_ms how long the child ran for.
+ */
+void mail_child_exited(const char *name, pid_t pid, int status,
+		       const struct rusage *ru, long long run_ms,
+		       const struct ring *output, long long now)
+{
+	char when[64];
+	time_t t;
+
+	if (! address)
+		return;
+	if (! child_name)
+		child_name = xstrdup(name);
+	if (! digest_events)
+		digest_ms = now;
+	digest_events++;
+	if (digest_events > MAIL_MAX_EVENTS)
+		return;
+
+	t = time(NULL);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	if (WIFSIGNALED(status))
+		add_event("%s  %s[%d] was killed by signal %d (%s)%s after "
+			  "%.1f seconds\n", when, name, (int)pid,
+			  WTERMSIG(status), strsignal(WTERMSIG(status)),
+			  WCOREDUMP(status) ? ", dumping core," : "",
+			  run_ms / 1000.0);
+	else
+		add_event("%s  %s[%d] exited with status %d after %.1f "
+			  "seconds\n", when, name, (int)pid,
+			  WEXITSTATUS(status), run_ms / 1000.0);
+	add_event("  user %ld.%02lds, system %ld.%02lds, max RSS %ld KiB\n",
+		  (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 10000,
+		  (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 10000,
+		  ru->ru_maxrss);
+	add_output(output);
+	add_event("\n");
+}
+
+
+static void add_event(const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1) {
+		va_start(ap, format);
+		n = vsnprintf(digest + digest_len, digest_size - digest_len,
+			      format, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (digest_len + n < digest_size)
+			break;
+		digest_size = digest_size ? digest_size * 2 : 4096;
+		if (digest_size < digest_len + n + 1)
+			digest_size = digest_len + n + 1;
+		digest = xrealloc(digest, digest_size);
+	}
+	digest_len += n;
+}
+
+
+/**
+ * Add the end of the child's output, starting at a line, indented.
+ */
+static void add_output(const struct ring *output)
+{
+	char buf[MAIL_OUTPUT_LEN + 1];
+	char *line;
+	char *next;
+	size_t n;
+
+	n = ring_copy(output, buf, MAIL_OUTPUT_LEN);
+	buf[n] = '\0';
+	line = buf;
+	if (output->len > n) {
+		line = strchr(buf, '\n');
+		line = line ? line + 1 : buf;
+	}
+	if (! *line)
+		return;
+	add_event("  last output:\n");
+	for (; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		n = strlen(line);
+		if (n && line[n - 1] == '\r')
+			line[n - 1] = '\0';
+		add_event("    %s\n", line);
+	}
+}
+
+
+void mail_fill_fds(fd_set *write_fds, int *nfds)
+{
+	int i;
+
+	for (i = 0; i < MAIL_MAX_SENDING; i++) {
+		if (deliveries[i].fd < 0)
+			continue;
+		FD_SET(deliveries[i].fd, write_fds);
+		if (deliveries[i].fd > *nfds)
+			*nfds = deliveries[i].fd;
+	}
+}
+
+
+/**
+ * Write as much of each message as the sendmail commands will take.
+ */
+void mail_handle_fds(fd_set *write_fds)
+{
+	struct delivery *d;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < MAIL_MAX_SENDING; i++) {
+		d = &deliveries[i];
+		if (d->fd < 0 || ! FD_ISSET(d->fd, write_fds))
+			continue;
+		n = send(d->fd, d->text + d->sent, d->len - d->sent,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n > 0)
+			d->sent += n;
+		if (n <= 0 || d->sent == d->len) {
+			/* Done, or the command has stopped reading.  Either
+			   way, its exit status says whether it worked. */
+			close(d->fd);
+			d->fd = -1;
+		}
+	}
+}
+
+
+/**
+ * Send the digest when it is due, try failed messages again, and time out
+ * sendmail commands that are taking too long.
+ *
+ * The digest is sent MAIL_GATHER_MS after the first restart in it, but not
+ * sooner than interval_ms after the last one, so a child that keeps failing
+ * gets one message per interval.  If MAIL_MAX_SENDING messages are already on
+ * their way, it keeps gathering until one of them has gone.
+ *
+ * \return the next time this wants to be called, or 0.
+ */
+long long mail_check(long long now)
+{
+	struct delivery *d;
+	struct delivery *free_slot = NULL;
+	long long next = 0;
+	long long due;
+	int i;
+
+	for (i = 0; i < MAIL_MAX_SENDING; i++) {
+		d = &deliveries[i];
+		if (! d->text) {
+			free_slot = d;
+			continue;
+		}
+		if (d->pid > 0) {
+			due = d->start_ms + MAIL_TIMEOUT_MS;
+			if (now >= due && ! d->killed) {
+				logparent(CM_WARN, "mail command %d took too "
+					  "long, killing it\n", (int)d->pid);
+				kill(d->pid, SIGKILL);
+				d->killed = 1;
+			} else if (! d->killed && (! next || due < next)) {
+				next = due;
+			}
+		} else if (d->retry_ms) {
+			if (now >= d->retry_ms)
+				start_delivery(d, now);
+			else if (! next || d->retry_ms < next)
+				next = d->retry_ms;
+		}
+	}
+
+	if (! digest_events)
+		return next;
+	due = digest_ms + MAIL_GATHER_MS;
+	if (last_mail_ms && last_mail_ms + interval_ms > due)
+		due = last_mail_ms + interval_ms;
+	if (now < due)
+		return (! next || due < next) ? due : next;
+	if (free_slot)
+		send_digest(free_slot, now);
+	return next;
+}
+
+
+/**
+ * Turn the digest into a message in a delivery slot, and start sending it.
+ */
+static void send_digest(struct delivery *d, long long now)
+{
+	char host[256];
+	char header[1024];
+	char more[128] = "";
+	int header_len;
+
+	if (gethostname(host, sizeof(host)))
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = '\0';
+	header_len = snprintf(header, sizeof(header),
+			      "To: %s\n"
+			      "Subject: %s on %s restarted %d time%s\n"
+			      "Auto-Submitted: auto-generated\n"
+			      "\n", address, child_name, host, digest_events,
+			      digest_events == 1 ? "" : "s");
+	if (header_len >= (int)sizeof(header))
+		header_len = sizeof(header) - 1;
+	if (digest_events > MAIL_MAX_EVENTS)
+		snprintf(more, sizeof(more), "... and %d more restarts.\n",
+			 digest_events - MAIL_MAX_EVENTS);
+
+	d->len = header_len + digest_len + strlen(more);
+	d->text = xmalloc(d->len + 1);
+	memcpy(d->text, header, header_len);
+	memcpy(d->text + header_len, digest, digest_len);
+	strcpy(d->text + header_len + digest_len, more);
+	d->events = digest_events;
+	d->attempts = 0;
+
+	digest_len = 0;
+	digest_events = 0;
+	digest_ms = 0;
+	last_mail_ms = now;
+	start_delivery(d, now);
+}
+
+
+/**
+ * Start the sendmail command for a message.
+ */
+static void start_delivery(struct delivery *d, long long now)
+{
+	int sv[2];
+	pid_t pid;
+
+	d->retry_ms = 0;
+	d->sent = 0;
+	d->killed = 0;
+	d->attempts++;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		delivery_failed(d, now, strerror(errno));
+		return;
+	}
+	pid = fork();
+	if (-1 == pid) {
+		close(sv[0]);
+		close(sv[1]);
+		delivery_failed(d, now, strerror(errno));
+		return;
+	}
+	if (pid) {
+		close(sv[1]);
+		d->pid = pid;
+		d->fd = sv[0];
+		d->start_ms = now;
+		return;
+	}
+	/* Child */
+	dup2(sv[1], 0);
+	reset_child_signals();
+	qos_child(0);
+	execl("/bin/sh", "sh", "-c", command ? command : MAIL_SENDMAIL_COMMAND,
+	      (char *)NULL);
+	_exit(127);
+}
+
+
+/**
+ * \return 1 if pid was a sendmail command, or 0 if not.
+ */
+int mail_reaped(pid_t pid, int status)
+{
+	struct delivery *d;
+	char reason[64];
+	int i;
+
+	for (i = 0; i < MAIL_MAX_SENDING; i++) {
+		d = &deliveries[i];
+		if (d->pid == pid)
+			break;
+	}
+	if (i == MAIL_MAX_SENDING)
+		return 0;
+	d->pid = -1;
+	if (d->fd >= 0) {
+		close(d->fd);
+		d->fd = -1;
+	}
+	if (WIFEXITED(status) && ! WEXITSTATUS(status)
+	    && d->sent == d->len) {
+		logparent(CM_INFO, "sent mail about %d restart%s to %s\n",
+			  d->events, d->events == 1 ? "" : "s", address);
+		free_delivery(d);
+		return 1;
+	}
+	if (WIFSIGNALED(status))
+		snprintf(reason, sizeof(reason), "killed by signal %d",
+			 WTERMSIG(status));
+	else if (WEXITSTATUS(status))
+		snprintf(reason, sizeof(reason), "exit status %d",
+			 WEXITSTATUS(status));
+	else
+		snprintf(reason, sizeof(reason), "message not read");
+	delivery_failed(d, mstime_now(), reason);
+	return 1;
+}
+
+
+/**
+ * Arrange to try a message again later, with the wait doubling each time, or
+ * give up on it after MAIL_MAX_ATTEMPTS.
+ */
+static void delivery_failed(struct delivery *d, long long now,
+			    const char *reason)
+{
+	long long wait_ms;
+
+	if (d->attempts >= MAIL_MAX_ATTEMPTS) {
+		logparent(CM_WARN, "cannot send mail to %s (%s), giving up "
+			  "after %d tries\n", address, reason, d->attempts);
+		free_delivery(d);
+		return;
+	}
+	wait_ms = (long long)MAIL_RETRY_MS << (d->attempts - 1);
+	logparent(CM_WARN, "cannot send mail to %s (%s), trying again in "
+		  "%lld seconds\n", address, reason, wait_ms / 1000);
+	d->retry_ms = now + wait_ms;
+}
+
+
+static void free_delivery(struct delivery *d)
+{
+	free(d->text);
+	d->text = NULL;
+	d->retry_ms = 0;
+	d->attempts = 0;
+}
@@ -0,0 +1,29 @@
+/* Email about child restarts, in digests, through a sendmail command. */
+
+#ifndef __mail_h__
+#define __mail_h__
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+
+struct ring;
+
+/** Used when there is no --sendmail-command.  -t takes the recipient from
+    the To: header, and -oi stops a line with only "." ending the message. */
+#define MAIL_SENDMAIL_COMMAND "/usr/sbin/sendmail -t -oi"
+/** Default for --email-interval, in seconds. */
+#define MAIL_INTERVAL 300
+
+extern void mail_set_address(const char *address);
+extern void mail_set_command(const char *command);
+extern void mail_set_interval(int secs);
+extern void mail_child_exited(const char *name, pid_t pid, int status,
+			      const struct rusage *ru, long long run_ms,
+			      const struct ring *output, long long now);
+extern void mail_fill_fds(fd_set *write_fds, int *nfds);
+extern void mail_handle_fds(fd_set *write_fds);
+extern long long mail_check(long long now);
+extern int mail_reaped(pid_t pid, int status);
+
+#endif
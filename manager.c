@@ -0,0 +1,1770 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "manager.h"
+#include "config.h"
+#include "intern.h"
+#include "is_daemon.h"
+#include "log.h"
+#include "mstime.h"
+#include "notify.h"
+#include "qos.h"
+#include "xmalloc.h"
+
+
+/** Seconds a sub-monitor has to stop its child and exit before SIGKILL.  The
+    sub-monitor itself gives its child six seconds. */
+#define MANAGER_KILL_TIME 10
+/** Longest wait before restarting a sub-monitor that keeps exiting. */
+#define MANAGER_MAX_RESTART_DELAY 60
+/** Where the sub-monitor's mode goes in its argv, filled in at fork time. */
+#define MANAGED_MODE_ARG 2
+/** Default time for each restarted instance to become ready. */
+#define ROLLOUT_READY_TIMEOUT 60
+/** How long a child counts as starting, for max-starting, if it never says
+    that it is ready. */
+#define MANAGER_START_TIMEOUT 60
+
+static struct managed *managed_list = NULL;
+static struct pool *pools = NULL;
+static char *config_path = NULL;
+static const struct option *pm_options = NULL;
+static const char *pm_program = "process-monitor";
+/** Set when we are stopping everything to exit. */
+static int stopping_all = 0;
+/** The sub-monitors tell us about their children on this socket. */
+static int notify_fd = -1;
+static char notify_name[NOTIFY_NAME_LEN];
+
+/** Options that make no sense in a configuration file section. */
+static const char *forbidden_options[] = {
+	"command", "config", "daemon", "help", "managed", "version", NULL
+};
+
+static int build_children(struct config *config, struct managed **list,
+			  struct pool **pools, struct pool *old_pools,
+			  struct start_limits *limits);
+static int start_limit_option(struct start_limits *limits,
+			      struct config *config, struct config_option *o);
+static char **build_args(struct config *config,
+			 struct config_section *section, int *instances,
+			 struct autoscale *as, struct rollout *ro,
+			 char **after, int *priority);
+static int rollout_option(struct rollout *ro, struct config *config,
+			  struct config_option *o);
+static int has_option(struct config_section *section, const char *key);
+static char **split_after(const char *after);
+static int check_after(struct config *config, struct managed *list,
+		       struct pool *pools);
+static int after_loop(struct managed *m, struct managed *list,
+		      struct managed **index, size_t index_size,
+		      struct pool *pools);
+static struct pool *find_pool(struct pool *pools, const char *name);
+static char *pool_instance_name(const char *section_name);
+static struct managed *new_managed(const char *name, char **argv);
+static struct managed *new_instance(struct pool *p, int index);
+static char *subst_index(const char *s, int index);
+static void free_pools(struct pool *p);
+static int add_option_args(struct config *config,
+			   struct config_option *o, char ***argv, int *argc,
+			   int *max_argc);
+static void add_arg(char ***argv, int *argc, int *max_argc, char *arg);
+static unsigned long long hash_args(char **argv);
+static int same_args(char **a, char **b);
+static struct managed **make_index(struct managed *list, size_t *size);
+static struct managed *find_in_index(struct managed **index, size_t size,
+				     const char *name);
+static void start_managed(struct managed *m);
+static void start_or_hold(struct managed *m);
+static void start_held(void);
+static int after_ready(struct managed *m, struct managed **index,
+		       size_t index_size);
+static long long grant_starts(long long now);
+static void stop_managed(struct managed *m, long long now);
+static void free_managed(struct managed *m);
+static void start_replacements(struct managed *old);
+static void stop_replaced(struct managed *m, long long now);
+static long long rollout_check(struct pool *p, long long now);
+static void rollout_abort(struct pool *p, struct managed *failed,
+			  const char *why);
+static struct managed *find_by_pid(pid_t pid);
+
+
+/**
+ * Tell the manager what options a sub-monitor accepts, so that the
+ * configuration file can be checked before any children are started.
+ *
+ * \param program the name we were run as, used as argv[0] for the
+ * sub-monitors.
+ */
+void manager_set_options(const struct option *options, const char *program)
+{
+	pm_options = options;
+	pm_program = program;
+}
+
+
+/**
+ * Read the configuration file for the first time.
+ *
+ * \return 0 on success, -1 if the file has an error (which has been logged).
+ */
+int manager_load(const char *path)
+{
+	struct config *config;
+	struct start_limits limits;
+	int ret;
+
+	config_path = xstrdup(path);
+	config = config_read(path);
+	if (! config)
+		return -1;
+	ret = build_children(config, &managed_list, &pools, NULL, &limits);
+	config_free(config);
+	if (! ret)
+		startq_set_limits(&limits);
+	return ret;
+}
+
+
+/**
+ * Start all the children.
+ */
+void manager_start(void)
+{
+	struct managed *m;
+
+	notify_fd = notify_open(notify_name, sizeof(notify_name));
+	for (m = managed_list; m; m = m->next)
+		start_or_hold(m);
+	start_held();
+}
+
+
+/**
+ * Read the configuration file again, and make the running children match it.
+ *
+ * Children whose sub-monitor arguments are exactly the same as before are
+ * left alone.  Changed children are stopped and started again with the new
+ * arguments, new ones are started, and ones that have gone are stopped.  If
+ * the new file has an error, nothing changes.
+ *
+ * Changed instances of a pool with max-unavailable are not stopped here, but
+ * left for rollout_check() to restart a few at a time.
+ */
+void manager_reload(void)
+{
+	struct config *config;
+	struct managed *new_list = NULL;
+	struct pool *new_pools = NULL;
+	struct managed *list = NULL;
+	struct managed **tail = &list;
+	struct managed **index;
+	struct managed **old;
+	struct managed *n, *o, *next;
+	struct pool *p;
+	struct start_limits limits;
+	size_t index_size;
+	size_t n_old = 0;
+	size_t i;
+	long long now = mstime_now();
+	int added = 0, changed = 0, removed = 0, unchanged = 0;
+
+	if (stopping_all)
+		return;
+	logparent(CM_INFO, "reloading %s\n", config_path);
+	config = config_read(config_path);
+	if (! config) {
+		logparent(CM_ERROR, "keeping the old configuration\n");
+		return;
+	}
+	if (build_children(config, &new_list, &new_pools, pools, &limits)) {
+		config_free(config);
+		logparent(CM_ERROR, "keeping the old configuration\n");
+		return;
+	}
+	config_free(config);
+	startq_set_limits(&limits);
+
+	/* The old list is relinked as we go, so keep it in an array. */
+	for (o = managed_list; o; o = o->next)
+		n_old++;
+	old = xmalloc((n_old + 1) * sizeof(struct managed *));
+	for (o = managed_list, i = 0; o; o = o->next, i++) {
+		o->seen = 0;
+		old[i] = o;
+	}
+	index = make_index(managed_list, &index_size);
+
+	/* The new list is in the order of the new file, with the old entries
+	   kept where they have not changed. */
+	for (n = new_list; n; n = next) {
+		next = n->next;
+		n->next = NULL;
+		o = find_in_index(index, index_size, n->name);
+		if (o && o->hash == n->hash && same_args(o->argv, n->argv)) {
+			o->seen = 1;
+			o->pool = n->pool;
+			o->index = n->index;
+			free(o->after);
+			o->after = n->after;
+			n->after = NULL;
+			if (o->priority != n->priority && o->queue_pos) {
+				startq_remove(o);
+				o->priority = n->priority;
+				startq_add(o);
+			}
+			o->priority = n->priority;
+			free_managed(n);
+			*tail = o;
+			tail = &o->next;
+			unchanged++;
+			continue;
+		}
+		if (o) {
+			o->seen = 1;
+			o->removed = 1;
+			changed++;
+			if (o->pid > 0) {
+				n->replaces = o;
+				if (n->pool && n->pool->rollout.max_unavailable) {
+					n->rolling = ROLL_WAITING;
+					o->keep_running = 1;
+				}
+			} else {
+				/* Take over whatever o was waiting for. */
+				n->replaces = o->replaces;
+				n->rolling = o->rolling;
+				n->roll_ms = o->roll_ms;
+				n->child_starts = o->child_starts;
+				o->replaces = NULL;
+			}
+		} else {
+			/* It may have been removed by an earlier reload and
+			   still be exiting. */
+			for (i = 0; i < n_old; i++) {
+				if (old[i]->removed && old[i]->pid > 0
+				    && ! strcmp(old[i]->name, n->name))
+					n->replaces = old[i];
+			}
+			added++;
+		}
+		*tail = n;
+		tail = &n->next;
+	}
+	free(index);
+
+	/* Anything left from the old list is either removed from the file, or
+	   replaced by a changed entry, or still exiting after an earlier
+	   reload. */
+	for (i = 0; i < n_old; i++) {
+		o = old[i];
+		if (o->seen && ! o->removed)
+			continue;	/* Already in the new list */
+		if (! o->seen && ! o->removed)
+			removed++;
+		o->removed = 1;
+		o->pool = NULL;
+		if (o->pid > 0) {
+			o->next = NULL;
+			*tail = o;
+			tail = &o->next;
+			if (! o->keep_running)
+				stop_managed(o, now);
+		} else {
+			stop_replaced(o, now);
+			free_managed(o);
+		}
+	}
+	free(old);
+	managed_list = list;
+	free_pools(pools);
+	pools = new_pools;
+
+	for (n = managed_list; n; n = n->next) {
+		p = n->pool;
+		if (n->removed || n->rolling != ROLL_WAITING
+		    || p->rollout.active)
+			continue;
+		p->rollout.active = 1;
+		p->rollout.batch_size = p->rollout.max_unavailable;
+		logparent(CM_INFO, "rolling restart of %s, %d at a time\n",
+			  p->name, p->rollout.batch_size);
+	}
+
+	logparent(CM_INFO, "%s: %d added, %d changed, %d removed, "
+		  "%d unchanged\n",
+		  config_path, added, changed, removed, unchanged);
+	for (n = managed_list; n; n = n->next) {
+		if (! n->removed && n->pid <= 0 && ! n->replaces
+		    && ! n->restart_ms && ! n->held)
+			start_or_hold(n);
+	}
+	start_held();
+}
+
+
+/**
+ * Ask all the sub-monitors to stop their children and exit.
+ */
+void manager_stop_all(void)
+{
+	struct managed *m;
+	long long now = mstime_now();
+
+	stopping_all = 1;
+	for (m = managed_list; m; m = m->next) {
+		m->restart_ms = 0;
+		stop_managed(m, now);
+	}
+}
+
+
+/**
+ * Change the number of instances of a pool.
+ *
+ * New instances are all started at once.  Instances with the highest numbers
+ * are stopped first, and each one is given the usual time to stop its child.
+ *
+ * \return 0 on success, or -1 if there is no such pool.
+ */
+int manager_scale(const char *name, int count)
+{
+	struct pool *p;
+	struct managed **mp;
+	struct managed **insert = NULL;
+	struct managed *m;
+	struct managed *other;
+	long long now = mstime_now();
+	int i;
+
+	for (p = pools; p; p = p->next) {
+		if (! strcmp(p->name, name))
+			break;
+	}
+	if (! p) {
+		logparent(CM_WARN, "no pool called %s\n", name);
+		return -1;
+	}
+	if (stopping_all)
+		return 0;
+	if (count < 0 || count > MANAGER_MAX_INSTANCES) {
+		logparent(CM_WARN, "cannot scale %s to %d\n", name, count);
+		return -1;
+	}
+	if (count == p->instances)
+		return 0;
+	logparent(CM_INFO, "scaling %s from %d to %d\n",
+		  name, p->instances, count);
+	p->autoscale.last_scale_ms = now;
+
+	if (count < p->instances) {
+		mp = &managed_list;
+		while (*mp) {
+			m = *mp;
+			if (m->pool != p || m->index < count) {
+				mp = &m->next;
+				continue;
+			}
+			m->pool = NULL;
+			m->removed = 1;
+			if (m->pid > 0) {
+				stop_managed(m, now);
+				mp = &m->next;
+			} else {
+				*mp = m->next;
+				stop_replaced(m, now);
+				free_managed(m);
+			}
+		}
+		p->instances = count;
+		return 0;
+	}
+
+	/* Keep the new instances next to the old ones. */
+	for (mp = &managed_list; *mp; mp = &(*mp)->next) {
+		if ((*mp)->pool == p)
+			insert = &(*mp)->next;
+	}
+	if (! insert)
+		insert = mp;
+	for (i = p->instances; i < count; i++) {
+		m = new_instance(p, i);
+		for (other = managed_list; other; other = other->next) {
+			if (! strcmp(other->name, m->name)) {
+				if (! other->removed)
+					break;
+				if (other->pid > 0)
+					m->replaces = other;
+			}
+		}
+		if (other) {
+			logparent(CM_WARN, "cannot scale %s past %d: "
+				  "there is already a %s\n",
+				  name, i, m->name);
+			free_managed(m);
+			break;
+		}
+		m->next = *insert;
+		*insert = m;
+		insert = &m->next;
+		if (! m->replaces)
+			start_or_hold(m);
+	}
+	p->instances = i;
+	start_held();
+	return 0;
+}
+
+
+/**
+ * Restart all the instances of a pool a few at a time, with the arguments from
+ * the configuration file.
+ *
+ * \param max_unavailable how many to restart at once, or 0 to use the pool's
+ * max-unavailable (or 1 if it has none).
+ *
+ * \return 0 on success, or -1 if there is no such pool or it is already
+ * having a rolling restart.
+ */
+int manager_rolling_restart(const char *name, int max_unavailable)
+{
+	struct pool *p;
+	struct managed *m;
+	struct managed *n;
+	int count = 0;
+
+	for (p = pools; p; p = p->next) {
+		if (! strcmp(p->name, name))
+			break;
+	}
+	if (! p) {
+		logparent(CM_WARN, "no pool called %s\n", name);
+		return -1;
+	}
+	if (stopping_all)
+		return 0;
+	if (p->rollout.active) {
+		logparent(CM_WARN, "%s is already having a rolling restart\n",
+			  name);
+		return -1;
+	}
+
+	/* Each running instance is replaced by a new one with the same
+	   index, which waits for rollout_check() to stop the old one. */
+	for (m = managed_list; m; m = m->next) {
+		if (m->pool != p || m->removed || m->pid <= 0)
+			continue;
+		n = new_instance(p, m->index);
+		n->replaces = m;
+		n->rolling = ROLL_WAITING;
+		m->removed = 1;
+		m->keep_running = 1;
+		m->pool = NULL;
+		n->next = m->next;
+		m->next = n;
+		m = n;
+		count++;
+	}
+	if (! max_unavailable)
+		max_unavailable = p->rollout.max_unavailable;
+	if (! max_unavailable)
+		max_unavailable = 1;
+	p->rollout.active = count > 0;
+	p->rollout.batch_size = max_unavailable;
+	logparent(CM_INFO, "rolling restart of %s: %d instances, %d at a "
+		  "time\n", name, count, max_unavailable);
+	return 0;
+}
+
+
+/**
+ * Add the notify socket to the fds for select().
+ */
+void manager_fill_fds(fd_set *read_fds, int *nfds)
+{
+	struct pool *p;
+
+	for (p = pools; p && ! stopping_all; p = p->next)
+		autoscale_fill_fds(&p->autoscale, read_fds, nfds);
+	if (notify_fd < 0)
+		return;
+	FD_SET(notify_fd, read_fds);
+	if (notify_fd > *nfds)
+		*nfds = notify_fd;
+}
+
+
+/**
+ * Read what the sub-monitors have told us about their children, and queue
+ * lengths for autoscaling.
+ */
+void manager_handle_fds(fd_set *read_fds)
+{
+	struct notify_msg msg;
+	struct managed *m;
+	struct pool *p;
+	int ret;
+
+	for (p = pools; p && ! stopping_all; p = p->next)
+		autoscale_handle_fds(p, read_fds, mstime_now());
+	if (notify_fd < 0 || ! FD_ISSET(notify_fd, read_fds))
+		return;
+	while ((ret = notify_recv(notify_fd, getuid(), &msg)) >= 0) {
+		if (! ret)
+			continue;
+		m = find_by_pid(msg.pid);
+		if (! m)
+			continue;
+		if (msg.has_child_pid && msg.child_pid != m->child_pid) {
+			if (msg.child_pid > 0)
+				m->child_starts++;
+			else
+				m->starting = 0;
+			m->child_pid = msg.child_pid;
+			m->ready = 0;
+			m->has_load = 0;
+			m->cpu_ticks = -1;
+		}
+		if (msg.ready) {
+			m->ready = 1;
+			m->starting = 0;
+		}
+		if (msg.want_start && ! stopping_all) {
+			m->start_addr = msg.from;
+			m->start_addr_len = msg.from_len;
+			startq_add(m);
+		}
+		if (msg.has_load) {
+			m->load = msg.load;
+			m->has_load = 1;
+		}
+	}
+}
+
+
+/**
+ * \return the number of sub-monitors that are running.
+ */
+int manager_running(void)
+{
+	struct managed *m;
+	int n = 0;
+
+	for (m = managed_list; m; m = m->next) {
+		if (m->pid > 0)
+			n++;
+	}
+	return n;
+}
+
+
+/**
+ * Called for every process that exits.
+ *
+ * \return 1 if pid was one of our sub-monitors, 0 if not.
+ */
+int manager_reaped(pid_t pid, int status)
+{
+	struct managed *m;
+	struct managed **mp;
+	long long now;
+
+	for (mp = &managed_list; *mp; mp = &(*mp)->next) {
+		if ((*mp)->pid == pid)
+			break;
+	}
+	m = *mp;
+	if (! m)
+		return 0;
+
+	now = mstime_now();
+	m->pid = -1;
+	m->starting = 0;
+	startq_remove(m);
+	if (m->removed) {
+		*mp = m->next;
+		start_replacements(m);
+		free_managed(m);
+		return 1;
+	}
+	if (stopping_all)
+		return 1;
+
+	if (WIFSIGNALED(status))
+		logparent(CM_WARN, "monitor for %s exited due to signal %d\n",
+			  m->name, WTERMSIG(status));
+	else
+		logparent(CM_WARN, "monitor for %s exited with status %d\n",
+			  m->name, WEXITSTATUS(status));
+	/* Back off if it keeps exiting, but not after a good run. */
+	if (now - m->start_ms > MANAGER_MAX_RESTART_DELAY * 1000LL)
+		m->restart_delay = 1;
+	logparent(CM_INFO, "restarting monitor for %s in %d seconds\n",
+		  m->name, m->restart_delay);
+	m->restart_ms = now + m->restart_delay * 1000LL;
+	m->restart_delay *= 2;
+	if (m->restart_delay > MANAGER_MAX_RESTART_DELAY)
+		m->restart_delay = MANAGER_MAX_RESTART_DELAY;
+	return 1;
+}
+
+
+/**
+ * Restart sub-monitors that are due, and kill ones that have not exited in
+ * time.
+ *
+ * \return the next time there is anything to do, or 0.
+ */
+long long manager_check(long long now)
+{
+	struct managed *m;
+	struct pool *p;
+	long long next = 0;
+	long long when;
+
+	for (m = managed_list; m; m = m->next) {
+		when = 0;
+		if (m->restart_ms) {
+			if (now >= m->restart_ms)
+				start_managed(m);
+			else
+				when = m->restart_ms;
+		} else if (m->pid > 0 && m->term_ms && ! m->killed) {
+			when = m->term_ms + MANAGER_KILL_TIME * 1000LL;
+			if (now >= when) {
+				logparent(CM_WARN, "killing monitor for %s[%d]\n",
+					  m->name, (int)m->pid);
+				kill(m->pid, SIGKILL);
+				m->killed = 1;
+				when = 0;
+			}
+		}
+		if (when && (! next || when < next))
+			next = when;
+	}
+	start_held();
+	when = grant_starts(now);
+	if (when && (! next || when < next))
+		next = when;
+	for (p = pools; p && ! stopping_all; p = p->next) {
+		when = autoscale_check(p, managed_list, now);
+		if (when && (! next || when < next))
+			next = when;
+		when = rollout_check(p, now);
+		if (when && (! next || when < next))
+			next = when;
+	}
+	return next;
+}
+
+
+/**
+ * Make the list of children described by a configuration file.
+ *
+ * \param old_pools the pools from the previous load, or NULL.  A pool keeps
+ * the number of instances it was scaled to at run time, unless the number in
+ * the file has changed.
+ * \param limits filled in with the limits on starting children.
+ *
+ * \return 0 on success, or -1 if there was an error (which has been logged).
+ */
+static int build_children(struct config *config, struct managed **list,
+			  struct pool **pools, struct pool *old_pools,
+			  struct start_limits *limits)
+{
+	struct config_section *section;
+	struct managed **index;
+	struct managed *m;
+	struct managed **tail = list;
+	struct pool **pool_tail = pools;
+	struct pool *p;
+	struct pool *old;
+	size_t index_size;
+	char **argv;
+	int instances;
+	struct autoscale as;
+	struct rollout ro;
+	char *after;
+	int priority;
+	int ret = 0;
+	int i;
+
+	*list = NULL;
+	*pools = NULL;
+	memset(limits, 0, sizeof(struct start_limits));
+	for (i = 0; i < config->defaults.n_options; i++) {
+		if (start_limit_option(limits, config,
+				       &config->defaults.options[i]) < 0)
+			return -1;
+	}
+	for (section = config->sections; section; section = section->next) {
+		instances = -1;
+		autoscale_init(&as);
+		memset(&ro, 0, sizeof(ro));
+		ro.wait_ready = 1;
+		ro.ready_timeout_ms = ROLLOUT_READY_TIMEOUT * 1000;
+		after = NULL;
+		priority = 0;
+		argv = build_args(config, section, &instances, &as, &ro,
+				  &after, &priority);
+		if (! argv) {
+			autoscale_free(&as);
+			ret = -1;
+			break;
+		}
+		if (instances < 0 && ! strstr(section->name, "%i")) {
+			*tail = new_managed(section->name, argv);
+			if (after)
+				(*tail)->after = split_after(after);
+			(*tail)->priority = priority;
+			free(after);
+			tail = &(*tail)->next;
+			continue;
+		}
+
+		p = xmalloc(sizeof(struct pool));
+		memset(p, 0, sizeof(struct pool));
+		p->name = xstrdup(section->name);
+		p->instance_name = pool_instance_name(section->name);
+		p->argv = argv;
+		p->autoscale = as;
+		p->rollout = ro;
+		p->after = after;
+		p->priority = priority;
+		p->config_instances = instances < 0 ? 1 : instances;
+		p->instances = p->config_instances;
+		for (old = old_pools; old; old = old->next) {
+			if (strcmp(old->name, p->name))
+				continue;
+			autoscale_keep_state(&p->autoscale, &old->autoscale);
+			p->rollout.active = old->rollout.active;
+			p->rollout.batch_size = old->rollout.batch_size;
+			if (old->config_instances == p->config_instances)
+				p->instances = old->instances;
+		}
+		if (as.max_instances && p->instances > as.max_instances)
+			p->instances = as.max_instances;
+		if (as.max_instances && p->instances < as.min_instances)
+			p->instances = as.min_instances;
+		*pool_tail = p;
+		pool_tail = &p->next;
+		for (i = 0; i < p->instances; i++) {
+			*tail = new_instance(p, i);
+			tail = &(*tail)->next;
+		}
+	}
+	if (! ret && ! config->n_sections) {
+		logparent(CM_ERROR, "%s: no children\n", config->path);
+		ret = -1;
+	}
+
+	/* Check for duplicate names.  make_index() keeps the first of each
+	   name, so anything it can't find is a duplicate. */
+	if (! ret) {
+		index = make_index(*list, &index_size);
+		for (m = *list; m; m = m->next) {
+			if (find_in_index(index, index_size, m->name) != m) {
+				logparent(CM_ERROR, "%s: duplicate child %s\n",
+					  config->path, m->name);
+				ret = -1;
+				break;
+			}
+		}
+		free(index);
+	}
+	if (! ret)
+		ret = check_after(config, *list, *pools);
+
+	if (ret) {
+		while (*list) {
+			m = *list;
+			*list = m->next;
+			free_managed(m);
+		}
+		free_pools(*pools);
+		*pools = NULL;
+	}
+	return ret;
+}
+
+
+/**
+ * Make the sub-monitor arguments for one section.  The defaults from the top
+ * of the file come first, so the section can override them.
+ *
+ * \param instances set to the value of "instances" if the section has it, or
+ * the number of instances to start with for an autoscaled pool.
+ * \param as filled in with the autoscaling settings.
+ * \param ro filled in with the rolling restart settings.
+ * \param after set to a copy of the "after" line, if there is one.
+ * \param priority set to the start-priority.
+ *
+ * \return the arguments, or NULL if the section has an error (which has been
+ * logged).
+ */
+static char **build_args(struct config *config,
+			 struct config_section *section, int *instances,
+			 struct autoscale *as, struct rollout *ro,
+			 char **after, int *priority)
+{
+	char **argv = NULL;
+	int argc = 0;
+	int max_argc = 0;
+	const char *exec = NULL;
+	int exec_line = section->line;
+	const char *name;
+	char *log_name;
+	char *arg;
+	char *endptr;
+	size_t len;
+	char **words;
+	int n_words;
+	int ret;
+	int i;
+
+	name = section->name;
+	if (strstr(name, "%i") || has_option(section, "instances")
+	    || has_option(section, "max-instances"))
+		name = arg = pool_instance_name(section->name);
+	else
+		arg = NULL;
+	add_arg(&argv, &argc, &max_argc, intern(pm_program));
+	add_arg(&argv, &argc, &max_argc, intern("--managed"));
+	/* MANAGED_MODE_ARG, filled in when we start it. */
+	add_arg(&argv, &argc, &max_argc, intern("foreground"));
+	add_arg(&argv, &argc, &max_argc, intern("--child-log-name"));
+	add_arg(&argv, &argc, &max_argc, intern(name));
+	len = strlen(get_parent_log_name()) + strlen(name) + 2;
+	log_name = xmalloc(len);
+	snprintf(log_name, len, "%s/%s", get_parent_log_name(), name);
+	add_arg(&argv, &argc, &max_argc, intern("--log-name"));
+	add_arg(&argv, &argc, &max_argc, intern(log_name));
+	free(log_name);
+	free(arg);
+
+	for (i = 0; i < config->defaults.n_options; i++) {
+		struct config_option *o = &config->defaults.options[i];
+		if (! strcmp(o->key, "exec")) {
+			exec = o->value;
+			exec_line = o->line;
+		} else if (start_limit_option(NULL, config, o)) {
+			/* Done by build_children(). */
+		} else if (! strcmp(o->key, "instances")
+			   || ! strcmp(o->key, "start-priority")
+			   || ! strcmp(o->key, "after")
+			   || autoscale_option(as, config, o)
+			   || rollout_option(ro, config, o)) {
+			logparent(CM_ERROR, "%s:%d: %s must be in a "
+				  "section\n", config->path, o->line, o->key);
+			goto error;
+		} else if (add_option_args(config, o, &argv, &argc,
+					   &max_argc)) {
+			goto error;
+		}
+	}
+	for (i = 0; i < section->n_options; i++) {
+		struct config_option *o = &section->options[i];
+		if (! strcmp(o->key, "exec")) {
+			exec = o->value;
+			exec_line = o->line;
+		} else if (! strcmp(o->key, "instances")) {
+			*instances = o->value
+				? (int)strtol(o->value, &endptr, 10) : -1;
+			if (! o->value || *endptr || *instances < 0
+			    || *instances > MANAGER_MAX_INSTANCES) {
+				logparent(CM_ERROR, "%s:%d: bad instances\n",
+					  config->path, o->line);
+				goto error;
+			}
+		} else if (! strcmp(o->key, "after")) {
+			if (! o->value) {
+				logparent(CM_ERROR, "%s:%d: after needs a "
+					  "value\n", config->path, o->line);
+				goto error;
+			}
+			free(*after);
+			*after = xstrdup(o->value);
+		} else if (! strcmp(o->key, "start-priority")) {
+			*priority = o->value
+				? (int)strtol(o->value, &endptr, 10) : 0;
+			if (! o->value || *endptr) {
+				logparent(CM_ERROR, "%s:%d: bad start-priority\n",
+					  config->path, o->line);
+				goto error;
+			}
+		} else if (start_limit_option(NULL, config, o)) {
+			logparent(CM_ERROR, "%s:%d: %s must be before the first "
+				  "section\n", config->path, o->line, o->key);
+			goto error;
+		} else if ((ret = autoscale_option(as, config, o))) {
+			if (ret < 0)
+				goto error;
+		} else if ((ret = rollout_option(ro, config, o))) {
+			if (ret < 0)
+				goto error;
+			if (name == section->name) {
+				logparent(CM_ERROR, "%s:%d: %s is only for "
+					  "pools\n", config->path, o->line,
+					  o->key);
+				goto error;
+			}
+		} else if (add_option_args(config, o, &argv, &argc,
+					   &max_argc)) {
+			goto error;
+		}
+	}
+	if (autoscale_finish(as, config, section->name, section->line,
+			     instances))
+		goto error;
+
+	if (! exec || ! *exec) {
+		logparent(CM_ERROR, "%s:%d: no exec for %s\n",
+			  config->path, exec_line, section->name);
+		goto error;
+	}
+	add_arg(&argv, &argc, &max_argc, intern("--"));
+	words = config_split_words(exec, &n_words);
+	for (i = 0; i < n_words; i++)
+		add_arg(&argv, &argc, &max_argc, intern(words[i]));
+	free(words);
+	add_arg(&argv, &argc, &max_argc, NULL);
+	return argv;
+
+ error:
+	for (i = 0; i < argc; i++)
+		intern_release(argv[i]);
+	free(argv);
+	free(*after);
+	*after = NULL;
+	return NULL;
+}
+
+
+/**
+ * Handle one of the options that limit child starts, which apply to the whole
+ * file.
+ *
+ * \param limits where to put the value, or NULL just to find out if the
+ * option is one of these.
+ *
+ * \return 1 if the option was ours, 0 if it was not, or -1 if it had an
+ * error (which has been logged).
+ */
+static int start_limit_option(struct start_limits *limits,
+			      struct config *config, struct config_option *o)
+{
+	char *endptr;
+	double value;
+
+	if (strcmp(o->key, "max-starting") && strcmp(o->key, "start-rate"))
+		return 0;
+	if (! limits)
+		return 1;
+	value = o->value ? strtod(o->value, &endptr) : -1;
+	if (! o->value || *endptr || value < 0 || value > 1000000) {
+		logparent(CM_ERROR, "%s:%d: bad %s\n",
+			  config->path, o->line, o->key);
+		return -1;
+	}
+	if (! strcmp(o->key, "max-starting"))
+		limits->max_starting = (int)value;
+	else
+		limits->rate = value;
+	return 1;
+}
+
+
+/**
+ * Handle one rolling restart option from a pool section.
+ *
+ * \return 1 if the option was ours, 0 if it was not, or -1 if it had an
+ * error (which has been logged).
+ */
+static int rollout_option(struct rollout *ro, struct config *config,
+			  struct config_option *o)
+{
+	char *endptr;
+	double secs;
+
+	if (! strcmp(o->key, "max-unavailable")) {
+		ro->max_unavailable = o->value
+			? (int)strtol(o->value, &endptr, 10) : -1;
+		if (! o->value || *endptr || ro->max_unavailable < 1
+		    || ro->max_unavailable > MANAGER_MAX_INSTANCES)
+			goto bad;
+		return 1;
+	}
+	if (! strcmp(o->key, "rolling-wait-ready")) {
+		if (o->value && ! strcmp(o->value, "yes"))
+			ro->wait_ready = 1;
+		else if (o->value && ! strcmp(o->value, "no"))
+			ro->wait_ready = 0;
+		else
+			goto bad;
+		return 1;
+	}
+	if (! strcmp(o->key, "rolling-ready-timeout")) {
+		secs = o->value ? strtod(o->value, &endptr) : 0;
+		if (! o->value || *endptr || secs <= 0 || secs > 86400)
+			goto bad;
+		ro->ready_timeout_ms = (int)(secs * 1000);
+		return 1;
+	}
+	return 0;
+
+ bad:
+	logparent(CM_ERROR, "%s:%d: bad %s\n", config->path, o->line, o->key);
+	return -1;
+}
+
+
+static int has_option(struct config_section *section, const char *key)
+{
+	int i;
+
+	for (i = 0; i < section->n_options; i++) {
+		if (! strcmp(section->options[i].key, key))
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Split an "after" line into names.
+ *
+ * \return the names, NULL terminated, in one block for free(), or NULL if
+ * there are none.
+ */
+static char **split_after(const char *after)
+{
+	char **names;
+	int n;
+
+	names = config_split_words(after, &n);
+	if (! n) {
+		free(names);
+		return NULL;
+	}
+	return names;
+}
+
+
+/**
+ * Check the "after" lines.  Every name must be a child or a pool, and no child
+ * may end up waiting for itself.
+ *
+ * \return 0 if they are OK, -1 if not (which has been logged).
+ */
+static int check_after(struct config *config, struct managed *list,
+		       struct pool *pools)
+{
+	struct managed **index;
+	struct managed *m;
+	size_t index_size;
+	char **name;
+	int ret = 0;
+
+	index = make_index(list, &index_size);
+	for (m = list; m && ! ret; m = m->next) {
+		for (name = m->after; name && *name; name++) {
+			if (! find_in_index(index, index_size, *name)
+			    && ! find_pool(pools, *name)) {
+				logparent(CM_ERROR, "%s: %s is after %s, which "
+					  "is not a child or a pool\n",
+					  config->path, m->name, *name);
+				ret = -1;
+				break;
+			}
+		}
+	}
+	for (m = list; m && ! ret; m = m->next) {
+		if (after_loop(m, list, index, index_size, pools)) {
+			logparent(CM_ERROR, "%s: %s is in a loop of after "
+				  "lines\n", config->path, m->name);
+			ret = -1;
+		}
+	}
+	for (m = list; m; m = m->next)
+		m->seen = 0;
+	free(index);
+	return ret;
+}
+
+
+/**
+ * Depth first search for a loop in the "after" lines, using seen to mark the
+ * children being searched (1) and the ones already done (2).
+ *
+ * \return 1 if m is in a loop.
+ */
+static int after_loop(struct managed *m, struct managed *list,
+		      struct managed **index, size_t index_size,
+		      struct pool *pools)
+{
+	struct managed *other;
+	struct pool *p;
+	char **name;
+
+	if (m->seen)
+		return m->seen == 1;
+	m->seen = 1;
+	for (name = m->after; name && *name; name++) {
+		other = find_in_index(index, index_size, *name);
+		if (other) {
+			if (after_loop(other, list, index, index_size, pools))
+				return 1;
+			continue;
+		}
+		p = find_pool(pools, *name);
+		for (other = list; other; other = other->next) {
+			if (other->pool == p
+			    && after_loop(other, list, index, index_size,
+					  pools))
+				return 1;
+		}
+	}
+	m->seen = 2;
+	return 0;
+}
+
+
+static struct pool *find_pool(struct pool *pools, const char *name)
+{
+	for (; pools; pools = pools->next) {
+		if (! strcmp(pools->name, name))
+			return pools;
+	}
+	return NULL;
+}
+
+
+/**
+ * The name of each instance of a pool, with %i where the instance number
+ * goes.  If the section name has no %i, the number goes on the end.
+ *
+ * \return the name, allocated with xmalloc().
+ */
+static char *pool_instance_name(const char *section_name)
+{
+	size_t len;
+	char *name;
+
+	if (strstr(section_name, "%i"))
+		return xstrdup(section_name);
+	len = strlen(section_name) + 4;
+	name = xmalloc(len);
+	snprintf(name, len, "%s-%%i", section_name);
+	return name;
+}
+
+
+static struct managed *new_managed(const char *name, char **argv)
+{
+	struct managed *m;
+
+	m = xmalloc(sizeof(struct managed));
+	memset(m, 0, sizeof(struct managed));
+	m->name = xstrdup(name);
+	m->argv = argv;
+	m->hash = hash_args(argv);
+	m->pid = -1;
+	m->restart_delay = 1;
+	m->cpu_ticks = -1;
+	return m;
+}
+
+
+/**
+ * Make one instance of a pool, with %i replaced by index everywhere.
+ */
+static struct managed *new_instance(struct pool *p, int index)
+{
+	struct managed *m;
+	char **argv;
+	char *name;
+	int argc;
+	int i;
+
+	for (argc = 0; p->argv[argc]; argc++)
+		;
+	argv = xmalloc((argc + 1) * sizeof(char *));
+	for (i = 0; i < argc; i++) {
+		if (! strchr(p->argv[i], '%')) {
+			argv[i] = intern_hold(p->argv[i]);
+			continue;
+		}
+		name = subst_index(p->argv[i], index);
+		argv[i] = intern(name);
+		free(name);
+	}
+	argv[argc] = NULL;
+	name = subst_index(p->instance_name, index);
+	m = new_managed(name, argv);
+	free(name);
+	m->pool = p;
+	m->index = index;
+	m->priority = p->priority;
+	if (p->after) {
+		name = subst_index(p->after, index);
+		m->after = split_after(name);
+		free(name);
+	}
+	return m;
+}
+
+
+/**
+ * Copy s, replacing %i with index and %% with %.
+ */
+static char *subst_index(const char *s, int index)
+{
+	char num[20];
+	char *out;
+	char *o;
+	const char *p;
+	size_t n = 0;
+
+	snprintf(num, sizeof(num), "%d", index);
+	for (p = s; *p; p++) {
+		if (p[0] == '%' && p[1] == 'i')
+			n++;
+	}
+	out = o = xmalloc(strlen(s) + n * strlen(num) + 1);
+	for (p = s; *p; p++) {
+		if (p[0] == '%' && p[1] == 'i') {
+			strcpy(o, num);
+			o += strlen(num);
+			p++;
+		} else if (p[0] == '%' && p[1] == '%') {
+			*o++ = '%';
+			p++;
+		} else {
+			*o++ = *p;
+		}
+	}
+	*o = '\0';
+	return out;
+}
+
+
+static void free_pools(struct pool *p)
+{
+	struct pool *next;
+	char **arg;
+
+	for (; p; p = next) {
+		next = p->next;
+		for (arg = p->argv; *arg; arg++)
+			intern_release(*arg);
+		free(p->argv);
+		free(p->instance_name);
+		free(p->name);
+		free(p->after);
+		autoscale_free(&p->autoscale);
+		free(p);
+	}
+}
+
+
+/**
+ * Check one option from the configuration file against the options that
+ * process-monitor accepts, and add it to argv as --key or --key=value.
+ *
+ * \return 0 on success, -1 on error (which has been logged).
+ */
+static int add_option_args(struct config *config, struct config_option *o,
+			   char ***argv, int *argc, int *max_argc)
+{
+	const struct option *opt;
+	const char **f;
+	char *arg;
+	size_t len;
+
+	for (f = forbidden_options; *f; f++) {
+		if (! strcmp(*f, o->key)) {
+			logparent(CM_ERROR, "%s:%d: %s cannot be used in "
+				  "the configuration file\n",
+				  config->path, o->line, o->key);
+			return -1;
+		}
+	}
+	for (opt = pm_options; opt && opt->name; opt++) {
+		if (! strcmp(opt->name, o->key))
+			break;
+	}
+	if (! opt || ! opt->name) {
+		logparent(CM_ERROR, "%s:%d: unknown option %s\n",
+			  config->path, o->line, o->key);
+		return -1;
+	}
+	if (opt->has_arg == required_argument && ! o->value) {
+		logparent(CM_ERROR, "%s:%d: %s needs a value\n",
+			  config->path, o->line, o->key);
+		return -1;
+	}
+	if (opt->has_arg == no_argument && o->value) {
+		logparent(CM_ERROR, "%s:%d: %s does not take a value\n",
+			  config->path, o->line, o->key);
+		return -1;
+	}
+
+	len = strlen(o->key) + (o->value ? strlen(o->value) : 0) + 4;
+	arg = xmalloc(len);
+	if (o->value)
+		snprintf(arg, len, "--%s=%s", o->key, o->value);
+	else
+		snprintf(arg, len, "--%s", o->key);
+	add_arg(argv, argc, max_argc, intern(arg));
+	free(arg);
+	return 0;
+}
+
+
+static void add_arg(char ***argv, int *argc, int *max_argc, char *arg)
+{
+	if (*argc == *max_argc) {
+		*max_argc = *max_argc * 2 + 16;
+		*argv = xrealloc(*argv, *max_argc * sizeof(char *));
+	}
+	(*argv)[(*argc)++] = arg;
+}
+
+
+/**
+ * FNV-1a hash of all the arguments, including the terminating nulls so that
+ * "ab" "c" is different from "a" "bc".
+ */
+static unsigned long long hash_args(char **argv)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	const char *p;
+
+	for (; *argv; argv++) {
+		p = *argv;
+		do {
+			hash ^= (unsigned char)*p;
+			hash *= 1099511628211ULL;
+		} while (*p++);
+	}
+	return hash;
+}
+
+
+/**
+ * The arguments are interned, so equal strings are the same pointer.
+ */
+static int same_args(char **a, char **b)
+{
+	for (; *a && *b; a++, b++) {
+		if (*a != *b)
+			return 0;
+	}
+	return ! *a && ! *b;
+}
+
+
+/**
+ * Make a hash table of the children that are still in the configuration, to
+ * find them by name.  It is open addressed, and at most half full.
+ *
+ * \return the table, which the caller must free().
+ */
+static struct managed **make_index(struct managed *list, size_t *size)
+{
+	struct managed **index;
+	struct managed *m;
+	size_t n = 0;
+	size_t i;
+
+	for (m = list; m; m = m->next)
+		n++;
+	for (*size = 16; *size < n * 2; *size *= 2)
+		;
+	index = xmalloc(*size * sizeof(struct managed *));
+	memset(index, 0, *size * sizeof(struct managed *));
+	for (m = list; m; m = m->next) {
+		if (m->removed)
+			continue;
+		i = hash_args((char *[]){ m->name, NULL }) & (*size - 1);
+		while (index[i] && strcmp(index[i]->name, m->name))
+			i = (i + 1) & (*size - 1);
+		if (! index[i])
+			index[i] = m;
+	}
+	return index;
+}
+
+
+static struct managed *find_in_index(struct managed **index, size_t size,
+				     const char *name)
+{
+	size_t i;
+
+	i = hash_args((char *[]){ (char *)name, NULL }) & (size - 1);
+	while (index[i]) {
+		if (! strcmp(index[i]->name, name))
+			return index[i];
+		i = (i + 1) & (size - 1);
+	}
+	return NULL;
+}
+
+
+/**
+ * Fork and exec a sub-monitor.
+ */
+static void start_managed(struct managed *m)
+{
+	pid_t pid;
+
+	m->restart_ms = 0;
+	pid = fork();
+	if (-1 == pid) {
+		logparent(CM_ERROR, "cannot fork for %s: %s\n",
+			  m->name, strerror(errno));
+		m->restart_ms = mstime_now() + MANAGER_MAX_RESTART_DELAY * 1000LL;
+		return;
+	}
+	if (pid) {
+		m->pid = pid;
+		m->child_pid = 0;
+		m->ready = 0;
+		m->has_load = 0;
+		m->start_ms = mstime_now();
+		m->term_ms = 0;
+		m->killed = 0;
+		return;
+	}
+
+	/* Child.  The sub-monitor logs in the same way as we do. */
+	m->argv[MANAGED_MODE_ARG] = is_daemon ? "daemon" : "foreground";
+	qos_child(0);
+	if (notify_fd >= 0)
+		setenv("NOTIFY_SOCKET", notify_name, 1);
+	else
+		unsetenv("NOTIFY_SOCKET");
+	execv("/proc/self/exe", m->argv);
+	logparent(CM_ERROR, "cannot exec %s for %s: %s\n",
+		  pm_program, m->name, strerror(errno));
+	_exit(99);
+}
+
+
+/**
+ * Start a child for the first time, or hold it until start_held() finds that
+ * the children it is after are ready.
+ */
+static void start_or_hold(struct managed *m)
+{
+	if (m->after)
+		m->held = 1;
+	else
+		start_managed(m);
+}
+
+
+/**
+ * Start the held children whose "after" children and pools are all ready.
+ * This is called on every trip around the main loop, so a child starts as soon
+ * as the sub-monitors tell us that the last of the ones it is after is ready.
+ */
+static void start_held(void)
+{
+	struct managed **index;
+	struct managed *m;
+	struct pool *p;
+	size_t index_size;
+
+	for (m = managed_list; m; m = m->next) {
+		if (m->held)
+			break;
+	}
+	if (! m || stopping_all)
+		return;
+
+	index = make_index(managed_list, &index_size);
+	for (p = pools; p; p = p->next)
+		p->unready = 0;
+	for (m = managed_list; m; m = m->next) {
+		if (m->pool && ! m->removed && (m->pid <= 0 || ! m->ready))
+			m->pool->unready++;
+	}
+	for (m = managed_list; m; m = m->next) {
+		if (m->held && ! m->removed
+		    && after_ready(m, index, index_size)) {
+			m->held = 0;
+			start_managed(m);
+		}
+	}
+	free(index);
+}
+
+
+/**
+ * \return 1 if all the children and pools that m is after are ready.  A name
+ * that has gone from the configuration does not hold m back.
+ */
+static int after_ready(struct managed *m, struct managed **index,
+		       size_t index_size)
+{
+	struct managed *other;
+	struct pool *p;
+	char **name;
+
+	for (name = m->after; *name; name++) {
+		other = find_in_index(index, index_size, *name);
+		if (other) {
+			if (other->pid <= 0 || ! other->ready)
+				return 0;
+			continue;
+		}
+		p = find_pool(pools, *name);
+		if (p && p->unready)
+			return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Let the sub-monitors at the front of the start queue start their children,
+ * as far as max-starting and start-rate allow.  A child counts as starting
+ * until it is ready, or for MANAGER_START_TIMEOUT seconds.
+ *
+ * \return the next time a child may be allowed to start, or 0.
+ */
+static long long grant_starts(long long now)
+{
+	struct managed *m;
+	long long next = 0;
+	long long when = 0;
+	int starting = 0;
+
+	if (! startq_len())
+		return 0;
+	for (m = managed_list; m; m = m->next) {
+		if (! m->starting)
+			continue;
+		when = m->start_grant_ms + MANAGER_START_TIMEOUT * 1000LL;
+		if (now >= when) {
+			m->starting = 0;
+			continue;
+		}
+		starting++;
+		if (! next || when < next)
+			next = when;
+	}
+	when = 0;
+	while ((m = startq_next(starting, now, &when))) {
+		m->starting = 1;
+		m->start_grant_ms = now;
+		starting++;
+		notify_send(notify_fd, &m->start_addr, m->start_addr_len,
+			    "START=1");
+	}
+	if (when && (! next || when < next))
+		next = when;
+	return next;
+}
+
+
+static void stop_managed(struct managed *m, long long now)
+{
+	if (m->pid <= 0 || m->term_ms)
+		return;
+	logparent(CM_INFO, "stopping %s\n", m->name);
+	kill(m->pid, SIGTERM);
+	m->term_ms = now;
+}
+
+
+static void free_managed(struct managed *m)
+{
+	char **arg;
+
+	for (arg = m->argv; *arg; arg++)
+		intern_release(*arg);
+	startq_remove(m);
+	free(m->argv);
+	free(m->name);
+	free(m->after);
+	free(m);
+}
+
+
+/**
+ * A removed child has exited, so start anything that was waiting for it.
+ */
+static void start_replacements(struct managed *old)
+{
+	struct managed *m;
+
+	for (m = managed_list; m; m = m->next) {
+		if (m->replaces == old) {
+			m->replaces = NULL;
+			if (! stopping_all)
+				start_managed(m);
+		}
+	}
+}
+
+
+static struct managed *find_by_pid(pid_t pid)
+{
+	struct managed *m;
+
+	for (m = managed_list; m; m = m->next) {
+		if (m->pid == pid)
+			return m;
+	}
+	return NULL;
+}
+
+
+/**
+ * m is being dropped before it started, so the child it was waiting to
+ * replace must not be left running for a rolling restart.
+ */
+static void stop_replaced(struct managed *m, long long now)
+{
+	if (! m->replaces)
+		return;
+	m->replaces->keep_running = 0;
+	stop_managed(m->replaces, now);
+	m->replaces = NULL;
+}
+
+
+/**
+ * Move a rolling restart along.
+ *
+ * Up to batch_size instances are restarted at once.  An instance is done when
+ * its sub-monitor says its child is ready (or just when the child has started,
+ * with "rolling-wait-ready = no"), and then the next waiting instance is
+ * restarted.  If a restarted instance's child exits, or it is not ready in
+ * time, the rolling restart is abandoned so that the instances not yet
+ * restarted keep running as they are.
+ *
+ * \return the next time this wants to be called, or 0.
+ */
+static long long rollout_check(struct pool *p, long long now)
+{
+	struct rollout *ro = &p->rollout;
+	struct managed *m;
+	long long next = 0;
+	long long deadline;
+	int in_flight = 0;
+	int waiting = 0;
+	char why[100];
+
+	if (! ro->active)
+		return 0;
+	for (m = managed_list; m; m = m->next) {
+		if (m->pool != p || m->removed || m->rolling != ROLL_STARTED)
+			continue;
+		if (m->child_starts > 1) {
+			rollout_abort(p, m, "child exited");
+			return 0;
+		}
+		if (m->pid > 0 && m->child_pid > 0
+		    && (m->ready || ! ro->wait_ready)) {
+			logparent(CM_INFO, "%s: %s restarted\n", p->name,
+				  m->name);
+			m->rolling = ROLL_NONE;
+			continue;
+		}
+		in_flight++;
+		if (m->replaces)
+			continue;	/* The old one is still stopping */
+		deadline = (m->start_ms > m->roll_ms ? m->start_ms : m->roll_ms)
+			+ ro->ready_timeout_ms;
+		if (now >= deadline) {
+			snprintf(why, sizeof(why), "not ready after %.3f "
+				 "seconds", ro->ready_timeout_ms / 1000.0);
+			rollout_abort(p, m, why);
+			return 0;
+		}
+		if (! next || deadline < next)
+			next = deadline;
+	}
+
+	for (m = managed_list; m; m = m->next) {
+		if (m->pool != p || m->removed || m->rolling != ROLL_WAITING)
+			continue;
+		if (in_flight >= ro->batch_size) {
+			waiting++;
+			continue;
+		}
+		m->rolling = ROLL_STARTED;
+		m->roll_ms = now;
+		m->child_starts = 0;
+		in_flight++;
+		if (m->replaces) {
+			m->replaces->keep_running = 0;
+			stop_managed(m->replaces, now);
+		} else if (m->pid <= 0 && ! m->restart_ms) {
+			start_managed(m);
+		}
+	}
+	if (! in_flight && ! waiting) {
+		logparent(CM_INFO, "rolling restart of %s finished\n", p->name);
+		ro->active = 0;
+	}
+	return next;
+}
+
+
+/**
+ * Give up on a rolling restart.  The instances that have not been restarted
+ * yet are put back as they were, and the ones already restarted are left
+ * alone.
+ */
+static void rollout_abort(struct pool *p, struct managed *failed,
+			  const char *why)
+{
+	struct managed **mp;
+	struct managed *m;
+	struct managed *old;
+	int kept = 0;
+
+	mp = &managed_list;
+	while (*mp) {
+		m = *mp;
+		if (m->pool != p || m->removed) {
+			mp = &m->next;
+			continue;
+		}
+		if (m->rolling != ROLL_WAITING) {
+			m->rolling = ROLL_NONE;
+			mp = &m->next;
+			continue;
+		}
+		old = m->replaces;
+		m->rolling = ROLL_NONE;
+		if (! old) {
+			/* The old one has gone anyway. */
+			if (m->pid <= 0 && ! m->restart_ms)
+				start_managed(m);
+			mp = &m->next;
+			continue;
+		}
+		old->removed = 0;
+		old->keep_running = 0;
+		old->pool = p;
+		old->index = m->index;
+		*mp = m->next;
+		free_managed(m);
+		kept++;
+	}
+	p->rollout.active = 0;
+	logparent(CM_ERROR, "rolling restart of %s abandoned (%s: %s), %d "
+		  "instances not restarted\n", p->name, failed->name, why, kept);
+}
@@ -0,0 +1,147 @@
+/* Run several children from a configuration file. */
+
+#ifndef __manager_h__
+#define __manager_h__
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <getopt.h>
+
+#include "autoscale.h"
+#include "notify.h"
+#include "startq.h"
+
+/** A sanity limit for the size of a pool. */
+#define MANAGER_MAX_INSTANCES 10000
+
+/** Where an instance is in a rolling restart. */
+enum rolling_state {
+	ROLL_NONE,
+	ROLL_WAITING,		/* Its turn has not come yet */
+	ROLL_STARTED,		/* Restarting, and not ready yet */
+};
+
+/**
+ * Settings and state for rolling restarts of a pool.
+ */
+struct rollout {
+	/** How many instances may be restarting at once.  0 means that a
+	    reload restarts changed instances all at once. */
+	int max_unavailable;
+	/** Wait for each batch to be ready before starting the next one. */
+	int wait_ready;
+	int ready_timeout_ms;
+	/** Set while a rolling restart is running, with the batch size it
+	    uses. */
+	int active;
+	int batch_size;
+};
+
+/**
+ * A section with "instances = N", or with %i in its name, which runs N copies
+ * of the child with %i in the name and options replaced by 0 to N-1.
+ */
+struct pool {
+	char *name;
+	/** Sub-monitor arguments, with %i not yet replaced. */
+	char **argv;
+	/** The name of each instance, with %i. */
+	char *instance_name;
+	int instances;
+	/** The number from the file.  A reload only changes the number of
+	    instances if this has changed, so it does not undo a scale
+	    command. */
+	int config_instances;
+	struct autoscale autoscale;
+	struct rollout rollout;
+	/** The "after" line, with %i not yet replaced, or NULL. */
+	char *after;
+	int priority;
+	/** Used while checking the "after" lines. */
+	int unready;
+	struct pool *next;
+};
+
+/**
+ * One child from the configuration file.
+ *
+ * Each child is run by its own process-monitor (a "sub-monitor") with the
+ * options from its section, so it is supervised in exactly the same way as a
+ * child given on the command line.  We only have to keep the sub-monitors
+ * running, and start and stop them when the configuration changes.
+ */
+struct managed {
+	char *name;
+	/** Arguments for the sub-monitor, NULL terminated. */
+	char **argv;
+	/** Hash of argv, to find changed children quickly. */
+	unsigned long long hash;
+	/** PID of the sub-monitor, or -1. */
+	pid_t pid;
+	long long start_ms;
+	/** When to start it again after it exited, or 0. */
+	long long restart_ms;
+	int restart_delay;
+	/** When we asked it to stop, or 0. */
+	long long term_ms;
+	int killed;
+	/** Set when it is not in the configuration any more.  It is freed
+	    when it has exited. */
+	int removed;
+	/** The removed child that has to exit before this one can start, or
+	    NULL. */
+	struct managed *replaces;
+	/** What the sub-monitor has told us about its child: its pid (or 0
+	    when it is not running), whether it is ready, and its LOAD=. */
+	pid_t child_pid;
+	int ready;
+	int has_load;
+	double load;
+	/** For autoscaling on CPU use. */
+	long long cpu_ticks;
+	long long cpu_sample_ms;
+	/** The pool this is an instance of, or NULL. */
+	struct pool *pool;
+	int index;
+	/** Names of the children and pools that must be ready before this
+	    one is first started, NULL terminated, or NULL.  held is set while
+	    it is waiting for them. */
+	char **after;
+	int held;
+	/** The sub-monitor asks before it starts its child (WANT_START=1),
+	    and we reply to start_addr (START=1) when the start limits allow.
+	    While it waits it is in the start queue, in priority order.
+	    starting is set from then until the child is ready. */
+	int priority;
+	int queue_pos;
+	unsigned long long queue_serial;
+	struct sockaddr_un start_addr;
+	socklen_t start_addr_len;
+	int starting;
+	long long start_grant_ms;
+	/** Rolling restarts.  keep_running is set on a removed child that is
+	    left running until its replacement's turn comes. */
+	enum rolling_state rolling;
+	long long roll_ms;
+	int child_starts;
+	int keep_running;
+	/** Used while reloading. */
+	int seen;
+	struct managed *next;
+};
+
+extern void manager_set_options(const struct option *options,
+				const char *program);
+extern int manager_load(const char *path);
+extern void manager_start(void);
+extern void manager_reload(void);
+extern void manager_stop_all(void);
+extern int manager_scale(const char *name, int count);
+extern int manager_rolling_restart(const char *name, int max_unavailable);
+extern void manager_fill_fds(fd_set *read_fds, int *nfds);
+extern void manager_handle_fds(fd_set *read_fds);
+extern int manager_running(void);
+extern int manager_reaped(pid_t pid, int status);
+extern long long manager_check(long long now);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "metrics.h"
+#include "log.h"
+#include "xmalloc.h"
+
+
+/**
+ * One metric.  The name includes any labels, in the Prometheus text format,
+ * eg process_monitor_child_starts_total{child="fred"}.
+ */
+struct metric {
+	char *name;
+	double value;
+	struct metric *next;
+};
+
+static struct metric *metrics = NULL;
+static struct metric **metrics_tail = &metrics;
+static const char *metrics_file = NULL;
+/** Set when a value has changed since the file was last written. */
+static int metrics_dirty = 0;
+
+static struct metric *find_metric(const char *name);
+
+
+void metrics_set_file(const char *path)
+{
+	metrics_file = path;
+}
+
+
+/**
+ * Find a metric by name, creating it with a value of zero if it does not
+ * exist.
+ */
+static struct metric *find_metric(const char *name)
+{
+	struct metric *m;
+
+	for (m = metrics; m; m = m->next) {
+		if (! strcmp(m->name, name))
+			return m;
+	}
+	m = xmalloc(sizeof(struct metric));
+	m->name = xstrdup(name);
+	m->value = 0;
+	m->next = NULL;
+	*metrics_tail = m;
+	metrics_tail = &m->next;
+	return m;
+}
+
+
+void metrics_set(const char *name, double value)
+{
+	find_metric(name)->value = value;
+	metrics_dirty = 1;
+}
+
+
+void metrics_add(const char *name, double delta)
+{
+	find_metric(name)->value += delta;
+	metrics_dirty = 1;
+}
+
+
+/**
+ * Find a metric once, for a caller that updates it often and does not want to
+ * look it up by name each time.  The metric lasts as long as we do.
+ */
+struct metric *metrics_ref(const char *name)
+{
+	return find_metric(name);
+}
+
+
+void metrics_ref_set(struct metric *m, double value)
+{
+	m->value = value;
+	metrics_dirty = 1;
+}
+
+
+void metrics_ref_add(struct metric *m, double delta)
+{
+	m->value += delta;
+	metrics_dirty = 1;
+}
+
+
+/**
+ * Make a metric name for a child, with the child's name as a label.  In a
+ * label value, backslash, double quote and newline must be escaped.
+ */
+void metrics_name(char *buf, size_t len, const char *metric,
+		  const char *child_name)
+{
+	char value[256];
+	const char *s;
+	size_t n = 0;
+
+	for (s = child_name; *s && n + 2 < sizeof(value); s++) {
+		if (*s == '\\' || *s == '"' || *s == '\n') {
+			value[n++] = '\\';
+			value[n++] = (*s == '\n') ? 'n' : *s;
+		} else {
+			value[n++] = *s;
+		}
+	}
+	value[n] = '\0';
+	snprintf(buf, len, "process_monitor_%s{child=\"%s\"}", metric, value);
+}
+
+
+/**
+ * Write all the metrics to the metrics file, if any have changed.
+ *
+ * The file is written under a temporary name and renamed into place, so a
+ * reader never sees a partly written file.  This is called once per trip
+ * around the main loop, so a burst of changes results in one write.
+ */
+void metrics_write(void)
+{
+	struct metric *m;
+	char tmpname[1024];
+	char buf[4096];
+	char line[sizeof(buf)];
+	size_t len = 0;
+	int n;
+	int fd;
+
+	if (! metrics_file || ! metrics_dirty)
+		return;
+	metrics_dirty = 0;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", metrics_file);
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (-1 == fd) {
+		logparent(CM_WARN, "cannot open %s: %s\n",
+			  tmpname, strerror(errno));
+		return;
+	}
+	/* Formatted into a buffer on the stack rather than with stdio, so
+	   writing the file does not allocate. */
+	for (m = metrics; m; m = m->next) {
+		n = snprintf(line, sizeof(line), "%s %.15g\n",
+			     m->name, m->value);
+		if (n < 0)
+			continue;
+		if (n >= (int)sizeof(line)) {
+			/* A truncated line would run into the next one. */
+			logparent(CM_WARN, "metric name too long for %s: "
+				  "%.60s...\n", metrics_file, m->name);
+			continue;
+		}
+		if (len + n > sizeof(buf)) {
+			if (write_all(fd, buf, len))
+				goto error;
+			len = 0;
+		}
+		memcpy(buf + len, line, n);
+		len += n;
+	}
+	if (len && write_all(fd, buf, len))
+		goto error;
+	if (close(fd)) {
+		fd = -1;
+		goto error;
+	}
+	if (rename(tmpname, metrics_file)) {
+		logparent(CM_WARN, "cannot rename %s to %s: %s\n",
+			  tmpname, metrics_file, strerror(errno));
+	}
+	return;
+
+ error:
+	logparent(CM_WARN, "cannot write %s: %s\n", tmpname, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
@@ -0,0 +1,20 @@
+/* Simple named metrics, written to a file for other programs to collect. */
+
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include <stddef.h>
+
+struct metric;
+
+extern void metrics_set_file(const char *path);
+extern void metrics_set(const char *name, double value);
+extern void metrics_add(const char *name, double delta);
+extern struct metric *metrics_ref(const char *name);
+extern void metrics_ref_set(struct metric *m, double value);
+extern void metrics_ref_add(struct metric *m, double delta);
+extern void metrics_write(void);
+extern void metrics_name(char *buf, size_t len, const char *metric,
+			 const char *child_name);
+
+#endif
@@ -0,0 +1,19 @@
+#include <time.h>
+
+#include "mstime.h"
+
+
+/**
+ * Get the current time in milliseconds.
+ *
+ * This is from CLOCK_MONOTONIC, so it has no relationship to the time of day,
+ * but it never goes backwards when the clock is set.  Use it only for
+ * measuring intervals and setting timeouts.
+ */
+long long mstime_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
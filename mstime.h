@@ -0,0 +1,8 @@
+/* Monotonic time in milliseconds, for timeouts. */
+
+#ifndef __mstime_h__
+#define __mstime_h__
+
+extern long long mstime_now(void);
+
+#endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE		/* For struct ucred */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "notify.h"
+#include "log.h"
+
+
+static void parse_notify_line(char *line, struct notify_msg *msg);
+
+/** Where to send our own notifications, if someone is watching us. */
+static struct sockaddr_un parent_addr;
+static socklen_t parent_addr_len = 0;
+static int parent_fd = -1;
+
+
+/**
+ * Create a socket for a child to send notifications to.
+ *
+ * The socket is a datagram socket in the Linux abstract namespace, so there is
+ * no file to clean up, and it goes away when we close it.  The name is unique
+ * to this process and call.
+ *
+ * \param name the name to put in the child's NOTIFY_SOCKET environment
+ * variable is placed here, starting with '@' to indicate the abstract
+ * namespace.
+ * \param name_len the size of name.
+ *
+ * \return the socket fd, or -1 on error (which has been logged).
+ */
+int notify_open(char *name, size_t name_len)
+{
+	static unsigned int serial = 0;
+	struct sockaddr_un sun;
+	socklen_t sun_len;
+	int fd;
+	int one = 1;
+
+	snprintf(name, name_len, "@process-monitor/%d/%u",
+		 (int)getpid(), serial++);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	/* sun_path[0] stays '\0' for the abstract namespace. */
+	strncpy(sun.sun_path + 1, name + 1, sizeof(sun.sun_path) - 2);
+	sun_len = offsetof(struct sockaddr_un, sun_path) + strlen(name);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (-1 == fd) {
+		logparent(CM_ERROR, "cannot make notify socket: %s\n",
+			  strerror(errno));
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sun_len)) {
+		logparent(CM_ERROR, "cannot bind notify socket %s: %s\n",
+			  name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* Ask for the sender's credentials, so we can ignore messages from
+	   strangers. */
+	setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one));
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+
+/**
+ * Receive one notification message.
+ *
+ * The socket is in the abstract namespace, so anyone can send to it.
+ * Messages are accepted only from root, from our own uid, or from child_uid
+ * (the uid the child runs as).
+ *
+ * \return 1 if a message was read into msg, 0 if a message was read but
+ * ignored, or -1 if there are no more messages.
+ */
+int notify_recv(int fd, uid_t child_uid, struct notify_msg *msg)
+{
+	char buf[4096];
+	char cmsgbuf[CMSG_SPACE(sizeof(struct ucred))];
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct ucred *cred = NULL;
+	ssize_t len;
+	char *line;
+	char *next;
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf) - 1;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cmsgbuf;
+	mh.msg_controllen = sizeof(cmsgbuf);
+	mh.msg_name = &msg->from;
+	mh.msg_namelen = sizeof(msg->from);
+
+	len = recvmsg(fd, &mh, MSG_DONTWAIT);
+	if (-1 == len) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			logparent(CM_WARN, "cannot read notify socket: %s\n",
+				  strerror(errno));
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SCM_CREDENTIALS) {
+			cred = (struct ucred *)CMSG_DATA(cmsg);
+		}
+	}
+	if (! cred) {
+		logparent(CM_WARN, "notify message without credentials\n");
+		return 0;
+	}
+	if (cred->uid != 0 && cred->uid != getuid() && cred->uid != child_uid) {
+		logparent(CM_WARN, "ignoring notify message from pid %d uid %d\n",
+			  (int)cred->pid, (int)cred->uid);
+		return 0;
+	}
+
+	buf[len] = '\0';
+	memset(msg, 0, offsetof(struct notify_msg, from));
+	msg->from_len = mh.msg_namelen;
+	msg->pid = cred->pid;
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		parse_notify_line(line, msg);
+	}
+	return 1;
+}
+
+
+static void parse_notify_line(char *line, struct notify_msg *msg)
+{
+	if (! strcmp(line, "READY=1")) {
+		msg->ready = 1;
+	} else if (! strcmp(line, "RELOADING=1")) {
+		msg->reloading = 1;
+	} else if (! strcmp(line, "STOPPING=1")) {
+		msg->stopping = 1;
+	} else if (! strcmp(line, "WATCHDOG=1")) {
+		msg->watchdog = 1;
+	} else if (! strncmp(line, "MAINPID=", 8)) {
+		msg->mainpid = (pid_t)strtol(line + 8, NULL, 10);
+	} else if (! strncmp(line, "CHILD_PID=", 10)) {
+		msg->child_pid = (pid_t)strtol(line + 10, NULL, 10);
+		msg->has_child_pid = 1;
+	} else if (! strcmp(line, "WANT_START=1")) {
+		msg->want_start = 1;
+	} else if (! strcmp(line, "START=1")) {
+		msg->start = 1;
+	} else if (! strncmp(line, "LOAD=", 5)) {
+		msg->load = strtod(line + 5, NULL);
+		msg->has_load = 1;
+	} else if (! strncmp(line, "STATUS=", 7)) {
+		strncpy(msg->status, line + 7, NOTIFY_STATUS_LEN - 1);
+		msg->status[NOTIFY_STATUS_LEN - 1] = '\0';
+		msg->has_status = 1;
+	}
+	/* Anything else (ERRNO=, BUSERROR=, EXTEND_TIMEOUT_USEC=, ...) is
+	   silently ignored, as sd_notify(3) says a receiver should. */
+}
+
+
+/**
+ * Send a reply to whoever sent a notification, using the address from its
+ * notify_msg.  Like notify_parent(), this does not block or complain.
+ */
+void notify_send(int fd, const struct sockaddr_un *to, socklen_t to_len,
+		 const char *text)
+{
+	if (fd < 0 || to_len <= sizeof(sa_family_t))
+		return;
+	sendto(fd, text, strlen(text), MSG_DONTWAIT|MSG_NOSIGNAL,
+	       (const struct sockaddr *)to, to_len);
+}
+
+
+/**
+ * Find out if whoever started us wants notifications, ie if NOTIFY_SOCKET is
+ * in our environment.  It is removed from the environment so that our child
+ * does not send to it.  Only called when we report the child's readiness
+ * ourselves.
+ */
+void notify_parent_init(void)
+{
+	const char *name = getenv("NOTIFY_SOCKET");
+	int one = 1;
+
+	if (! name || (name[0] != '/' && name[0] != '@')
+	    || strlen(name) >= sizeof(parent_addr.sun_path)) {
+		unsetenv("NOTIFY_SOCKET");
+		return;
+	}
+	memset(&parent_addr, 0, sizeof(parent_addr));
+	parent_addr.sun_family = AF_UNIX;
+	strcpy(parent_addr.sun_path, name);
+	if (name[0] == '@')
+		parent_addr.sun_path[0] = '\0';
+	parent_addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(name);
+	unsetenv("NOTIFY_SOCKET");
+
+	parent_fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (-1 == parent_fd) {
+		logparent(CM_WARN, "cannot make socket for NOTIFY_SOCKET: %s\n",
+			  strerror(errno));
+		parent_addr_len = 0;
+		return;
+	}
+	/* Bind to an address the kernel makes up, so that the other end can
+	   reply to us (see notify_parent_fd()). */
+	bind(parent_fd, (struct sockaddr *)&(sa_family_t){ AF_UNIX },
+	     sizeof(sa_family_t));
+	setsockopt(parent_fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one));
+	fcntl(parent_fd, F_SETFL, O_NONBLOCK);
+}
+
+
+/**
+ * \return the socket we send notifications to our parent on, which also
+ * receives its replies with notify_recv(), or -1 if there is no parent
+ * listening.
+ */
+int notify_parent_fd(void)
+{
+	return parent_addr_len ? parent_fd : -1;
+}
+
+
+/**
+ * Send a notification to whoever started us, if they asked for them.  The
+ * arguments are like printf(), and make lines like "READY=1".
+ */
+void notify_parent(const char *format, ...)
+{
+	char buf[256];
+	va_list ap;
+	int len;
+
+	if (! parent_addr_len)
+		return;
+	va_start(ap, format);
+	len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if (len < 0 || len >= sizeof(buf))
+		return;
+	/* Nothing useful can be done if this fails, and the other end may
+	   just be busy, so don't block and don't complain. */
+	sendto(parent_fd, buf, len, MSG_DONTWAIT|MSG_NOSIGNAL,
+	       (struct sockaddr *)&parent_addr, parent_addr_len);
+}
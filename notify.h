@@ -0,0 +1,50 @@
+/* The sd_notify(3) readiness protocol. */
+
+#ifndef __notify_h__
+#define __notify_h__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** Maximum length of a NOTIFY_SOCKET name, including the leading '@'. */
+#define NOTIFY_NAME_LEN 64
+#define NOTIFY_STATUS_LEN 128
+
+/**
+ * The parts of a notification message that we understand.  Fields for
+ * variables that were not in the message are zero (or empty).
+ */
+struct notify_msg {
+	int ready;		/* READY=1 */
+	int reloading;		/* RELOADING=1 */
+	int stopping;		/* STOPPING=1 */
+	int watchdog;		/* WATCHDOG=1 */
+	pid_t mainpid;		/* MAINPID=n */
+	int has_status;
+	char status[NOTIFY_STATUS_LEN];	/* STATUS=... */
+	int has_load;
+	double load;		/* LOAD=x, our own extension */
+	int has_child_pid;
+	pid_t child_pid;	/* CHILD_PID=n, from a sub-monitor */
+	int want_start;		/* WANT_START=1, from a sub-monitor */
+	int start;		/* START=1, to a sub-monitor */
+	pid_t pid;		/* Who sent it */
+	/** Where it came from, for a reply. */
+	struct sockaddr_un from;
+	socklen_t from_len;
+};
+
+extern int notify_open(char *name, size_t name_len);
+extern int notify_recv(int fd, uid_t child_uid, struct notify_msg *msg);
+extern void notify_send(int fd, const struct sockaddr_un *to,
+			socklen_t to_len, const char *text);
+extern void notify_parent_init(void);
+extern int notify_parent_fd(void);
+extern void notify_parent(const char *format, ...)
+#ifdef __GNUC__
+	__attribute__ ((format (printf, 1, 2)))
+#endif
+	;
+
+#endif
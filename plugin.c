@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef PM_NO_PLUGINS
+#include <dlfcn.h>
+#endif
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "mstime.h"
+#include "plugin.h"
+#include "xmalloc.h"
+
+
+/** How many of each kind of callback can be registered, by all the plugins
+    together. */
+#define PLUGIN_MAX_CALLBACKS 16
+#define PLUGIN_MAX_FDS 32
+/** How often metrics collectors are called. */
+#define PLUGIN_METRICS_MS 1000
+
+/**
+ * A plugin from the command line, "file[=arg]".
+ */
+struct plugin {
+	char *path;
+	char *arg;
+	void *handle;
+	struct plugin *next;
+};
+
+/**
+ * One registered callback.  fn is one of the pm_*_fn types.
+ */
+struct callback {
+	void *fn;
+	void *data;
+	struct plugin *plugin;
+};
+
+struct callbacks {
+	struct callback c[PLUGIN_MAX_CALLBACKS];
+	int n;
+};
+
+struct watched_fd {
+	int fd;
+	int events;
+	pm_fd_fn fn;
+	void *data;
+	struct plugin *plugin;
+};
+
+struct timer {
+	long long interval_ms;
+	long long next_ms;
+	pm_timer_fn fn;
+	void *data;
+	struct plugin *plugin;
+};
+
+static int add_callback(struct callbacks *cbs, void *fn, void *data);
+static int register_restart_policy(pm_restart_policy_fn fn, void *data);
+static int register_output_filter(pm_output_filter_fn fn, void *data);
+static int register_sink(pm_sink_fn fn, void *data);
+static int register_metrics(pm_metrics_fn fn, void *data);
+static void api_log(enum pm_log_level level, const char *message);
+static int watch_fd(int fd, int events, pm_fd_fn fn, void *data);
+static int add_timer(long long interval_ms, pm_timer_fn fn, void *data);
+
+static struct plugin *plugins = NULL;
+static struct plugin **plugins_tail = &plugins;
+/** The plugin that is being called, to say who is registering callbacks and
+    logging. */
+static struct plugin *current = NULL;
+
+static struct callbacks restart_policies;
+static struct callbacks output_filters;
+static struct callbacks sinks;
+static struct callbacks collectors;
+static struct watched_fd fds[PLUGIN_MAX_FDS];
+static int n_fds = 0;
+static struct timer timers[PLUGIN_MAX_CALLBACKS];
+static int n_timers = 0;
+static long long next_collect_ms = 0;
+
+static struct pm_plugin_api api = {
+	.abi_version = PM_PLUGIN_ABI_VERSION,
+	.size = sizeof(struct pm_plugin_api),
+	.register_restart_policy = register_restart_policy,
+	.register_output_filter = register_output_filter,
+	.register_sink = register_sink,
+	.register_metrics = register_metrics,
+	.log = api_log,
+	.metrics_set = metrics_set,
+	.now_ms = mstime_now,
+	.watch_fd = watch_fd,
+	.add_timer = add_timer,
+};
+
+
+/**
+ * Remember a plugin to load.  Plugins are loaded by plugin_load_all(), once
+ * we know the child's name.
+ */
+void plugin_add(const char *spec)
+{
+	struct plugin *p;
+	char *equals;
+
+	p = xmalloc(sizeof(struct plugin));
+	p->path = xstrdup(spec);
+	p->arg = NULL;
+	equals = strchr(p->path, '=');
+	if (equals) {
+		*equals = '\0';
+		p->arg = equals + 1;
+	}
+	p->handle = NULL;
+	p->next = NULL;
+	*plugins_tail = p;
+	plugins_tail = &p->next;
+}
+
+
+/**
+ * Load each plugin and call its pm_plugin_init().  A plugin that can't be
+ * loaded is a configuration error, so we log it and exit.
+ */
+void plugin_load_all(void)
+{
+#ifdef PM_NO_PLUGINS
+	api.child_name = get_child_log_name();
+	if (plugins) {
+		logparent(CM_ERROR, "cannot load plugin %s: this process-monitor "
+			  "was built without plugins\n", plugins->path);
+		exit(1);
+	}
+#else
+	const int *abi_version;
+	int (*init)(const struct pm_plugin_api *, const char *);
+	struct plugin *p;
+
+	api.child_name = get_child_log_name();
+	for (p = plugins; p; p = p->next) {
+		p->handle = dlopen(p->path, RTLD_NOW | RTLD_LOCAL);
+		if (! p->handle) {
+			logparent(CM_ERROR, "cannot load plugin %s: %s\n",
+				  p->path, dlerror());
+			exit(1);
+		}
+		abi_version = dlsym(p->handle, "pm_plugin_abi_version");
+		init = (int (*)(const struct pm_plugin_api *, const char *))
+			dlsym(p->handle, "pm_plugin_init");
+		if (! abi_version || ! init) {
+			logparent(CM_ERROR, "%s is not a process-monitor "
+				  "plugin\n", p->path);
+			exit(1);
+		}
+		if (*abi_version != PM_PLUGIN_ABI_VERSION) {
+			logparent(CM_ERROR, "plugin %s is for ABI version %d, "
+				  "not %d\n", p->path, *abi_version,
+				  PM_PLUGIN_ABI_VERSION);
+			exit(1);
+		}
+		current = p;
+		if (init(&api, p->arg)) {
+			logparent(CM_ERROR, "plugin %s failed to start\n",
+				  p->path);
+			exit(1);
+		}
+		current = NULL;
+		logparent(CM_INFO, "loaded plugin %s\n", p->path);
+	}
+#endif
+}
+
+
+static int add_callback(struct callbacks *cbs, void *fn, void *data)
+{
+	if (cbs->n == PLUGIN_MAX_CALLBACKS)
+		return -1;
+	cbs->c[cbs->n].fn = fn;
+	cbs->c[cbs->n].data = data;
+	cbs->c[cbs->n].plugin = current;
+	cbs->n++;
+	return 0;
+}
+
+
+static int register_restart_policy(pm_restart_policy_fn fn, void *data)
+{
+	return add_callback(&restart_policies, fn, data);
+}
+
+
+static int register_output_filter(pm_output_filter_fn fn, void *data)
+{
+	return add_callback(&output_filters, fn, data);
+}
+
+
+static int register_sink(pm_sink_fn fn, void *data)
+{
+	return add_callback(&sinks, fn, data);
+}
+
+
+/**
+ * Register a sink that is built in, rather than from a plugin.
+ */
+int plugin_add_sink(pm_sink_fn fn, void *data)
+{
+	return add_callback(&sinks, fn, data);
+}
+
+
+static int register_metrics(pm_metrics_fn fn, void *data)
+{
+	return add_callback(&collectors, fn, data);
+}
+
+
+static void api_log(enum pm_log_level level, const char *message)
+{
+	int cm_level;
+
+	switch (level) {
+	case PM_LOG_WARN:
+		cm_level = CM_WARN;
+		break;
+	case PM_LOG_ERROR:
+		cm_level = CM_ERROR;
+		break;
+	default:
+		cm_level = CM_INFO;
+		break;
+	}
+	if (current)
+		logparent(cm_level, "%s: %s\n", current->path, message);
+	else
+		logparent(cm_level, "plugin: %s\n", message);
+}
+
+
+static int watch_fd(int fd, int events, pm_fd_fn fn, void *data)
+{
+	int i;
+
+	for (i = 0; i < n_fds; i++) {
+		if (fds[i].fd == fd)
+			break;
+	}
+	if (! events) {
+		if (i < n_fds)
+			fds[i] = fds[--n_fds];
+		return 0;
+	}
+	if (i == n_fds) {
+		if (n_fds == PLUGIN_MAX_FDS)
+			return -1;
+		n_fds++;
+	}
+	fds[i].fd = fd;
+	fds[i].events = events;
+	fds[i].fn = fn;
+	fds[i].data = data;
+	fds[i].plugin = current;
+	return 0;
+}
+
+
+static int add_timer(long long interval_ms, pm_timer_fn fn, void *data)
+{
+	if (n_timers == PLUGIN_MAX_CALLBACKS || interval_ms <= 0)
+		return -1;
+	timers[n_timers].interval_ms = interval_ms;
+	timers[n_timers].next_ms = mstime_now() + interval_ms;
+	timers[n_timers].fn = fn;
+	timers[n_timers].data = data;
+	timers[n_timers].plugin = current;
+	n_timers++;
+	return 0;
+}
+
+
+/**
+ * Pass a line of the child's output through the output filters.
+ *
+ * \return 1 if a filter dropped it, or 0 to log it.
+ */
+int plugin_filter_output(char *line)
+{
+	pm_output_filter_fn fn;
+	int i;
+
+	for (i = 0; i < output_filters.n; i++) {
+		fn = (pm_output_filter_fn)output_filters.c[i].fn;
+		current = output_filters.c[i].plugin;
+		if (fn(output_filters.c[i].data, line, strlen(line))) {
+			current = NULL;
+			return 1;
+		}
+	}
+	current = NULL;
+	return 0;
+}
+
+
+/**
+ * Tell the sinks about something that happened to the child.
+ */
+void plugin_event(enum pm_event_type type, pid_t pid, const char *line,
+		  int status)
+{
+	struct pm_event event;
+	struct timeval tv;
+	pm_sink_fn fn;
+	int i;
+
+	if (! sinks.n)
+		return;
+	gettimeofday(&tv, NULL);
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.child_name = get_child_log_name();
+	event.pid = pid;
+	event.time_ms = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+	event.line = line;
+	event.status = status;
+	for (i = 0; i < sinks.n; i++) {
+		fn = (pm_sink_fn)sinks.c[i].fn;
+		current = sinks.c[i].plugin;
+		fn(sinks.c[i].data, &event);
+	}
+	current = NULL;
+}
+
+
+/**
+ * Ask the restart policies, in the order they were registered, what to do
+ * about an exit.  The first one that decides wins.
+ */
+enum pm_restart_decision plugin_restart_policy(const struct pm_exit *exit,
+					       int *delay)
+{
+	enum pm_restart_decision decision;
+	pm_restart_policy_fn fn;
+	int i;
+
+	for (i = 0; i < restart_policies.n; i++) {
+		fn = (pm_restart_policy_fn)restart_policies.c[i].fn;
+		*delay = exit->default_delay;
+		current = restart_policies.c[i].plugin;
+		decision = fn(restart_policies.c[i].data, exit, delay);
+		current = NULL;
+		if (decision != PM_RESTART_DEFAULT)
+			return decision;
+	}
+	*delay = exit->default_delay;
+	return PM_RESTART_DEFAULT;
+}
+
+
+void plugin_fill_fds(fd_set *read_fds, fd_set *write_fds, int *nfds)
+{
+	int i;
+
+	for (i = 0; i < n_fds; i++) {
+		if (fds[i].events & PM_FD_READ)
+			FD_SET(fds[i].fd, read_fds);
+		if (fds[i].events & PM_FD_WRITE)
+			FD_SET(fds[i].fd, write_fds);
+		if (fds[i].fd > *nfds)
+			*nfds = fds[i].fd;
+	}
+}
+
+
+void plugin_handle_fds(fd_set *read_fds, fd_set *write_fds)
+{
+	struct watched_fd w;
+	int readable;
+	int writable;
+	int i;
+
+	/* A callback can change the list, so go backwards and work on a
+	   copy. */
+	for (i = n_fds - 1; i >= 0; i--) {
+		if (i >= n_fds)
+			continue;
+		w = fds[i];
+		readable = (w.events & PM_FD_READ) && FD_ISSET(w.fd, read_fds);
+		writable = (w.events & PM_FD_WRITE)
+			&& FD_ISSET(w.fd, write_fds);
+		if (readable || writable) {
+			current = w.plugin;
+			w.fn(w.data, w.fd, readable, writable);
+		}
+	}
+	current = NULL;
+}
+
+
+/**
+ * Run the timers and metrics collectors that are due.
+ *
+ * \return the next time this wants to be called, or 0.
+ */
+long long plugin_check(long long now)
+{
+	pm_metrics_fn fn;
+	long long next = 0;
+	int i;
+
+	for (i = 0; i < n_timers; i++) {
+		if (now >= timers[i].next_ms) {
+			timers[i].next_ms = now + timers[i].interval_ms;
+			current = timers[i].plugin;
+			timers[i].fn(timers[i].data);
+		}
+		if (! next || timers[i].next_ms < next)
+			next = timers[i].next_ms;
+	}
+	if (collectors.n) {
+		if (now >= next_collect_ms) {
+			next_collect_ms = now + PLUGIN_METRICS_MS;
+			for (i = 0; i < collectors.n; i++) {
+				fn = (pm_metrics_fn)collectors.c[i].fn;
+				current = collectors.c[i].plugin;
+				fn(collectors.c[i].data);
+			}
+		}
+		if (! next || next_collect_ms < next)
+			next = next_collect_ms;
+	}
+	current = NULL;
+	return next;
+}
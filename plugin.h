@@ -0,0 +1,23 @@
+/* Load plugins, and call them from the main loop. */
+
+#ifndef __plugin_h__
+#define __plugin_h__
+
+#include <sys/types.h>
+#include <sys/select.h>
+
+#include "process-monitor-plugin.h"
+
+extern void plugin_add(const char *spec);
+extern void plugin_load_all(void);
+extern int plugin_add_sink(pm_sink_fn fn, void *data);
+extern int plugin_filter_output(char *line);
+extern void plugin_event(enum pm_event_type type, pid_t pid,
+			 const char *line, int status);
+extern enum pm_restart_decision plugin_restart_policy(
+	const struct pm_exit *exit, int *delay);
+extern void plugin_fill_fds(fd_set *read_fds, fd_set *write_fds, int *nfds);
+extern void plugin_handle_fds(fd_set *read_fds, fd_set *write_fds);
+extern long long plugin_check(long long now);
+
+#endif
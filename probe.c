@@ -0,0 +1,617 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "probe.h"
+#include "listen.h"
+#include "log.h"
+#include "mstime.h"
+#include "proc.h"
+#include "qos.h"
+#include "xmalloc.h"
+
+
+static struct probe *probes = NULL;
+static struct probe **probes_tail = &probes;
+/** Number of checks in progress, and the most we allow at once. */
+static int n_running = 0;
+static int max_running = 4;
+static probe_liveness_fn liveness_fn = NULL;
+static probe_readiness_fn readiness_fn = NULL;
+/** Whether all the readiness probes passed their last checks. */
+static int all_ready = 0;
+
+static void parse_probe_option(struct probe *p, char *word);
+static void parse_probe_target(struct probe *p, char *target);
+static char *unescape(const char *s);
+static int parse_ms(const char *s, const char *spec);
+static void start_check(struct probe *p, long long now);
+static void start_exec_check(struct probe *p);
+static void start_socket_check(struct probe *p);
+static void socket_ready(struct probe *p);
+static void finish_check(struct probe *p, int ok, const char *why);
+static void abort_check(struct probe *p);
+static void update_readiness(struct probe *p);
+
+
+/**
+ * Add a probe from a command line specification.
+ *
+ * The spec is zero or more space separated options, followed by the target:
+ *
+ *   [interval=SECS] [timeout=SECS] [failures=N] [send=STR] [expect=STR] TARGET
+ *
+ * where TARGET is "tcp:[HOST:]PORT", "unix:PATH" or "exec:COMMAND".  COMMAND
+ * is the rest of the spec, and is run with /bin/sh -c.  send and expect are
+ * only used with unix:, and may contain \n, \r, \t, \s (space) and \\.
+ *
+ * Errors in the spec are fatal.
+ */
+void probe_add(enum probe_kind kind, const char *spec)
+{
+	struct probe *p;
+	char *copy;
+	char *word;
+	char *rest;
+
+	p = xmalloc(sizeof(struct probe));
+	memset(p, 0, sizeof(struct probe));
+	p->kind = kind;
+	p->spec = xstrdup(spec);
+	p->fd = -1;
+	p->pid = -1;
+	p->interval_ms = 10000;
+	p->timeout_ms = 2000;
+	p->failure_threshold = 3;
+
+	copy = xstrdup(spec);
+	rest = copy;
+	while (1) {
+		while (*rest == ' ')
+			rest++;
+		word = rest;
+		rest = strchr(rest, ' ');
+		if (rest)
+			*rest++ = '\0';
+		/* The first word without an '=' before any ':' is the
+		   target. */
+		if (strchr(word, '=')
+		    && (! strchr(word, ':')
+			|| strchr(word, '=') < strchr(word, ':'))) {
+			parse_probe_option(p, word);
+			if (! rest) {
+				logparent(CM_ERROR, "no target in probe: %s\n",
+					  spec);
+				exit(1);
+			}
+			continue;
+		}
+		/* Put the rest of an exec: command back together. */
+		if (rest)
+			rest[-1] = ' ';
+		parse_probe_target(p, word);
+		break;
+	}
+	free(copy);
+
+	*probes_tail = p;
+	probes_tail = &p->next;
+}
+
+
+static void parse_probe_option(struct probe *p, char *word)
+{
+	char *value = strchr(word, '=') + 1;
+	char *endptr;
+
+	if (! strncmp(word, "interval=", 9)) {
+		p->interval_ms = parse_ms(value, p->spec);
+	} else if (! strncmp(word, "timeout=", 8)) {
+		p->timeout_ms = parse_ms(value, p->spec);
+	} else if (! strncmp(word, "failures=", 9)) {
+		p->failure_threshold = (int)strtol(value, &endptr, 10);
+		if (*endptr || p->failure_threshold <= 0) {
+			logparent(CM_ERROR, "strange failures in probe: %s\n",
+				  p->spec);
+			exit(1);
+		}
+	} else if (! strncmp(word, "send=", 5)) {
+		p->send = unescape(value);
+	} else if (! strncmp(word, "expect=", 7)) {
+		p->expect = unescape(value);
+	} else {
+		logparent(CM_ERROR, "unknown probe option %s in: %s\n",
+			  word, p->spec);
+		exit(1);
+	}
+}
+
+
+static int parse_ms(const char *s, const char *spec)
+{
+	char *endptr;
+	double secs;
+
+	secs = strtod(s, &endptr);
+	if (*endptr || secs <= 0) {
+		logparent(CM_ERROR, "strange time %s in probe: %s\n", s, spec);
+		exit(1);
+	}
+	return (int)(secs * 1000);
+}
+
+
+static void parse_probe_target(struct probe *p, char *target)
+{
+	if (! strncmp(target, "exec:", 5)) {
+		p->type = PROBE_EXEC;
+		p->command = xstrdup(target + 5);
+	} else if (! strncmp(target, "unix:", 5)) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)&p->addr;
+		if (strlen(target + 5) >= sizeof(sun->sun_path)) {
+			logparent(CM_ERROR, "unix socket path too long: %s\n",
+				  target + 5);
+			exit(1);
+		}
+		p->type = PROBE_UNIX;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, target + 5);
+		p->addr_len = sizeof(struct sockaddr_un);
+	} else if (! strncmp(target, "tcp:", 4)) {
+		struct addrinfo hints;
+		struct addrinfo *res;
+		char *host = "127.0.0.1";
+		char *port = target + 4;
+		char *colon = strrchr(port, ':');
+		int gai_ret;
+
+		if (colon) {
+			*colon = '\0';
+			host = port;
+			port = colon + 1;
+		}
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		gai_ret = getaddrinfo(host, port, &hints, &res);
+		if (gai_ret) {
+			logparent(CM_ERROR, "cannot resolve probe %s: %s\n",
+				  p->spec, gai_strerror(gai_ret));
+			exit(1);
+		}
+		p->type = PROBE_TCP;
+		memcpy(&p->addr, res->ai_addr, res->ai_addrlen);
+		p->addr_len = res->ai_addrlen;
+		freeaddrinfo(res);
+	} else {
+		logparent(CM_ERROR, "unknown probe type: %s\n", p->spec);
+		exit(1);
+	}
+}
+
+
+/**
+ * Copy a string, replacing backslash escapes.  Spaces separate probe options,
+ * so \s is provided for a space.
+ */
+static char *unescape(const char *s)
+{
+	char *out = xmalloc(strlen(s) + 1);
+	char *o = out;
+
+	for (; *s; s++) {
+		if (*s != '\\' || ! s[1]) {
+			*o++ = *s;
+			continue;
+		}
+		switch (*++s) {
+		case 'n': *o++ = '\n'; break;
+		case 'r': *o++ = '\r'; break;
+		case 't': *o++ = '\t'; break;
+		case 's': *o++ = ' ';  break;
+		default:  *o++ = *s;   break;
+		}
+	}
+	*o = '\0';
+	return out;
+}
+
+
+int probe_have(enum probe_kind kind)
+{
+	struct probe *p;
+
+	for (p = probes; p; p = p->next) {
+		if (p->kind == kind)
+			return 1;
+	}
+	return 0;
+}
+
+
+void probe_set_concurrency(int n)
+{
+	max_running = n;
+}
+
+
+/**
+ * Refuse a tcp: or unix: probe of one of our own --listen sockets.  We hold
+ * that socket open, so connecting to it would succeed even with no child
+ * running.  Called after listen_open_all(), when the addresses are known.
+ */
+void probe_check_targets(void)
+{
+	struct probe *p;
+	const char *spec;
+
+	for (p = probes; p; p = p->next) {
+		if (p->type == PROBE_EXEC)
+			continue;
+		spec = listen_find((struct sockaddr *)&p->addr);
+		if (spec) {
+			logparent(CM_ERROR, "probe %s would connect to "
+				  "--listen %s, which is held open by "
+				  "process-monitor, not the child\n",
+				  p->spec, spec);
+			exit(1);
+		}
+	}
+}
+
+
+void probe_set_callbacks(probe_liveness_fn liveness,
+			 probe_readiness_fn readiness)
+{
+	liveness_fn = liveness;
+	readiness_fn = readiness;
+}
+
+
+/**
+ * Start probing a newly started child.
+ *
+ * Readiness probes run after one second (or their interval, if that's
+ * shorter), so that we notice as soon as possible that the child is ready.
+ * Liveness probes first run after their interval, to give the child time to
+ * start up.
+ */
+void probe_start(void)
+{
+	struct probe *p;
+	long long now = mstime_now();
+
+	probe_stop();
+	all_ready = 0;
+	for (p = probes; p; p = p->next) {
+		p->active = 1;
+		p->failures = 0;
+		p->ok = 0;
+		if (p->kind == PROBE_READINESS && p->interval_ms > 1000)
+			p->next_ms = now + 1000;
+		else
+			p->next_ms = now + p->interval_ms;
+	}
+}
+
+
+/**
+ * Stop probing, when the child has exited.  Any checks in progress are
+ * abandoned.
+ */
+void probe_stop(void)
+{
+	struct probe *p;
+
+	for (p = probes; p; p = p->next) {
+		if (p->running)
+			abort_check(p);
+		p->active = 0;
+	}
+}
+
+
+void probe_fill_fds(fd_set *read_fds, fd_set *write_fds, int *nfds)
+{
+	struct probe *p;
+
+	for (p = probes; p; p = p->next) {
+		if (! p->running || p->fd < 0)
+			continue;
+		/* We want to write while connecting and while sending, and
+		   read after that. */
+		if (! p->connected
+		    || (p->send && p->sent < strlen(p->send)))
+			FD_SET(p->fd, write_fds);
+		else
+			FD_SET(p->fd, read_fds);
+		if (p->fd > *nfds)
+			*nfds = p->fd;
+	}
+}
+
+
+void probe_handle_fds(fd_set *read_fds, fd_set *write_fds)
+{
+	struct probe *p;
+
+	for (p = probes; p; p = p->next) {
+		if (p->running && p->fd >= 0
+		    && (FD_ISSET(p->fd, read_fds)
+			|| FD_ISSET(p->fd, write_fds))) {
+			socket_ready(p);
+		}
+	}
+}
+
+
+/**
+ * Start checks that are due, and fail checks that have timed out.
+ *
+ * No more than max_running checks are in progress at once.  A check that is
+ * due when there is no room waits until another check finishes.
+ *
+ * \return the next time this needs to be called, or 0.
+ */
+long long probe_check(long long now)
+{
+	struct probe *p;
+	long long next = 0;
+	long long when;
+
+	for (p = probes; p; p = p->next) {
+		if (! p->active)
+			continue;
+		if (p->running && now >= p->start_ms + p->timeout_ms)
+			finish_check(p, 0, "timed out");
+		if (! p->running && now >= p->next_ms
+		    && n_running < max_running)
+			start_check(p, now);
+		if (p->running)
+			when = p->start_ms + p->timeout_ms;
+		else if (now < p->next_ms)
+			when = p->next_ms;
+		else
+			continue;	/* Waiting for a free slot. */
+		if (! next || when < next)
+			next = when;
+	}
+	return next;
+}
+
+
+/**
+ * See if a child process that has exited was one of our check commands.
+ *
+ * \return 1 if it was ours, 0 if not.
+ */
+int probe_reaped(pid_t pid, int status)
+{
+	struct probe *p;
+	char why[50];
+
+	for (p = probes; p; p = p->next) {
+		if (p->running && p->pid == pid) {
+			p->pid = -1;
+			if (WIFSIGNALED(status))
+				snprintf(why, sizeof(why),
+					 "killed by signal %d",
+					 WTERMSIG(status));
+			else
+				snprintf(why, sizeof(why),
+					 "exited with status %d",
+					 WEXITSTATUS(status));
+			finish_check(p, WIFEXITED(status)
+				     && 0 == WEXITSTATUS(status), why);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static void start_check(struct probe *p, long long now)
+{
+	p->running = 1;
+	p->start_ms = now;
+	p->connected = 0;
+	p->sent = 0;
+	p->buf_len = 0;
+	n_running++;
+	if (p->type == PROBE_EXEC)
+		start_exec_check(p);
+	else
+		start_socket_check(p);
+}
+
+
+static void start_exec_check(struct probe *p)
+{
+	pid_t pid;
+	int fd;
+
+	pid = fork();
+	if (-1 == pid) {
+		finish_check(p, 0, strerror(errno));
+		return;
+	}
+	if (pid) {
+		/* As well as in the child, so that it's done before we might
+		   signal the group. */
+		setpgid(pid, pid);
+		p->pid = pid;
+		return;
+	}
+	/* Child, in its own process group so that a timeout kills anything
+	   the check command started too. */
+	setpgid(0, 0);
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		if (fd > 2)
+			close(fd);
+	}
+	reset_child_signals();
+	qos_child(0);
+	execl("/bin/sh", "sh", "-c", p->command, (char *)NULL);
+	_exit(127);
+}
+
+
+static void start_socket_check(struct probe *p)
+{
+	p->fd = socket(p->addr.ss_family,
+		       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == p->fd) {
+		finish_check(p, 0, strerror(errno));
+		return;
+	}
+	if (connect(p->fd, (struct sockaddr *)&p->addr, p->addr_len)
+	    && errno != EINPROGRESS) {
+		finish_check(p, 0, strerror(errno));
+		return;
+	}
+	/* Connected or connecting.  Either way, select() will tell us when
+	   the socket is writable, and socket_ready() will find out which. */
+}
+
+
+/**
+ * Make progress on a socket check that select() says is ready.
+ */
+static void socket_ready(struct probe *p)
+{
+	int err;
+	socklen_t err_len = sizeof(err);
+	ssize_t ret;
+
+	if (! p->connected) {
+		if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &err_len))
+			err = errno;
+		if (err) {
+			finish_check(p, 0, strerror(err));
+			return;
+		}
+		p->connected = 1;
+		if (p->type == PROBE_TCP || (! p->send && ! p->expect)) {
+			finish_check(p, 1, "connected");
+			return;
+		}
+	}
+	if (p->send && p->sent < strlen(p->send)) {
+		ret = write(p->fd, p->send + p->sent,
+			    strlen(p->send) - p->sent);
+		if (-1 == ret) {
+			if (errno != EAGAIN)
+				finish_check(p, 0, strerror(errno));
+			return;
+		}
+		p->sent += ret;
+		if (p->sent == strlen(p->send) && ! p->expect)
+			finish_check(p, 1, "sent");
+		return;
+	}
+	ret = read(p->fd, p->buf + p->buf_len,
+		   PROBE_BUF_LEN - 1 - p->buf_len);
+	if (-1 == ret) {
+		if (errno != EAGAIN)
+			finish_check(p, 0, strerror(errno));
+		return;
+	}
+	p->buf_len += ret;
+	p->buf[p->buf_len] = '\0';
+	if (strstr(p->buf, p->expect))
+		finish_check(p, 1, "got the expected response");
+	else if (0 == ret || p->buf_len == PROBE_BUF_LEN - 1)
+		finish_check(p, 0, "did not get the expected response");
+}
+
+
+/**
+ * Record the result of a check, and tell the monitor if it matters.
+ */
+static void finish_check(struct probe *p, int ok, const char *why)
+{
+	abort_check(p);
+	p->next_ms = p->start_ms + p->interval_ms;
+
+	if (ok) {
+		p->failures = 0;
+		if (p->kind == PROBE_READINESS && ! p->ok) {
+			p->ok = 1;
+			update_readiness(p);
+		}
+		return;
+	}
+
+	p->failures++;
+	logparent(CM_WARN, "%s probe %s failed (%d of %d): %s\n",
+		  p->kind == PROBE_LIVENESS ? "liveness" : "readiness",
+		  p->spec, p->failures, p->failure_threshold, why);
+	if (p->failures < p->failure_threshold)
+		return;
+	if (p->kind == PROBE_LIVENESS) {
+		/* The child is about to be restarted, and probe_start() will
+		   begin counting again. */
+		p->failures = 0;
+		if (liveness_fn)
+			liveness_fn(p);
+	} else if (p->ok) {
+		p->ok = 0;
+		update_readiness(p);
+	}
+}
+
+
+/**
+ * Stop a check in progress, without recording a result.
+ */
+static void abort_check(struct probe *p)
+{
+	if (! p->running)
+		return;
+	if (p->fd >= 0) {
+		close(p->fd);
+		p->fd = -1;
+	}
+	if (p->pid > 0) {
+		/* The zombie is reaped along with everything else in
+		   handle_child_signal(). */
+		kill(-p->pid, SIGKILL);
+		p->pid = -1;
+	}
+	p->running = 0;
+	n_running--;
+}
+
+
+/**
+ * The child is ready when all of its readiness probes have passed.  Tell the
+ * monitor when that changes.
+ */
+static void update_readiness(struct probe *changed)
+{
+	struct probe *p;
+	int ready = 1;
+
+	for (p = probes; p; p = p->next) {
+		if (p->kind == PROBE_READINESS && ! p->ok)
+			ready = 0;
+	}
+	if (ready != all_ready) {
+		all_ready = ready;
+		if (readiness_fn)
+			readiness_fn(changed, ready);
+	}
+}
@@ -0,0 +1,77 @@
+/* Liveness and readiness probes for the child. */
+
+#ifndef __probe_h__
+#define __probe_h__
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+enum probe_kind {
+	PROBE_LIVENESS,
+	PROBE_READINESS,
+};
+
+enum probe_type {
+	PROBE_TCP,
+	PROBE_UNIX,
+	PROBE_EXEC,
+};
+
+#define PROBE_BUF_LEN 256
+
+/**
+ * One probe.  The parameters come from the command line, and the rest is the
+ * state of the probe while it runs.
+ */
+struct probe {
+	enum probe_kind kind;
+	enum probe_type type;
+	char *spec;			/* As given on the command line */
+	/* Target */
+	struct sockaddr_storage addr;	/* For PROBE_TCP and PROBE_UNIX */
+	socklen_t addr_len;
+	char *command;			/* For PROBE_EXEC */
+	char *send;			/* For PROBE_UNIX, or NULL */
+	char *expect;			/* For PROBE_UNIX, or NULL */
+	/* Parameters */
+	int interval_ms;
+	int timeout_ms;
+	int failure_threshold;
+	/* State */
+	int active;			/* Set while the child is running */
+	int running;			/* Set while a check is in progress */
+	int fd;				/* Socket, or -1 */
+	int connected;			/* Set when connect() has finished */
+	pid_t pid;			/* Check command, or -1 */
+	size_t sent;			/* Bytes of send written so far */
+	char buf[PROBE_BUF_LEN];	/* What we've read so far */
+	size_t buf_len;
+	long long start_ms;		/* When this check started */
+	long long next_ms;		/* When the next check is due */
+	int failures;			/* Consecutive failures */
+	int ok;				/* Result of the last check */
+	struct probe *next;
+};
+
+/**
+ * Called when a liveness probe reaches its failure threshold, or when a
+ * readiness probe changes state.
+ */
+typedef void (*probe_liveness_fn)(struct probe *p);
+typedef void (*probe_readiness_fn)(struct probe *p, int ready);
+
+extern void probe_add(enum probe_kind kind, const char *spec);
+extern int probe_have(enum probe_kind kind);
+extern void probe_set_concurrency(int n);
+extern void probe_check_targets(void);
+extern void probe_set_callbacks(probe_liveness_fn liveness,
+				probe_readiness_fn readiness);
+extern void probe_start(void);
+extern void probe_stop(void);
+extern void probe_fill_fds(fd_set *read_fds, fd_set *write_fds, int *nfds);
+extern void probe_handle_fds(fd_set *read_fds, fd_set *write_fds);
+extern long long probe_check(long long now);
+extern int probe_reaped(pid_t pid, int status);
+
+#endif
@@ -0,0 +1,21 @@
+#include <signal.h>
+
+#include "proc.h"
+
+
+/**
+ * Called in each process we fork that is not the main child, so that it does
+ * not run our signal handlers before it execs (or at all, if it doesn't), and
+ * so that a write to a closed pipe kills it quietly.
+ */
+void reset_child_signals(void)
+{
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGALRM, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+}
@@ -0,0 +1,8 @@
+/* Helpers for the processes we fork, other than the main child. */
+
+#ifndef __proc_h__
+#define __proc_h__
+
+extern void reset_child_signals(void);
+
+#endif
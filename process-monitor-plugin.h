@@ -0,0 +1,128 @@
+/* Interface for process-monitor plugins, loaded with --plugin. */
+
+#ifndef __process_monitor_plugin_h__
+#define __process_monitor_plugin_h__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A plugin is a shared object that defines pm_plugin_abi_version and
+ * pm_plugin_init():
+ *
+ *	#include <process-monitor-plugin.h>
+ *
+ *	PM_PLUGIN_DECLARE;
+ *
+ *	int pm_plugin_init(const struct pm_plugin_api *api, const char *arg)
+ *	{
+ *		return api->register_output_filter(my_filter, NULL);
+ *	}
+ *
+ * pm_plugin_init() is called once, before the child is first started, with
+ * the argument from the command line (or NULL), and returns 0, or -1 to make
+ * process-monitor exit.  The callbacks it registers are called from
+ * process-monitor's main loop, so they must not block.
+ *
+ * The ABI version changes only when something in this file changes in a way
+ * that breaks existing plugins.  New members are only ever added to the end
+ * of struct pm_plugin_api, and api->size says how big the caller's is.
+ */
+
+#define PM_PLUGIN_ABI_VERSION 1
+
+#define PM_PLUGIN_DECLARE \
+	const int pm_plugin_abi_version = PM_PLUGIN_ABI_VERSION
+
+/** Levels for api->log(). */
+enum pm_log_level {
+	PM_LOG_INFO,
+	PM_LOG_WARN,
+	PM_LOG_ERROR,
+};
+
+/** What a restart policy wants done after the child exits. */
+enum pm_restart_decision {
+	PM_RESTART_DEFAULT,	/* No opinion, ask the next one */
+	PM_RESTART_AFTER,	/* Start it again after *delay seconds */
+	PM_RESTART_NEVER,	/* Stop monitoring, as for the stop command */
+};
+
+/** Kinds of struct pm_event. */
+enum pm_event_type {
+	PM_EVENT_START,		/* The child has started */
+	PM_EVENT_OUTPUT,	/* A line of output from the child */
+	PM_EVENT_EXIT,		/* The child has exited */
+};
+
+/**
+ * Something that happened to the child, for sinks.  Only the members that
+ * apply to the type are set.
+ */
+struct pm_event {
+	enum pm_event_type type;
+	const char *child_name;
+	pid_t pid;
+	long long time_ms;	/* Wall clock, ms since the epoch */
+	const char *line;	/* PM_EVENT_OUTPUT, without the newline */
+	int status;		/* PM_EVENT_EXIT, as from waitpid() */
+};
+
+/**
+ * What a restart policy knows about an exit of the child.
+ */
+struct pm_exit {
+	pid_t pid;
+	int status;		/* As from waitpid() */
+	long long run_ms;	/* How long it ran */
+	int restarts;		/* Exits since it was last started on command */
+	int default_delay;	/* What process-monitor would wait, in seconds */
+};
+
+/** Return PM_RESTART_AFTER or PM_RESTART_NEVER to decide, or
+    PM_RESTART_DEFAULT to leave it to the next policy. */
+typedef enum pm_restart_decision (*pm_restart_policy_fn)(
+	void *data, const struct pm_exit *exit, int *delay);
+/** Called with each line of output, which can be changed in place as long as
+    it is not made longer than len.  Return 0 to keep it, or 1 to drop it. */
+typedef int (*pm_output_filter_fn)(void *data, char *line, size_t len);
+typedef void (*pm_sink_fn)(void *data, const struct pm_event *event);
+/** Called about once a second, to set metrics with api->metrics_set(). */
+typedef void (*pm_metrics_fn)(void *data);
+/** Called when a watched fd is ready. */
+typedef void (*pm_fd_fn)(void *data, int fd, int readable, int writable);
+typedef void (*pm_timer_fn)(void *data);
+
+/** For api->watch_fd(). */
+#define PM_FD_READ  1
+#define PM_FD_WRITE 2
+
+/**
+ * What process-monitor gives to a plugin.  The register and watch functions
+ * return 0, or -1 if there are too many.
+ */
+struct pm_plugin_api {
+	int abi_version;
+	size_t size;
+	const char *child_name;
+
+	int (*register_restart_policy)(pm_restart_policy_fn fn, void *data);
+	int (*register_output_filter)(pm_output_filter_fn fn, void *data);
+	int (*register_sink)(pm_sink_fn fn, void *data);
+	int (*register_metrics)(pm_metrics_fn fn, void *data);
+
+	void (*log)(enum pm_log_level level, const char *message);
+	void (*metrics_set)(const char *name, double value);
+	long long (*now_ms)(void);	/* Monotonic */
+
+	/* Take part in the main loop.  events is PM_FD_READ, PM_FD_WRITE or
+	   both, or 0 to stop watching fd.  A timer is called every
+	   interval_ms until the process exits. */
+	int (*watch_fd)(int fd, int events, pm_fd_fn fn, void *data);
+	int (*add_timer)(long long interval_ms, pm_timer_fn fn, void *data);
+};
+
+extern const int pm_plugin_abi_version;
+extern int pm_plugin_init(const struct pm_plugin_api *api, const char *arg);
+
+#endif
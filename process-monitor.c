@@ -14,15 +14,85 @@
 #include <sys/wait.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <poll.h>
 #include <pty.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
+#include <sys/prctl.h>
 
 #include "log.h"
+#include "crash.h"
 #include "envlist.h"
+#include "freeze.h"
+#include "hook.h"
+#include "hostlimit.h"
 #include "is_daemon.h"
+#include "listen.h"
+#include "mail.h"
+#include "manager.h"
+#include "metrics.h"
+#include "mstime.h"
+#include "notify.h"
+#include "plugin.h"
+#include "qos.h"
+#include "probe.h"
+#include "procinfo.h"
+#include "ring.h"
+#include "ship.h"
+#include "statsd.h"
+#include "watch.h"
+
+
+#define PTY_LINE_LEN 2048
+/** How much recent output we keep from each generation. */
+#define OUTPUT_RING_LEN 8192
+
+/**
+ * One running instance of the child program.
+ *
+ * Normally only one generation runs at a time.  During an overlapping restart
+ * the new generation is started while the old one is still running, and the old
+ * one is sent SIGTERM only when the new one is ready.
+ */
+struct generation {
+	/** PID of the child process, or -1 when it is not running. */
+	pid_t pid;
+	int pty_fd;
+	char pty_data[PTY_LINE_LEN];
+	int pty_data_len;
+	/** When the process was started, from mstime_now(). */
+	long long start_ms;
+	/** Set when the process is ready, either because it said so or (without
+	    --notify) because it has been running for ready_delay seconds. */
+	int ready;
+	/** Set between RELOADING=1 and READY=1. */
+	int reloading;
+	/** When we asked it to stop, or 0.  If it has not exited
+	    RETIRE_KILL_TIME seconds later, it gets SIGKILL. */
+	long long term_ms;
+	int killed;
+	/** The socket for sd_notify(3) messages, or -1. */
+	int notify_fd;
+	char notify_name[NOTIFY_NAME_LEN];
+	/** When we last heard WATCHDOG=1 (or when the process started). */
+	long long watchdog_ms;
+	/** The MAINPID= the child told us, or 0. */
+	pid_t main_pid;
+	/** The most recent output. */
+	struct ring output;
+	/** For --silence-timeout: when we last saw output, when the CPU time
+	    last changed, and when we last looked at the CPU time. */
+	long long last_output_ms;
+	long long last_cpu_ms;
+	long long cpu_sample_ms;
+	long long cpu_ticks;
+	/** Set when we have reported it as silent. */
+	int silent;
+	/** How the pause command froze it, or FREEZE_NONE. */
+	enum freeze_method paused;
+};
 
 
 static void usage(int exitcode);
@@ -34,16 +104,50 @@ static void monitor_child(void);
 static void wait_in_select(void);
 static void read_signal_command_pipe(void);
 static void read_command_fifo_fd(void);
-static void read_pty_fd(void);
+static void read_pty_fd(struct generation *gen);
+static void log_child_line(struct generation *gen, char *line);
+static void read_notify_fd(struct generation *gen);
+static void set_generation_ready(struct generation *gen, long long now);
+static int readiness_reported(void);
+static void liveness_probe_failed(struct probe *p);
+static void readiness_probe_changed(struct probe *p, int ready);
 static void maybe_create_pid_file(void);
 static void delete_pid_file(void);
-static void start_child(void);
+static void start_child(struct generation *gen);
+static void start_failed(struct generation *gen);
+static void start_child_when_allowed(void);
+static void start_child_host_limited(void);
+static void read_parent_notify(void);
+static void restart_child(void);
+static void start_overlap_restart(void);
+static void check_generations(void);
+static void check_overlap_restart(long long now);
+static void check_ready_delay(long long now);
+static void check_watchdog(struct generation *gen, long long now);
+static void check_stopping(struct generation *gen, long long now);
+static void check_silence(struct generation *gen, long long now);
+static void check_idle(long long now);
+static void check_watched(long long now);
+static void wait_for_connection(void);
+static void log_hang_diagnostics(struct generation *gen, long long silent_ms);
+static void log_lines(const char *prefix, char *text);
+static void schedule_check(long long when);
+static void snapshot_crashes(void);
+static void reap_generation(struct generation *gen, int status,
+			    const struct rusage *ru);
+static int any_generation_running(void);
+static void kill_generations(int sig);
+static void signal_generation(struct generation *gen, int sig,
+			      const char *signame);
 static void set_child_wait_time(void);
 static void make_signal_command_pipe(void);
 static void make_command_fifo(void);
 static void signal_handler(int sig);
 static void get_user_and_group_names(char *names);
 static void send_command(void);
+static int make_reply_fifo(char *dir, char *name);
+static void remove_reply_fifo(const char *dir, const char *name);
+static int copy_reply(int fd);
 static void stop_monitoring(const char *reason);
 static void start_monitoring(const char *reason);
 static void send_hup_to_child(void);
@@ -51,6 +155,18 @@ static void send_int_to_child(void);
 static void send_kill_to_child(void);
 static void send_term_to_child(void);
 static void kill_child_and_exit(void);
+static void monitor_children(void);
+static void reload_config(const char *reason);
+static void stop_children_and_exit(const char *reason);
+static void scale_pool(char *arg);
+static void rolling_restart_pool(char *arg);
+static void pause_child(const char *reason);
+static void resume_child(const char *reason);
+static void resume_generation(struct generation *gen);
+static void run_hooks(enum hook_event event, pid_t pid, int status,
+		      int delay);
+static int command_has_arg(char c);
+static void read_command_arg(char *arg, size_t len);
 
 /*
  * These are essentially event handlers for the main loop.  The real signal
@@ -71,16 +187,24 @@ static void handle_usr2_signal(void);
 
 static char *           child_dir = NULL;
 static int              go_daemon_flag = 0;
-static char *           email_address = NULL;
 static char **          child_args = NULL;
 static int              clear_env_flag = 0;
 /** List of env vars to set in the child. */
 static struct envlist * child_envlist = NULL;
 /** List of env vars to remove from the child environment. */
 static struct envlist * child_unenvlist = NULL;
-/** PID of our child process.  Set to -1 to indicate that the child is not
+static struct generation generations[2] = {
+	{ .pid = -1, .pty_fd = -1, .notify_fd = -1,
+	  .output = { NULL, OUTPUT_RING_LEN, 0, 0 } },
+	{ .pid = -1, .pty_fd = -1, .notify_fd = -1,
+	  .output = { NULL, OUTPUT_RING_LEN, 0, 0 } },
+};
+/** The newest generation of the child.  child->pid is -1 when the child is not
     running. */
-static pid_t            child_pid = -1;
+static struct generation *child = &generations[0];
+/** The previous generation, while it is still running during an overlapping
+    restart, or NULL. */
+static struct generation *old_child = NULL;
 static char *           pid_file = NULL;
 static int              do_restart = 1;
 static int              do_exit = 0;
@@ -89,10 +213,6 @@ static int              command_fifo_fd = -1;
 static int              command_fifo_write_fd = -1;
 static char *           command_fifo_name = NULL;
 static char *           command_name = NULL;
-static int              pty_fd = -1;
-#define PTY_LINE_LEN 2048
-static char             pty_data[PTY_LINE_LEN];
-static int              pty_data_len = 0;
 static int              min_child_wait_time = 2;
 static int              max_child_wait_time = 300; /* 5 minutes */
 static int              child_wait_time = 2;
@@ -100,37 +220,184 @@ static uid_t            child_uid = 0;
 static char *           child_username = NULL;
 static gid_t            child_gid = 0;
 static char *           child_groupname = NULL;
+static int              overlap_restart_flag = 0;
+static int              ready_delay = 5;
+static int              ready_timeout = 60;
+static int              notify_flag = 0;
+/** Watchdog interval in ms, or 0 for no watchdog. */
+static long long        watchdog_ms = 0;
+/** For --silence-timeout, in ms, or 0. */
+static long long        silence_ms = 0;
+/** --lazy-start and --idle-stop.  waiting_for_connection is set while the
+    child is stopped until someone connects to one of our sockets. */
+static int              lazy_start_flag = 0;
+static long long        idle_stop_ms = 0;
+static int              waiting_for_connection = 0;
+static int              idle_stopping = 0;
+/** Set when the circuit-open hook has been run, until the restart delay is
+    below the maximum again. */
+static int              circuit_open = 0;
+/** Exits of the child since it was started by the start or restart command,
+    or since we started. */
+static int              exits_since_start = 0;
+static long long        idle_check_ms = 0;
+static long long        last_busy_ms = 0;
+enum silence_action {
+	SILENCE_LOG,
+	SILENCE_RESTART,
+	SILENCE_ABORT,
+};
+static enum silence_action silence_action = SILENCE_RESTART;
+/** What to do when a --watch path changes. */
+enum watch_action {
+	WATCH_RESTART,
+	WATCH_HUP,
+};
+static enum watch_action watch_action = WATCH_RESTART;
+/** With --config, we run the children from this file instead of child_args. */
+static char *           config_file = NULL;
+/** Set when we are a sub-monitor started by another process-monitor with
+    --config. */
+static int              managed_flag = 0;
+/** The next time check_generations() has something to do, or 0. */
+static long long        next_check_ms = 0;
+/** Set while a sub-monitor is waiting for its parent to let it start the
+    child, with the time it last asked. */
+static int              start_wanted = 0;
+static long long        start_wanted_ms = 0;
+/** When to try again to start the child, if --host-start-rate held it
+    back, or 0. */
+static long long        host_start_ms = 0;
+/** How long a generation has to exit after we ask it to stop. */
+#define RETIRE_KILL_TIME 6
+/** Seconds between asking our parent again to start the child, in case the
+    message was lost. */
+#define START_REQUEST_INTERVAL 5
+/** Seconds to wait before trying again when the child could not be started
+    at all. */
+#define START_RETRY_TIME 60
 
 
-struct pmCommand { char *command; char c; };
+/**
+ * A command for the command fifo.  Most commands are a single byte.  A command
+ * with an argument is followed by the argument and a newline.  A command with
+ * a reply has an argument that starts with the name of a fifo for the reply,
+ * which the sender makes.
+ */
+struct pmCommand { char *command; char c; int has_arg; int reply; };
 
 static struct pmCommand pmCommands[] = {
-	{ "start"    , '+' },
-	{ "stop"     , '-' },
-	{ "exit"     , 'x' },
-	{ "hup"      , 'h' },
-	{ "int"      , 'i' },
-	{ NULL       , '\0'}
+	{ "start"    , '+', 0, 0 },
+	{ "stop"     , '-', 0, 0 },
+	{ "exit"     , 'x', 0, 0 },
+	{ "hup"      , 'h', 0, 0 },
+	{ "int"      , 'i', 0, 0 },
+	{ "restart"  , 'r', 0, 0 },
+	{ "reload"   , 'R', 0, 0 },
+	{ "scale"    , 'n', 1, 0 },
+	{ "rolling-restart", 'l', 1, 0 },
+	{ "pause"    , 'p', 0, 0 },
+	{ "resume"   , 'c', 0, 0 },
+	{ "crashes"  , 'k', 0, 1 },
+	{ "crash"    , 'K', 1, 1 },
+	{ NULL       , '\0', 0, 0 }
 };
 
+/** Longest command argument, including the newline. */
+#define COMMAND_ARG_LEN 256
+/** Longest name of a reply fifo, and how many seconds to wait for the
+    reply. */
+#define REPLY_NAME_LEN 64
+#define REPLY_TIMEOUT 10
+
+
+/* Options that have no short form. */
+enum {
+	OPT_READY_DELAY = 256,
+	OPT_READY_TIMEOUT,
+	OPT_WATCHDOG,
+	OPT_METRICS_FILE,
+	OPT_LIVENESS_PROBE,
+	OPT_READINESS_PROBE,
+	OPT_PROBE_CONCURRENCY,
+	OPT_SILENCE_TIMEOUT,
+	OPT_SILENCE_ACTION,
+	OPT_MANAGED,
+	OPT_HOST_START_RATE,
+	OPT_RUN_DIR,
+	OPT_LAZY_START,
+	OPT_IDLE_STOP,
+	OPT_SENDMAIL_COMMAND,
+	OPT_EMAIL_INTERVAL,
+	OPT_HOOK,
+	OPT_HOOK_CONCURRENCY,
+	OPT_PLUGIN,
+	OPT_QOS,
+	OPT_QOS_PRIORITY,
+	OPT_CHILD_OOM_SCORE_ADJ,
+	OPT_CRASH_DIR,
+	OPT_CRASH_KEEP,
+	OPT_WATCH,
+	OPT_WATCH_DELAY,
+	OPT_WATCH_ACTION,
+	OPT_STATSD,
+	OPT_SHIP,
+	OPT_SHIP_SPOOL,
+	OPT_SHIP_SPOOL_SIZE,
+};
 
-static const char *short_options = "D:dCc:E:e:hL:l:M:m:P:p:u:V";
+static const char *short_options = "D:dCc:E:e:f:hL:l:M:m:NOP:p:S:u:V";
 static struct option long_options[] = {
 	{ "dir"           , 1, NULL, 'D' },
 	{ "daemon"        , 0, NULL, 'd' },
 	{ "clear-env"     , 0, NULL, 'C' },
 	{ "command"       , 1, NULL, 'c' },
 	{ "command-pipe"  , 1, NULL, 'P' },
+	{ "config"        , 1, NULL, 'f' },
 	{ "email"         , 1, NULL, 'e' },
+	{ "email-interval", 1, NULL, OPT_EMAIL_INTERVAL },
 	{ "env"           , 1, NULL, 'E' },
 	{ "child-log-name", 1, NULL, 'L' },
+	{ "child-oom-score-adj", 1, NULL, OPT_CHILD_OOM_SCORE_ADJ },
+	{ "crash-dir"     , 1, NULL, OPT_CRASH_DIR },
+	{ "crash-keep"    , 1, NULL, OPT_CRASH_KEEP },
 	{ "help"          , 0, NULL, 'h' },
+	{ "hook"          , 1, NULL, OPT_HOOK },
+	{ "hook-concurrency", 1, NULL, OPT_HOOK_CONCURRENCY },
+	{ "host-start-rate", 1, NULL, OPT_HOST_START_RATE },
+	{ "idle-stop"     , 1, NULL, OPT_IDLE_STOP },
+	{ "lazy-start"    , 0, NULL, OPT_LAZY_START },
+	{ "listen"        , 1, NULL, 'S' },
+	{ "liveness-probe", 1, NULL, OPT_LIVENESS_PROBE },
 	{ "log-name"      , 1, NULL, 'l' },
+	{ "managed"       , 1, NULL, OPT_MANAGED },
 	{ "max-wait-time" , 1, NULL, 'M' },
+	{ "metrics-file"  , 1, NULL, OPT_METRICS_FILE },
 	{ "min-wait-time" , 1, NULL, 'm' },
+	{ "notify"        , 0, NULL, 'N' },
+	{ "overlap-restart", 0, NULL, 'O' },
 	{ "pid-file"      , 1, NULL, 'p' },
+	{ "plugin"        , 1, NULL, OPT_PLUGIN },
+	{ "probe-concurrency", 1, NULL, OPT_PROBE_CONCURRENCY },
+	{ "qos"           , 0, NULL, OPT_QOS },
+	{ "qos-priority"  , 1, NULL, OPT_QOS_PRIORITY },
+	{ "ready-delay"   , 1, NULL, OPT_READY_DELAY },
+	{ "ready-timeout" , 1, NULL, OPT_READY_TIMEOUT },
+	{ "readiness-probe", 1, NULL, OPT_READINESS_PROBE },
+	{ "run-dir"       , 1, NULL, OPT_RUN_DIR },
+	{ "sendmail-command", 1, NULL, OPT_SENDMAIL_COMMAND },
+	{ "ship"          , 1, NULL, OPT_SHIP },
+	{ "ship-spool"    , 1, NULL, OPT_SHIP_SPOOL },
+	{ "ship-spool-size", 1, NULL, OPT_SHIP_SPOOL_SIZE },
+	{ "silence-action", 1, NULL, OPT_SILENCE_ACTION },
+	{ "silence-timeout", 1, NULL, OPT_SILENCE_TIMEOUT },
+	{ "statsd"        , 1, NULL, OPT_STATSD },
 	{ "user"          , 1, NULL, 'u' },
 	{ "version"       , 0, NULL, 'V' },
+	{ "watch"         , 1, NULL, OPT_WATCH },
+	{ "watch-action"  , 1, NULL, OPT_WATCH_ACTION },
+	{ "watch-delay"   , 1, NULL, OPT_WATCH_DELAY },
+	{ "watchdog"      , 1, NULL, OPT_WATCHDOG },
 	{ 0               , 0,    0,   0 }
 };
 
@@ -168,7 +435,10 @@ int main(int argc, char **argv)
 			add_env(optarg);
 			break;
 		case 'e':
-			email_address = optarg;
+			mail_set_address(optarg);
+			break;
+		case 'f':
+			config_file = optarg;
 			break;
 		case 'h':
 			usage(0);
@@ -197,15 +467,242 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'N':
+			notify_flag = 1;
+			break;
+		case 'O':
+			overlap_restart_flag = 1;
+			break;
 		case 'p':
 			pid_file = optarg;
 			break;
 		case 'P':
 			command_fifo_name = optarg;
 			break;
+		case 'S':
+			listen_add(optarg);
+			break;
 		case 'u':
 			get_user_and_group_names(optarg);
 			break;
+		case OPT_READY_DELAY:
+			ready_delay = (int)strtol(optarg, &endptr, 10);
+			if (*endptr || ready_delay < 0) {
+				logparent(CM_ERROR,
+					  "strange ready delay: %d\n",
+					  ready_delay);
+				exit(1);
+			}
+			break;
+		case OPT_READY_TIMEOUT:
+			ready_timeout = (int)strtol(optarg, &endptr, 10);
+			if (*endptr || ready_timeout <= 0) {
+				logparent(CM_ERROR,
+					  "strange ready timeout: %d\n",
+					  ready_timeout);
+				exit(1);
+			}
+			break;
+		case OPT_WATCHDOG: {
+			double secs = strtod(optarg, &endptr);
+			if (*endptr || secs <= 0) {
+				logparent(CM_ERROR,
+					  "strange watchdog time: %s\n",
+					  optarg);
+				exit(1);
+			}
+			watchdog_ms = (long long)(secs * 1000);
+			/* The watchdog needs the notify socket. */
+			notify_flag = 1;
+			break;
+		}
+		case OPT_METRICS_FILE:
+			metrics_set_file(optarg);
+			break;
+		case OPT_LIVENESS_PROBE:
+			probe_add(PROBE_LIVENESS, optarg);
+			break;
+		case OPT_READINESS_PROBE:
+			probe_add(PROBE_READINESS, optarg);
+			break;
+		case OPT_PROBE_CONCURRENCY: {
+			int n = (int)strtol(optarg, &endptr, 10);
+			if (*endptr || n <= 0) {
+				logparent(CM_ERROR,
+					  "strange probe concurrency: %s\n",
+					  optarg);
+				exit(1);
+			}
+			probe_set_concurrency(n);
+			break;
+		}
+		case OPT_SILENCE_TIMEOUT: {
+			double secs = strtod(optarg, &endptr);
+			if (*endptr || secs <= 0) {
+				logparent(CM_ERROR,
+					  "strange silence timeout: %s\n",
+					  optarg);
+				exit(1);
+			}
+			silence_ms = (long long)(secs * 1000);
+			break;
+		}
+		case OPT_SILENCE_ACTION:
+			if (! strcmp(optarg, "log")) {
+				silence_action = SILENCE_LOG;
+			} else if (! strcmp(optarg, "restart")) {
+				silence_action = SILENCE_RESTART;
+			} else if (! strcmp(optarg, "abort")) {
+				silence_action = SILENCE_ABORT;
+			} else {
+				logparent(CM_ERROR,
+					  "unknown silence action: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_HOST_START_RATE:
+			if (hostlimit_set_rate(optarg)) {
+				logparent(CM_ERROR,
+					  "strange host start rate: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_RUN_DIR:
+			hostlimit_set_run_dir(optarg);
+			break;
+		case OPT_PLUGIN:
+			plugin_add(optarg);
+			break;
+		case OPT_QOS:
+			qos_enable();
+			break;
+		case OPT_QOS_PRIORITY:
+			if (qos_set_priority(optarg)) {
+				logparent(CM_ERROR,
+					  "strange qos priority: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_CHILD_OOM_SCORE_ADJ:
+			if (qos_set_child_oom_score_adj(optarg)) {
+				logparent(CM_ERROR,
+					  "strange child oom_score_adj: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_SHIP:
+			if (ship_set_address(optarg))
+				exit(1);
+			break;
+		case OPT_SHIP_SPOOL:
+			ship_set_spool(optarg);
+			break;
+		case OPT_SHIP_SPOOL_SIZE:
+			if (ship_set_spool_size(optarg)) {
+				logparent(CM_ERROR,
+					  "strange log spool size: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_STATSD:
+			if (statsd_set_mode(optarg)) {
+				logparent(CM_ERROR,
+					  "unknown statsd socket type: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_WATCH:
+			watch_add(optarg);
+			break;
+		case OPT_WATCH_DELAY:
+			if (watch_set_delay(optarg)) {
+				logparent(CM_ERROR,
+					  "strange watch delay: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_WATCH_ACTION:
+			if (! strcmp(optarg, "restart")) {
+				watch_action = WATCH_RESTART;
+			} else if (! strcmp(optarg, "hup")) {
+				watch_action = WATCH_HUP;
+			} else {
+				logparent(CM_ERROR,
+					  "unknown watch action: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_CRASH_DIR:
+			crash_set_dir(optarg);
+			break;
+		case OPT_CRASH_KEEP:
+			if (crash_set_keep(optarg)) {
+				logparent(CM_ERROR,
+					  "strange crash record count: %s\n",
+					  optarg);
+				exit(1);
+			}
+			break;
+		case OPT_HOOK:
+			if (hook_add(optarg))
+				exit(1);
+			break;
+		case OPT_HOOK_CONCURRENCY: {
+			int n = (int)strtol(optarg, &endptr, 10);
+			if (*endptr || n < 1) {
+				logparent(CM_ERROR,
+					  "strange hook concurrency: %s\n",
+					  optarg);
+				exit(1);
+			}
+			hook_set_concurrency(n);
+			break;
+		}
+		case OPT_SENDMAIL_COMMAND:
+			mail_set_command(optarg);
+			break;
+		case OPT_EMAIL_INTERVAL: {
+			int secs = (int)strtol(optarg, &endptr, 10);
+			if (*endptr || secs < 0) {
+				logparent(CM_ERROR,
+					  "strange email interval: %s\n",
+					  optarg);
+				exit(1);
+			}
+			mail_set_interval(secs);
+			break;
+		}
+		case OPT_LAZY_START:
+			lazy_start_flag = 1;
+			break;
+		case OPT_IDLE_STOP: {
+			double secs = strtod(optarg, &endptr);
+			if (*endptr || secs <= 0) {
+				logparent(CM_ERROR,
+					  "strange idle stop time: %s\n",
+					  optarg);
+				exit(1);
+			}
+			idle_stop_ms = (long long)(secs * 1000);
+			break;
+		}
+		case OPT_MANAGED:
+			/* A sub-monitor logs in the same way as the
+			   process-monitor that started it. */
+			managed_flag = 1;
+			if (! strcmp(optarg, "daemon"))
+				is_daemon = 1;
+			/* Don't outlive the process-monitor that started us. */
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			break;
 		case 'V':
 			printf("process-monitor 0.1\n");
 			exit(0);
@@ -296,6 +793,31 @@ int main(int argc, char **argv)
 			  max_child_wait_time);
 	}
 
+	if (config_file) {
+		if (argv[optind] || command_name) {
+			fprintf(stderr,
+				"%s: Can't use a configuration file with a "
+				"program name or a command.\n"
+				"   -h for help\n",
+				get_parent_log_name());
+			exit(1);
+		}
+		manager_set_options(long_options, argv[0]);
+		if (manager_load(config_file))
+			exit(1);
+		make_signal_command_pipe();
+		make_command_fifo();
+		watch_start();
+		if (go_daemon_flag) {
+			go_daemon();
+		}
+		maybe_create_pid_file();
+		qos_start();
+		set_signal_handlers();
+		monitor_children();
+		/*NOTREACHED - monitor_children() does not return. */
+	}
+
 	if (! argv[optind]) {
 		if (command_name) {
 			send_command();
@@ -326,13 +848,32 @@ int main(int argc, char **argv)
 			set_child_log_name(argv[optind]);
 	}
 	child_args = argv + optind;
+	/* Only report to whoever started us if we know when the child is
+	   ready.  Otherwise the child can talk to them itself. */
+	if (managed_flag || readiness_reported())
+		notify_parent_init();
+	if ((lazy_start_flag || idle_stop_ms) && ! listen_count()) {
+		fprintf(stderr, "%s: --lazy-start and --idle-stop need "
+			"--listen\n", get_parent_log_name());
+		exit(1);
+	}
 
+	listen_open_all();
+	probe_check_targets();
+	statsd_open(child_uid);
+	if (! config_file)
+		plugin_load_all();
+	probe_set_callbacks(liveness_probe_failed, readiness_probe_changed);
 	make_signal_command_pipe();
 	make_command_fifo();
+	watch_start();
 	if (go_daemon_flag) {
 		go_daemon();
 	}
 	maybe_create_pid_file();
+	listen_unlink_at_exit();
+	qos_start();
+	ship_start();
 
 	set_signal_handlers();
 	monitor_child();
@@ -390,31 +931,96 @@ void usage(int exitcode)
 	 */
 	fprintf(stderr, "\
 Usage: %s [args] [--] childpath [child_args...]\n\
-       %s -P <pipe> --command=stop|start|exit|hup|int\n\
+       %s [args] --config <file>\n\
+       %s -P <pipe> --command=stop|start|exit|hup|int|restart|reload\n\
+       %s -P <pipe> --command=pause|resume\n\
+       %s -P <pipe> --command='scale <pool> <n>'\n\
+       %s -P <pipe> --command='rolling-restart <pool> [<n>]'\n\
+       %s -P <pipe> --command=crashes|'crash <id>'\n\
   -C|--clear-env              Clear the environment before setting the vars\n\
                               specified with -E\n\
   -c|--command <command>      Make a running process-monitor react to\n\
                               <command>\n\
+  --crash-dir <dir>           Write a record of each crash of the child\n\
+                                in <dir>\n\
+  --crash-keep <n>            Keep the newest <n> crash records (default 20)\n\
   -D|--dir <dirname>          Change to <dirname> before starting child\n\
   -d|--daemon                 Go into the background\n\
                                 (changes some signal handling behaviour)\n\
   -E|--env <var=value>        Environment var for child process\n\
                                 (can use multiple times)\n\
   -e|--email <addr>           Email when child restarts\n\
-                                (not implemented)\n\
+  --email-interval <time>     Send at most one email every <time> seconds\n\
+                                (default 300)\n\
+  -f|--config <file>          Run the children described in <file>\n\
   -h|--help                   This message\n\
+  --hook <event>[:<time>]=<cmd>\n\
+                              Run <cmd> on <event>, for at most <time>\n\
+                                seconds (see the man page, can use\n\
+                                multiple times)\n\
+  --hook-concurrency <n>      Run at most <n> hooks at once\n\
+  --host-start-rate <n>[:<b>] Share a limit of <n> child starts per second\n\
+                                (bursts of <b>) with other process-monitors\n\
+  --idle-stop <time>          Stop the child after <time> seconds with no\n\
+                                connections or output (needs -S)\n\
   -L|--child-log-name <name>  Name to use in messages that come from the\n\
                                child process\n\
+  --child-oom-score-adj <n>   Set the child's oom_score_adj to <n>\n\
+  --lazy-start                Start the child on the first connection\n\
+                                (needs -S)\n\
   -l|--log-name <name>        Name to use in our own messages\n\
+  --liveness-probe <probe>    Restart the child when <probe> fails\n\
+                                (see the man page, can use multiple times)\n\
   -M|--max-wait-time <time>   Maximum time between child starts\n\
+  --metrics-file <file>       Write metrics to <file>\n\
   -m|--min-wait-time <time>   Minimum time between child starts\n\
                                 (seconds, cannot be less than 1)\n\
+  -N|--notify                 Give the child a NOTIFY_SOCKET for sd_notify()\n\
+  -O|--overlap-restart        On the restart command, start the new child\n\
+                                before stopping the old one\n\
   -P|--command-pipe <pipe>    Open named pipe <pipe> to receive commands\n\
   -p|--pid-file <file>        Write PID to <file>, if in the background\n\
+  --plugin <file>[=<arg>]     Load a plugin (can use multiple times)\n\
+  --probe-concurrency <n>     Run at most <n> probes at once\n\
+  --qos                       Lock our memory and make the OOM killer\n\
+                                avoid us\n\
+  --qos-priority <n>          Run with real time (SCHED_RR) priority <n>\n\
+  --ready-delay <time>        With -O or in a configuration file, seconds\n\
+                                before a new child is ready (without -N)\n\
+  --ready-timeout <time>      With -O and -N, seconds to wait for READY=1\n\
+  --readiness-probe <probe>   The child is ready when <probe> succeeds\n\
+  --run-dir <dir>             Keep state shared with other process-monitors\n\
+                                in <dir> (default /run/process-monitor)\n\
+  --sendmail-command <cmd>    Send email with <cmd>\n\
+                                (default /usr/sbin/sendmail -t -oi)\n\
+  --ship <addr>               Send the child's output to a log collector at\n\
+                                <addr> (tcp:[host:]port or unix:path)\n\
+  --ship-spool <dir>          Keep log records in <dir> while the collector\n\
+                                is down\n\
+  --ship-spool-size <n>       Keep at most <n> bytes in the spool (can end\n\
+                                in k, M or G, default 64M)\n\
+  --silence-timeout <time>    Act if the child has no output and uses no CPU\n\
+                                for <time> seconds\n\
+  --silence-action <action>   log, restart (default) or abort\n\
+  --statsd unix|udp           Take statsd metrics from the child on a unix\n\
+                                or UDP socket, for --metrics-file\n\
+  -S|--listen <socket>        Listen on <socket> and pass it to the child\n\
+                                (tcp:[host:]port or unix:path, can use\n\
+                                multiple times)\n\
   -u|--user <user>            User to run child as (name or uid)\n\
                                 (can be user:group)\n\
+  --watch <path>              Restart the child when <path> changes (can\n\
+                                use multiple times)\n\
+  --watch-action <action>     restart (default) or hup\n\
+  --watch-delay <time>        Act when the --watch paths have not changed\n\
+                                for <time> seconds (default 2)\n\
+  --watchdog <time>           Restart the child if it does not send\n\
+                                WATCHDOG=1 every <time> seconds (implies -N)\n\
   -- is required if childpath or any of child_args begin with -\n",
-		get_parent_log_name(), get_parent_log_name());
+		get_parent_log_name(), get_parent_log_name(),
+		get_parent_log_name(), get_parent_log_name(),
+		get_parent_log_name(), get_parent_log_name(),
+		get_parent_log_name());
 	exit(exitcode);
 }
 
@@ -527,6 +1133,65 @@ static void set_signal_handlers(void)
 }
 
 
+/**
+ * Start the child when it is not running, or as a sub-monitor, ask our
+ * parent first.  It limits how many children start at once, and replies with
+ * START=1 when it is our turn.
+ */
+static void start_child_when_allowed(void)
+{
+	if (! managed_flag || notify_parent_fd() < 0) {
+		start_child_host_limited();
+		return;
+	}
+	start_wanted = 1;
+	start_wanted_ms = mstime_now();
+	notify_parent("WANT_START=1");
+	schedule_check(start_wanted_ms + START_REQUEST_INTERVAL * 1000LL);
+}
+
+
+/**
+ * Read replies from our parent process-monitor.
+ */
+static void read_parent_notify(void)
+{
+	struct notify_msg msg;
+	int ret;
+
+	while ((ret = notify_recv(notify_parent_fd(), getuid(), &msg)) >= 0) {
+		if (! ret || ! msg.start || msg.pid != getppid())
+			continue;
+		if (start_wanted && do_restart && ! do_exit
+		    && child->pid <= 0)
+			start_child_host_limited();
+		start_wanted = 0;
+	}
+}
+
+
+/**
+ * Start the child now if --host-start-rate allows it, or try again when it
+ * will.
+ */
+static void start_child_host_limited(void)
+{
+	long long now = mstime_now();
+	long long wait;
+
+	wait = hostlimit_take(now);
+	if (! wait) {
+		start_child(child);
+		return;
+	}
+	if (! host_start_ms)
+		logparent(CM_INFO, "host start limit: waiting to start %s\n",
+			  child_args[0]);
+	host_start_ms = now + wait;
+	schedule_check(host_start_ms);
+}
+
+
 /**
  * Run child and monitor the process.
  *
@@ -540,13 +1205,123 @@ static void set_signal_handlers(void)
 static void monitor_child(void)
 {
 
-	start_child();
+	if (lazy_start_flag)
+		wait_for_connection();
+	else
+		start_child_when_allowed();
+	while (1) {
+		wait_in_select();
+	}
+}
+
+
+/**
+ * Run the children from the configuration file.
+ *
+ * Each child has its own sub-monitor, so the main loop only has to watch for
+ * sub-monitors exiting, signals, and commands.
+ */
+static void monitor_children(void)
+{
+	manager_start();
 	while (1) {
 		wait_in_select();
 	}
 }
 
 
+/**
+ * Read the configuration file again, and start, stop or restart only the
+ * children that have changed.
+ */
+static void reload_config(const char *reason)
+{
+	if (! config_file) {
+		logparent(CM_WARN, "%s: no configuration file to reload\n",
+			  reason);
+		return;
+	}
+	if (do_exit)
+		return;
+	logparent(CM_INFO, "%s: reloading\n", reason);
+	manager_reload();
+}
+
+
+/**
+ * Change the number of instances in a pool, for the command "scale NAME N".
+ */
+static void scale_pool(char *arg)
+{
+	char *name;
+	char *count;
+	char *endptr;
+	int n;
+
+	name = strtok(arg, " \t");
+	count = strtok(NULL, " \t");
+	if (! name || ! count || strtok(NULL, " \t")) {
+		logparent(CM_WARN, "Command: scale needs a pool name "
+			  "and a number\n");
+		return;
+	}
+	n = (int)strtol(count, &endptr, 10);
+	if (*endptr || n < 0) {
+		logparent(CM_WARN, "Command: strange instance count: %s\n",
+			  count);
+		return;
+	}
+	manager_scale(name, n);
+}
+
+
+/**
+ * Restart the instances of a pool a few at a time, for the command
+ * "rolling-restart NAME [N]".
+ */
+static void rolling_restart_pool(char *arg)
+{
+	char *name;
+	char *count;
+	char *endptr;
+	int n = 0;
+
+	name = strtok(arg, " \t");
+	count = strtok(NULL, " \t");
+	if (! name || (count && strtok(NULL, " \t"))) {
+		logparent(CM_WARN, "Command: rolling-restart needs a pool name "
+			  "and maybe a number\n");
+		return;
+	}
+	if (count) {
+		n = (int)strtol(count, &endptr, 10);
+		if (*endptr || n < 1) {
+			logparent(CM_WARN, "Command: strange max-unavailable: "
+				  "%s\n", count);
+			return;
+		}
+	}
+	manager_rolling_restart(name, n);
+}
+
+
+/**
+ * Stop all the children from the configuration file, and exit when they have
+ * gone.
+ */
+static void stop_children_and_exit(const char *reason)
+{
+	logparent(CM_INFO, "%s: stopping all children\n", reason);
+	do_restart = 0;
+	do_exit = 1;
+	manager_stop_all();
+	if (! manager_running()) {
+		logparent(CM_INFO, "process-monitor exiting\n");
+		exit(0);
+	}
+}
+
+
 /**
  * Do one iteration of the select() loop.
  *
@@ -559,37 +1334,81 @@ static void monitor_child(void)
 static void wait_in_select(void)
 {
 	fd_set read_fds;
+	fd_set write_fds;
 	struct timeval timeout;
+	long long timeout_ms;
 	int ret;
 	int nfds;
+	int i;
 
 	FD_ZERO(&read_fds);
+	FD_ZERO(&write_fds);
 	FD_SET(signal_command_pipe[0], &read_fds);
 	nfds = signal_command_pipe[0];
-	/* logparent(CM_INFO, "--- select pty_fd==%d\n", pty_fd); */
-	if (pty_fd >= 0) {
-		FD_SET(pty_fd, &read_fds);
-		if (pty_fd > nfds)
-			nfds = pty_fd;
+	for (i = 0; i < 2; i++) {
+		int pty_fd = generations[i].pty_fd;
+		int notify_fd = generations[i].notify_fd;
+		if (pty_fd >= 0) {
+			FD_SET(pty_fd, &read_fds);
+			if (pty_fd > nfds)
+				nfds = pty_fd;
+		}
+		if (notify_fd >= 0) {
+			FD_SET(notify_fd, &read_fds);
+			if (notify_fd > nfds)
+				nfds = notify_fd;
+		}
 	}
 	if (command_fifo_fd >= 0) {
 		FD_SET(command_fifo_fd, &read_fds);
 		if (command_fifo_fd > nfds)
 			nfds = command_fifo_fd;
 	}
+	if (waiting_for_connection)
+		listen_fill_fds(&read_fds, &nfds);
+	if (notify_parent_fd() >= 0) {
+		FD_SET(notify_parent_fd(), &read_fds);
+		if (notify_parent_fd() > nfds)
+			nfds = notify_parent_fd();
+	}
+	probe_fill_fds(&read_fds, &write_fds, &nfds);
+	hook_fill_fds(&read_fds, &nfds);
+	plugin_fill_fds(&read_fds, &write_fds, &nfds);
+	manager_fill_fds(&read_fds, &nfds);
+	mail_fill_fds(&write_fds, &nfds);
+	watch_fill_fds(&read_fds, &nfds);
+	statsd_fill_fds(&read_fds, &nfds);
+	ship_fill_fds(&read_fds, &write_fds, &nfds);
 	nfds++;
-	timeout.tv_sec = child_wait_time;
-	timeout.tv_usec = 0;
-	ret = select(nfds, &read_fds, 0, 0, &timeout);
+	timeout_ms = child_wait_time * 1000LL;
+	if (next_check_ms) {
+		long long until = next_check_ms - mstime_now();
+		if (until < 0)
+			until = 0;
+		if (until < timeout_ms)
+			timeout_ms = until;
+	}
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	ret = select(nfds, &read_fds, &write_fds, 0, &timeout);
 	/* logparent(CM_INFO, "--- select returns %d\n", ret); */
-	if (-1 == ret && errno != EINTR) {
-		logparent(CM_WARN, "select error: %s\n",
-			  strerror(errno));
-	}
-	/* Read data on the pty first so we don't miss any. */
-	if (pty_fd >= 0) {
-		if (FD_ISSET(pty_fd, &read_fds)) {
-			read_pty_fd();
+	if (-1 == ret) {
+		if (errno != EINTR)
+			logparent(CM_WARN, "select error: %s\n",
+				  strerror(errno));
+		/* The fd sets are undefined after an error. */
+		FD_ZERO(&read_fds);
+		FD_ZERO(&write_fds);
+	}
+	/* Read data on the ptys first so we don't miss any. */
+	for (i = 0; i < 2; i++) {
+		int pty_fd = generations[i].pty_fd;
+		int notify_fd = generations[i].notify_fd;
+		if (pty_fd >= 0 && FD_ISSET(pty_fd, &read_fds)) {
+			read_pty_fd(&generations[i]);
+		}
+		if (notify_fd >= 0 && FD_ISSET(notify_fd, &read_fds)) {
+			read_notify_fd(&generations[i]);
 		}
 	}
 	if (FD_ISSET(signal_command_pipe[0], &read_fds)) {
@@ -599,6 +1418,25 @@ static void wait_in_select(void)
 	    && FD_ISSET(command_fifo_fd, &read_fds)) {
 		read_command_fifo_fd();
 	}
+	if (notify_parent_fd() >= 0 && FD_ISSET(notify_parent_fd(), &read_fds))
+		read_parent_notify();
+	if (waiting_for_connection && listen_ready(&read_fds)) {
+		logparent(CM_INFO, "connection on %s\n",
+			  listen_ready(&read_fds));
+		waiting_for_connection = 0;
+		if (do_restart && ! do_exit && child->pid <= 0)
+			start_child_when_allowed();
+	}
+	probe_handle_fds(&read_fds, &write_fds);
+	hook_handle_fds(&read_fds);
+	plugin_handle_fds(&read_fds, &write_fds);
+	manager_handle_fds(&read_fds);
+	mail_handle_fds(&write_fds);
+	watch_handle_fds(&read_fds);
+	statsd_handle_fds(&read_fds);
+	ship_handle_fds(&read_fds, &write_fds);
+	check_generations();
+	metrics_write();
 }
 
 
@@ -673,6 +1511,7 @@ static void read_command_fifo_fd(void)
 {
 	int read_ret;
 	char c;
+	char arg[COMMAND_ARG_LEN];
 
 	while (1) {
 		read_ret = read(command_fifo_fd, &c, 1);
@@ -695,6 +1534,38 @@ static void read_command_fifo_fd(void)
 			return;
 		default:
 			/* logparent(CM_INFO, "command fifo: %c\n", c); */
+			arg[0] = '\0';
+			if (command_has_arg(c))
+				read_command_arg(arg, sizeof(arg));
+			if (config_file) {
+				switch (c) {
+				case 'R':
+					reload_config("Command");
+					break;
+				case 'n':
+					scale_pool(arg);
+					break;
+				case 'l':
+					rolling_restart_pool(arg);
+					break;
+				case 'x':
+					stop_children_and_exit("Command");
+					break;
+				case 'k':
+				case 'K':
+					crash_reply_error(arg, "crash records "
+							  "are kept by each "
+							  "child's own "
+							  "process-monitor\n");
+					break;
+				default:
+					logparent(CM_WARN, "Command char %c "
+						  "is not used with a "
+						  "configuration file\n", c);
+					break;
+				}
+				continue;
+			}
 			switch (c) {
 			case '+':
 				start_monitoring("Command");
@@ -708,6 +1579,28 @@ static void read_command_fifo_fd(void)
 			case 'i':
 				send_int_to_child();
 				break;
+			case 'r':
+				restart_child();
+				break;
+			case 'R':
+				reload_config("Command");
+				break;
+			case 'p':
+				pause_child("Command");
+				break;
+			case 'c':
+				resume_child("Command");
+				break;
+			case 'k':
+			case 'K':
+				crash_command(c, arg);
+				break;
+			case 'n':
+			case 'l':
+				logparent(CM_WARN, "Command: %s needs a "
+					  "configuration file\n",
+					  c == 'n' ? "scale" : "rolling-restart");
+				break;
 			case 'x':
 				kill_child_and_exit();
 			default:
@@ -725,46 +1618,82 @@ static void read_command_fifo_fd(void)
 }
 
 
+static int command_has_arg(char c)
+{
+	struct pmCommand *pmc;
+
+	for (pmc = pmCommands; pmc->command; pmc++) {
+		if (pmc->c == c)
+			return pmc->has_arg || pmc->reply;
+	}
+	return 0;
+}
+
+
+/**
+ * Read the argument of a command, up to its newline.
+ *
+ * The sender writes the whole command with one write(), which is atomic for
+ * a fifo, so the argument is already there.
+ */
+static void read_command_arg(char *arg, size_t len)
+{
+	size_t n = 0;
+	char c;
+
+	while (read(command_fifo_fd, &c, 1) == 1 && c != '\n') {
+		if (n < len - 1)
+			arg[n++] = c;
+	}
+	arg[n] = '\0';
+}
+
+
 static void kill_child_and_exit(void)
 {
 	time_t start;
 
 	start = time(0);
 
-	if (child_pid <= 0)
+	if (! any_generation_running())
 		exit(0);
 	do_restart = 0;
 	do_exit = 1;
 	send_term_to_child();
 	min_child_wait_time = 5;
 	max_child_wait_time = 5;
-	while ((time(0) - start) < 6 && child_pid > 0)
+	while ((time(0) - start) < 6 && any_generation_running())
 		wait_in_select();
-	if (child_pid > 0)
+	if (any_generation_running())
 		send_kill_to_child();
 	exit(0);
 }
 
 
 /**
- * Read data from the pty.
+ * Read data from the pty of one generation of the child.
  */
-static void read_pty_fd(void)
+static void read_pty_fd(struct generation *gen)
 {
 	char buf[1024];
+	char *pty_data = gen->pty_data;
 
-	if (pty_fd <= 0)
+	if (gen->pty_fd <= 0)
 		return;
+	/* Both generations log with the same name, so make sure the pid in
+	   the messages is the right one. */
+	set_child_log_pid(gen->pid);
 
 	while (1) {
 		int ret;
 		int i;
 
-		ret = read(pty_fd, buf, 1024);
+		ret = read(gen->pty_fd, buf, 1024);
 		if (0 == ret) {
 			/* pty closed - dead child? */
 			logparent(CM_INFO, "pty closed\n");
-			pty_fd = -1;
+			close(gen->pty_fd);
+			gen->pty_fd = -1;
 			return;
 		} else if (-1 == ret) {
 			if (errno != EWOULDBLOCK) {
@@ -776,32 +1705,34 @@ static void read_pty_fd(void)
 					logparent(CM_INFO,
 						  "cannot read from pty: %s\n",
 						  strerror(errno));
-				close(pty_fd);
-				pty_fd = -1;
+				close(gen->pty_fd);
+				gen->pty_fd = -1;
 			}
 			return;
 		}
+		ring_write(&gen->output, buf, ret);
+		gen->last_output_ms = mstime_now();
 		for (i=0; i<ret; i++) {
-			pty_data[pty_data_len++] = buf[i];
+			pty_data[gen->pty_data_len++] = buf[i];
 			if (buf[i] == '\n' || buf[i] == '\0') {
-				pty_data[pty_data_len] = '\0';
+				pty_data[gen->pty_data_len] = '\0';
 				/* If the line ends in \r\n, move the \n back
 				   one and re-terminate it so it ends in only
 				   \n. */
-				if (pty_data_len >=2
-				    && pty_data[pty_data_len-1] == '\n'
-				    && pty_data[pty_data_len-2] == '\r') {
-					pty_data[pty_data_len-2] = '\n';
-					pty_data[pty_data_len-1] = '\0';
+				if (gen->pty_data_len >=2
+				    && pty_data[gen->pty_data_len-1] == '\n'
+				    && pty_data[gen->pty_data_len-2] == '\r') {
+					pty_data[gen->pty_data_len-2] = '\n';
+					pty_data[gen->pty_data_len-1] = '\0';
 				}
-				logchild(CM_INFO, "%s", pty_data);
-				pty_data_len = 0;
+				log_child_line(gen, pty_data);
+				gen->pty_data_len = 0;
 				continue;
 			}
-			if (pty_data_len == PTY_LINE_LEN-1) {
-				pty_data[pty_data_len] = '\0';
-				logchild(CM_INFO, "%s\n", pty_data);
-				pty_data_len = 0;
+			if (gen->pty_data_len == PTY_LINE_LEN-1) {
+				pty_data[gen->pty_data_len] = '\0';
+				log_child_line(gen, pty_data);
+				gen->pty_data_len = 0;
 				continue;
 			}
 		}
@@ -809,14 +1740,31 @@ static void read_pty_fd(void)
 }
 
 
+/**
+ * Log a line of output from the child, after passing it through the plugins'
+ * output filters.  line may end with a newline, and is modified.
+ */
+static void log_child_line(struct generation *gen, char *line)
+{
+	size_t len = strlen(line);
+
+	if (len && line[len - 1] == '\n')
+		line[len - 1] = '\0';
+	if (plugin_filter_output(line))
+		return;
+	plugin_event(PM_EVENT_OUTPUT, gen->pid, line, 0);
+	logchild(CM_INFO, "%s\n", line);
+}
+
+
 /**
  * On SIGALRM, restart the child if it's not running.
  */
 static void handle_alarm_signal(void)
 {
 	if (do_restart) {
-		if (child_pid <= 0) {
-			start_child();
+		if (child->pid <= 0) {
+			start_child_when_allowed();
 		}
 	}
 
@@ -828,9 +1776,10 @@ static void handle_alarm_signal(void)
 
 static void handle_child_signal(void)
 {
+	struct rusage ru;
 	int status;
-	int wait_time;
 	pid_t pid;
+	int i;
 
 	/* Read data from the child here so we flush that file before it's
 	 * closed.  We seem to sometimes get the SIGCHLD (and hence end up here
@@ -841,57 +1790,185 @@ static void handle_child_signal(void)
 	 * I don't understand the buffering that's happening here, but
 	 * there is definitely something buffering data on the pty.
 	 */
-	read_pty_fd();
+	for (i = 0; i < 2; i++)
+		read_pty_fd(&generations[i]);
 
-	/* We do the check for child_pid==-1 after the call to waitpid() since
-	 * if we get a SIGCHLD, we need to call waitpid() in any case, even if
-	 * we're ignoring that child.
+	/* We call wait4() until there are no more exited children, even if
+	 * they are not ones we're interested in.  Several children can exit
+	 * for one SIGCHLD, eg both generations during an overlapping restart.
 	 */
-	pid = waitpid(-1, &status, WNOHANG);
-	if (-1 == pid || -1 == child_pid || pid != child_pid) {
-		return;
+	snapshot_crashes();
+	while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+		for (i = 0; i < 2; i++) {
+			if (generations[i].pid == pid) {
+				reap_generation(&generations[i], status, &ru);
+				break;
+			}
+		}
+		if (i == 2 && ! manager_reaped(pid, status)
+		    && ! mail_reaped(pid, status) && ! hook_reaped(pid, status)
+		    && ! crash_reaped(pid, status))
+			probe_reaped(pid, status);
+	}
+	if (config_file && do_exit && ! manager_running()) {
+		logparent(CM_INFO, "process-monitor exiting\n");
+		exit(0);
 	}
+}
 
-	if (WIFSIGNALED(status)) {
-		logparent(CM_INFO,
-			  "%s[%d] exited due to signal %d with status %d\n",
-			  child_args[0], child_pid, WTERMSIG(status),
-			  WEXITSTATUS(status));
-	} else {
-		int retval = WEXITSTATUS(status);
-		/* 99 is returned by the child when the exec fails.  Don't log
+
+/**
+ * Look at a generation that has died of a signal before wait4() takes it
+ * away, for its crash record.
+ */
+static void snapshot_crashes(void)
+{
+	siginfo_t info;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (generations[i].pid <= 0)
+			continue;
+		info.si_pid = 0;
+		if (waitid(P_PID, generations[i].pid, &info,
+			   WEXITED|WNOHANG|WNOWAIT))
+			continue;
+		if (info.si_pid && (info.si_code == CLD_KILLED
+				    || info.si_code == CLD_DUMPED))
+			crash_snapshot(generations[i].pid);
+	}
+}
+
+
+/**
+ * Clean up after one generation of the child has exited, and restart it if
+ * necessary.
+ */
+static void reap_generation(struct generation *gen, int status,
+			    const struct rusage *ru)
+{
+	pid_t pid = gen->pid;
+	int wait_time;
+
+	if (WIFSIGNALED(status)) {
+		logparent(CM_INFO,
+			  "%s[%d] exited due to signal %d with status %d\n",
+			  child_args[0], gen->pid, WTERMSIG(status),
+			  WEXITSTATUS(status));
+	} else {
+		int retval = WEXITSTATUS(status);
+		/* 99 is returned by the child when the exec fails.  Don't log
 		   that as the child will already have logged the failure. */
 		if (retval != 99) {
 			logparent(CM_INFO,
 				  "%s[%d] exited with status %d\n",
-				  child_args[0], child_pid,
+				  child_args[0], gen->pid,
 				  WEXITSTATUS(status));
 		}
 	}
-	child_pid = -1;
-	if (pty_fd >= 0) {
-		logparent(CM_INFO, "closing pty_fd (%d)\n", pty_fd);
-		close(pty_fd);
-		pty_fd = -1;
+	gen->pid = -1;
+	gen->paused = FREEZE_NONE;
+	crash_child_exited(pid, status, gen->term_ms != 0, ru,
+			   mstime_now() - gen->start_ms, &gen->output,
+			   child_args, child_dir);
+	run_hooks(HOOK_EXIT, pid, status, -1);
+	plugin_event(PM_EVENT_EXIT, pid, NULL, status);
+	if (gen->pty_fd >= 0) {
+		logparent(CM_INFO, "closing pty_fd (%d)\n", gen->pty_fd);
+		close(gen->pty_fd);
+		gen->pty_fd = -1;
+	}
+	if (gen->notify_fd >= 0) {
+		/* Pick up anything it said on its way out. */
+		read_notify_fd(gen);
+		close(gen->notify_fd);
+		gen->notify_fd = -1;
+	}
+
+	if (gen == old_child) {
+		/* The old generation has gone, either because we retired it or
+		   because it died by itself.  Either way, the new one takes
+		   over. */
+		old_child = NULL;
+	} else if (old_child && ! gen->ready) {
+		/* The new generation died before it was ready.  Keep the old
+		   one. */
+		logparent(CM_WARN, "new %s failed, keeping %s[%d]\n",
+			  child_args[0], child_args[0], old_child->pid);
+		child = old_child;
+		old_child = NULL;
+		probe_start();
+	}
+	if (child->pid <= 0)
+		probe_stop();
+	notify_parent("CHILD_PID=%d\n%s", child->pid > 0 ? (int)child->pid : 0,
+		      child->pid > 0 && child->ready ? "READY=1" : "");
+	if (readiness_reported()) {
+		char name[200];
+		metrics_name(name, sizeof(name), "child_ready",
+			     get_child_log_name());
+		metrics_set(name, child->pid > 0 && child->ready);
 	}
 
 	if (do_exit) {
-		logparent(CM_INFO, "process-monitor exiting\n");
-		exit(0);
+		if (! any_generation_running()) {
+			logparent(CM_INFO, "process-monitor exiting\n");
+			exit(0);
+		}
+		return;
 	}
 
-	if (do_restart) {
+	if (idle_stopping && child->pid <= 0) {
+		idle_stopping = 0;
+		child_wait_time = min_child_wait_time;
+		if (do_restart)
+			wait_for_connection();
+		return;
+	}
+
+	if (do_restart && child->pid <= 0) {
+		struct pm_exit ex;
+
 		if (child_wait_time == 0)
 			wait_time = 1;
 		else
 			wait_time = child_wait_time;
+		ex.pid = pid;
+		ex.status = status;
+		ex.run_ms = mstime_now() - gen->start_ms;
+		ex.restarts = ++exits_since_start;
+		ex.default_delay = wait_time;
+		switch (plugin_restart_policy(&ex, &wait_time)) {
+		case PM_RESTART_NEVER:
+			stop_monitoring("Plugin");
+			return;
+		case PM_RESTART_AFTER:
+			if (wait_time < 1)
+				wait_time = 1;
+			break;
+		case PM_RESTART_DEFAULT:
+			break;
+		}
+		mail_child_exited(get_child_log_name(), pid, status, ru,
+				  ex.run_ms, &gen->output, mstime_now());
 		logparent(CM_INFO, "waiting for %d seconds\n", wait_time);
+		if (wait_time > min_child_wait_time)
+			run_hooks(HOOK_RESTART_THROTTLED, 0, -1, wait_time);
+		if (wait_time >= max_child_wait_time && ! circuit_open)
+			run_hooks(HOOK_CIRCUIT_OPEN, 0, -1, wait_time);
+		circuit_open = wait_time >= max_child_wait_time;
 		alarm(wait_time);
 		set_child_wait_time();
 	}
 }
 
 
+static int any_generation_running(void)
+{
+	return generations[0].pid > 0 || generations[1].pid > 0;
+}
+
+
 /**
  * Adjust the child wait time.
  *
@@ -913,17 +1990,17 @@ static void set_child_wait_time(void)
 static void send_hup_to_child(void)
 {
 	if (is_daemon) {
-		if (child_pid <= 0) {
+		if (child->pid <= 0) {
 			logparent(CM_INFO, "SIGHUP but no child\n");
 		} else {
 			logparent(CM_INFO, "passing SIGHUP to %s[%d]\n",
-				  child_args[0], child_pid);
-			kill(child_pid, SIGHUP);
+				  child_args[0], child->pid);
+			kill_generations(SIGHUP);
 		}
 	}
 	else {
-		if (child_pid >= 0) {
-			kill(child_pid, SIGHUP);
+		if (any_generation_running()) {
+			kill_generations(SIGHUP);
 			do_restart = 0;
 			do_exit = 1;
 		} else {
@@ -936,6 +2013,10 @@ static void send_hup_to_child(void)
 
 static void handle_hup_signal(void)
 {
+	if (config_file) {
+		reload_config("SIGHUP");
+		return;
+	}
 	send_hup_to_child();
 }
 
@@ -948,7 +2029,7 @@ static void handle_hup_signal(void)
  */
 static void send_int_to_child(void)
 {
-	if (child_pid <= 0) {
+	if (child->pid <= 0) {
 		if (is_daemon) {
 			logparent(CM_INFO, "SIGINT but no child process (%s)\n",
 				  child_args[0]);
@@ -962,11 +2043,11 @@ static void send_int_to_child(void)
 	/* We have a child process. */
 	if (is_daemon) {
 		logparent(CM_INFO, "passing SIGINT to %s[%d]\n",
-			  child_args[0], child_pid);
-		kill(child_pid, SIGINT);
+			  child_args[0], child->pid);
+		kill_generations(SIGINT);
 		/* Don't change do_restart and do_exit. */
 	} else {
-		kill(child_pid, SIGINT);
+		kill_generations(SIGINT);
 		/* If we're not a daemon, then probably the user typed ^C on
 		   our terminal, so when the child process exits, we should
 		   also exit. */
@@ -978,26 +2059,61 @@ static void send_int_to_child(void)
 
 static void send_term_to_child(void)
 {
-	if (child_pid <= 0) {
+	if (! any_generation_running()) {
 		return;
 	}
 	logparent(CM_INFO, "Sending SIGTERM\n");
-	kill(child_pid, SIGTERM);
+	kill_generations(SIGTERM);
 }
 
 
 static void send_kill_to_child(void)
 {
-	if (child_pid <= 0) {
+	if (! any_generation_running()) {
 		return;
 	}
 	logparent(CM_INFO, "Sending SIGKILL\n");
-	kill(child_pid, SIGKILL);
+	kill_generations(SIGKILL);
+}
+
+
+/**
+ * Send sig to every running generation of the child.
+ */
+static void kill_generations(int sig)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (generations[i].pid > 0) {
+			resume_generation(&generations[i]);
+			kill(generations[i].pid, sig);
+		}
+	}
+}
+
+
+/**
+ * Send sig to one generation of the child, and say so.
+ */
+static void signal_generation(struct generation *gen, int sig,
+			      const char *signame)
+{
+	if (gen->pid <= 0)
+		return;
+	resume_generation(gen);
+	logparent(CM_INFO, "sending %s to %s[%d]\n",
+		  signame, child_args[0], gen->pid);
+	kill(gen->pid, sig);
 }
 
 
 static void handle_int_signal(void)
 {
+	if (config_file) {
+		stop_children_and_exit("SIGINT");
+		return;
+	}
 	send_int_to_child();
 }
 
@@ -1007,14 +2123,25 @@ static void handle_int_signal(void)
  */
 static void handle_term_signal(void)
 {
-	if (child_pid <= 0) {
+	if (config_file) {
+		stop_children_and_exit("SIGTERM");
+		return;
+	}
+	if (managed_flag) {
+		/* Our process-monitor wants us gone, and will not wait for
+		   ever. */
+		logparent(CM_INFO, "SIGTERM: stopping %s and exiting\n",
+			  child_args[0]);
+		kill_child_and_exit();
+	}
+	if (! any_generation_running()) {
 		logparent(CM_INFO, "exiting on SIGTERM\n");
 		exit(1);
 	}
 
 	logparent(CM_INFO, "passing SIGTERM to %s[%d]\n",
-		  child_args[0], child_pid);
-	kill(child_pid, SIGTERM);
+		  child_args[0], child->pid);
+	kill_generations(SIGTERM);
 	do_restart = 0;
 	do_exit = 1;
 }
@@ -1030,6 +2157,8 @@ static void stop_monitoring(const char *reason)
 
 static void handle_usr1_signal(void)
 {
+	if (config_file)
+		return;
 	stop_monitoring("SIGUSR1");
 }
 
@@ -1040,43 +2169,784 @@ static void start_monitoring(const char *reason)
 		  reason, child_args[0]);
 	do_restart = 1;
 	child_wait_time = min_child_wait_time;
-	if (child_pid <= 0) {
-		start_child();
+	exits_since_start = 0;
+	if (child->pid <= 0) {
+		start_child_when_allowed();
 	}
 }
 
 
 static void handle_usr2_signal(void)
 {
+	if (config_file)
+		return;
 	start_monitoring("SIGUSR2");
 }
 
 
 /**
- * Fork/exec the child process.
+ * Freeze the child where it is, on the pause command.  It keeps its memory
+ * and its connections, and uses no CPU until it is resumed.
+ *
+ * The watchdog, hang detection, idle stop and probes are held while it is
+ * paused, as it can't answer them.  Any signal that we send to the child
+ * resumes it first, so that stop, restart and exit still work.
+ */
+static void pause_child(const char *reason)
+{
+	if (child->pid <= 0) {
+		logparent(CM_WARN, "%s: %s is not running\n",
+			  reason, child_args[0]);
+		return;
+	}
+	if (child->paused) {
+		logparent(CM_INFO, "%s: %s[%d] is already paused\n",
+			  reason, child_args[0], child->pid);
+		return;
+	}
+	if (old_child) {
+		logparent(CM_WARN, "%s: cannot pause %s during a restart\n",
+			  reason, child_args[0]);
+		return;
+	}
+	child->paused = freeze_process(child->pid);
+	if (! child->paused)
+		return;
+	probe_stop();
+	logparent(CM_INFO, "%s: paused %s[%d] (%s)\n", reason, child_args[0],
+		  child->pid, child->paused == FREEZE_CGROUP
+		  ? "cgroup.freeze" : "SIGSTOP");
+}
+
+
+static void resume_child(const char *reason)
+{
+	if (child->pid <= 0 || ! child->paused) {
+		logparent(CM_INFO, "%s: %s is not paused\n",
+			  reason, child_args[0]);
+		return;
+	}
+	logparent(CM_INFO, "%s: resuming %s[%d]\n",
+		  reason, child_args[0], child->pid);
+	resume_generation(child);
+}
+
+
+/**
+ * Run the hooks for an event, with what we know about the child in their
+ * environment.  pid is 0, status is -1 and delay is -1 when they don't apply.
+ */
+static void run_hooks(enum hook_event event, pid_t pid, int status,
+		      int delay)
+{
+	char name_var[200];
+	char pid_var[32];
+	char status_var[32];
+	char delay_var[32];
+	char *vars[5];
+	int n = 0;
+
+	snprintf(name_var, sizeof(name_var), "PM_CHILD_NAME=%s",
+		 get_child_log_name());
+	vars[n++] = name_var;
+	if (pid > 0) {
+		snprintf(pid_var, sizeof(pid_var), "PM_CHILD_PID=%d",
+			 (int)pid);
+		vars[n++] = pid_var;
+	}
+	if (status != -1) {
+		if (WIFSIGNALED(status))
+			snprintf(status_var, sizeof(status_var),
+				 "PM_EXIT_SIGNAL=%d", WTERMSIG(status));
+		else
+			snprintf(status_var, sizeof(status_var),
+				 "PM_EXIT_STATUS=%d", WEXITSTATUS(status));
+		vars[n++] = status_var;
+	}
+	if (delay >= 0) {
+		snprintf(delay_var, sizeof(delay_var), "PM_RESTART_DELAY=%d",
+			 delay);
+		vars[n++] = delay_var;
+	}
+	vars[n] = NULL;
+	hook_run(event, vars);
+}
+
+
+/**
+ * Let a paused generation go on, and start its timers again from now.
+ */
+static void resume_generation(struct generation *gen)
+{
+	long long now;
+
+	if (! gen->paused)
+		return;
+	thaw_process(gen->pid, gen->paused);
+	gen->paused = FREEZE_NONE;
+	now = mstime_now();
+	gen->watchdog_ms = now;
+	gen->last_cpu_ms = now;
+	if (gen == child) {
+		last_busy_ms = now;
+		probe_start();
+	}
+}
+
+
+/**
+ * Restart the child on command.
+ *
+ * With --overlap-restart, the new generation is started before the old one is
+ * stopped.  Otherwise the child is sent SIGTERM, and started again after the
+ * minimum wait time.
+ */
+static void restart_child(void)
+{
+	logparent(CM_INFO, "Command: restarting %s\n", child_args[0]);
+	do_restart = 1;
+	child_wait_time = min_child_wait_time;
+	exits_since_start = 0;
+	if (child->pid <= 0) {
+		start_child_when_allowed();
+	} else if (overlap_restart_flag) {
+		start_overlap_restart();
+	} else {
+		signal_generation(child, SIGTERM, "SIGTERM");
+	}
+}
+
+
+/**
+ * Start a new generation of the child alongside the running one.
+ *
+ * check_generations() retires the old generation once the new one is ready.
+ */
+static void start_overlap_restart(void)
+{
+	if (old_child) {
+		logparent(CM_WARN, "restart of %s already in progress\n",
+			  child_args[0]);
+		return;
+	}
+	old_child = child;
+	if (child == &generations[0])
+		child = &generations[1];
+	else
+		child = &generations[0];
+	logparent(CM_INFO, "starting new %s alongside %s[%d]\n",
+		  child_args[0], child_args[0], old_child->pid);
+	start_child(child);
+	if (child->pid <= 0) {
+		/* Could not fork.  Carry on with the old one. */
+		child = old_child;
+		old_child = NULL;
+	}
+}
+
+
+/**
+ * Check on the timeouts of the running generations.
+ *
+ * This moves overlapping restarts along, and handles the watchdog and
+ * generations that don't exit when asked to.  It is called on every trip
+ * around the main loop, and sets next_check_ms to the next time it has
+ * anything to do.
+ */
+static void check_generations(void)
+{
+	long long now = mstime_now();
+	long long when;
+	int i;
+
+	next_check_ms = 0;
+	when = probe_check(now);
+	if (when)
+		schedule_check(when);
+	when = mail_check(now);
+	if (when)
+		schedule_check(when);
+	when = hook_check(now);
+	if (when)
+		schedule_check(when);
+	when = plugin_check(now);
+	if (when)
+		schedule_check(when);
+	when = ship_check(now);
+	if (when)
+		schedule_check(when);
+	if (config_file) {
+		when = manager_check(now);
+		if (when)
+			schedule_check(when);
+	}
+	check_watched(now);
+	check_overlap_restart(now);
+	check_ready_delay(now);
+	if (start_wanted) {
+		when = start_wanted_ms + START_REQUEST_INTERVAL * 1000LL;
+		if (now >= when)
+			start_child_when_allowed();
+		else
+			schedule_check(when);
+	}
+	if (host_start_ms) {
+		if (now < host_start_ms)
+			schedule_check(host_start_ms);
+		else if (do_restart && ! do_exit && child->pid <= 0)
+			start_child_host_limited();
+		else
+			host_start_ms = 0;
+	}
+	for (i = 0; i < 2; i++) {
+		if (generations[i].pid > 0 && ! generations[i].paused) {
+			check_watchdog(&generations[i], now);
+			check_silence(&generations[i], now);
+			if (&generations[i] == child)
+				check_idle(now);
+			check_stopping(&generations[i], now);
+		}
+	}
+}
+
+
+/**
+ * Act on a change to the --watch paths, once they have settled.  With
+ * --config, the configuration is reloaded; each child has its own watches
+ * in its own sub-monitor.
+ */
+static void check_watched(long long now)
+{
+	const char *path;
+	long long when;
+
+	path = watch_check(now, &when);
+	if (when)
+		schedule_check(when);
+	if (! path)
+		return;
+	if (config_file) {
+		logparent(CM_INFO, "%s changed\n", path);
+		reload_config("Watch");
+		return;
+	}
+	if (! do_restart || do_exit || child->pid <= 0) {
+		/* The next start will pick up the change. */
+		logparent(CM_INFO, "%s changed, and %s is not running\n",
+			  path, child_args[0]);
+		return;
+	}
+	logparent(CM_INFO, "%s changed\n", path);
+	switch (watch_action) {
+	case WATCH_RESTART:
+		restart_child();
+		break;
+	case WATCH_HUP:
+		signal_generation(child, SIGHUP, "SIGHUP");
+		break;
+	}
+}
+
+
+/**
+ * Make sure check_generations() is called again by the given time.
+ */
+static void schedule_check(long long when)
+{
+	if (! next_check_ms || when < next_check_ms)
+		next_check_ms = when;
+}
+
+
+/**
+ * Move an overlapping restart along.
+ *
+ * Without --notify, the new generation is ready once it has been running for
+ * ready_delay seconds.  With --notify, it is ready when it sends READY=1, and
+ * if that has not happened after ready_timeout seconds, it is stopped (and the
+ * old generation is kept).  When the new generation is ready, the old one is
+ * sent SIGTERM.
+ */
+static void check_overlap_restart(long long now)
+{
+	long long deadline;
+
+	if (! old_child)
+		return;
+	if (child->pid > 0 && ! child->ready && ! child->term_ms) {
+		if (readiness_reported()) {
+			deadline = child->start_ms + ready_timeout * 1000LL;
+			if (now >= deadline) {
+				logparent(CM_WARN,
+					  "%s[%d] not ready after %d seconds\n",
+					  child_args[0], child->pid,
+					  ready_timeout);
+				signal_generation(child, SIGTERM, "SIGTERM");
+				child->term_ms = now;
+			} else {
+				schedule_check(deadline);
+			}
+		} else {
+			deadline = child->start_ms + ready_delay * 1000LL;
+			if (now >= deadline)
+				set_generation_ready(child, now);
+			else
+				schedule_check(deadline);
+		}
+	}
+	if (child->ready && old_child->pid > 0 && ! old_child->term_ms) {
+		signal_generation(old_child, SIGTERM, "SIGTERM");
+		old_child->term_ms = now;
+	}
+}
+
+
+/**
+ * A sub-monitor run from a configuration file tells its parent when the child
+ * is ready, so that rolling restarts can wait for it.  If the child can't tell
+ * us, it is taken to be ready after ready_delay seconds, as with an
+ * overlapping restart.
  */
-static void start_child(void)
+static void check_ready_delay(long long now)
+{
+	long long deadline;
+
+	if (! managed_flag || readiness_reported() || old_child)
+		return;
+	if (child->pid <= 0 || child->ready || child->term_ms)
+		return;
+	deadline = child->start_ms + ready_delay * 1000LL;
+	if (now >= deadline)
+		set_generation_ready(child, now);
+	else
+		schedule_check(deadline);
+}
+
+
+/**
+ * Kill a generation that has not sent WATCHDOG=1 for too long.
+ *
+ * We send SIGABRT first, as systemd does, so that the child can leave a core
+ * dump showing where it was stuck.
+ */
+static void check_watchdog(struct generation *gen, long long now)
+{
+	long long deadline;
+	char name[200];
+
+	if (! watchdog_ms || gen->term_ms)
+		return;
+	deadline = gen->watchdog_ms + watchdog_ms;
+	if (now < deadline) {
+		schedule_check(deadline);
+		return;
+	}
+	logparent(CM_WARN, "%s[%d] watchdog timeout after %lld ms\n",
+		  child_args[0], gen->pid, now - gen->watchdog_ms);
+	metrics_name(name, sizeof(name), "child_watchdog_timeouts_total",
+		     get_child_log_name());
+	metrics_add(name, 1);
+	signal_generation(gen, SIGABRT, "SIGABRT");
+	gen->term_ms = now;
+}
+
+
+/**
+ * Look for a generation that has produced no output and used no CPU for
+ * silence_ms.  That usually means it is stuck, eg deadlocked or waiting
+ * forever for something that will not happen.
+ *
+ * The CPU time is sampled from /proc a few times per timeout period, but not
+ * more than ten times a second or less than every five seconds.
+ */
+static void check_silence(struct generation *gen, long long now)
+{
+	long long sample_ms;
+	long long last_activity;
+	long long ticks;
+	char name[200];
+
+	if (! silence_ms || gen->term_ms)
+		return;
+	sample_ms = silence_ms / 4;
+	if (sample_ms < 100)
+		sample_ms = 100;
+	else if (sample_ms > 5000)
+		sample_ms = 5000;
+
+	if (now >= gen->cpu_sample_ms + sample_ms) {
+		ticks = procinfo_cpu_ticks(gen->pid);
+		if (ticks != gen->cpu_ticks) {
+			gen->cpu_ticks = ticks;
+			gen->last_cpu_ms = now;
+		}
+		gen->cpu_sample_ms = now;
+	}
+	schedule_check(gen->cpu_sample_ms + sample_ms);
+
+	last_activity = gen->last_output_ms;
+	if (gen->last_cpu_ms > last_activity)
+		last_activity = gen->last_cpu_ms;
+	if (now - last_activity < silence_ms) {
+		if (gen->silent) {
+			logparent(CM_INFO, "%s[%d] is active again\n",
+				  child_args[0], gen->pid);
+			gen->silent = 0;
+		}
+		schedule_check(last_activity + silence_ms);
+		return;
+	}
+	if (gen->silent)
+		return;
+
+	gen->silent = 1;
+	log_hang_diagnostics(gen, now - last_activity);
+	metrics_name(name, sizeof(name), "child_hangs_total",
+		     get_child_log_name());
+	metrics_add(name, 1);
+	switch (silence_action) {
+	case SILENCE_LOG:
+		break;
+	case SILENCE_RESTART:
+		signal_generation(gen, SIGTERM, "SIGTERM");
+		gen->term_ms = now;
+		break;
+	case SILENCE_ABORT:
+		signal_generation(gen, SIGABRT, "SIGABRT");
+		gen->term_ms = now;
+		break;
+	}
+}
+
+
+/**
+ * Log what we can find out about a generation that seems to be hung: where
+ * it is waiting in the kernel, the state of each thread, and its last few
+ * lines of output.
+ *
+ * /proc/<pid>/stack is normally only readable by root, so it is skipped if we
+ * can't read it.
+ */
+static void log_hang_diagnostics(struct generation *gen, long long silent_ms)
+{
+	char buf[4096];
+	char *text;
+	size_t n;
+
+	logparent(CM_WARN, "%s[%d] no output and no CPU use for %lld seconds, "
+		  "it may be hung\n",
+		  child_args[0], gen->pid, silent_ms / 1000);
+	if (procinfo_read(gen->pid, "wchan", buf, sizeof(buf)) > 0)
+		logparent(CM_WARN, "  wchan: %s\n", buf);
+	if (procinfo_read(gen->pid, "stack", buf, sizeof(buf)) > 0)
+		log_lines("  stack: ", buf);
+	if (procinfo_threads(gen->pid, buf, sizeof(buf)))
+		log_lines("  thread: ", buf);
+
+	/* Only the last couple of KiB of output, starting at a line. */
+	n = ring_copy(&gen->output, buf, 2048);
+	buf[n] = '\0';
+	text = buf;
+	if (gen->output.len > n) {
+		text = strchr(buf, '\n');
+		text = text ? text + 1 : buf;
+	}
+	log_lines("  output: ", text);
+}
+
+
+/**
+ * Log each line of text with a prefix.  text is modified.
+ */
+static void log_lines(const char *prefix, char *text)
+{
+	char *line;
+	char *next;
+
+	for (line = text; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (*line && strcmp(line, "\r"))
+			logparent(CM_WARN, "%s%s\n", prefix, line);
+	}
+}
+
+
+/**
+ * Send SIGKILL to a generation that has not exited RETIRE_KILL_TIME seconds
+ * after we asked it to stop.
+ */
+static void check_stopping(struct generation *gen, long long now)
+{
+	long long deadline;
+
+	if (! gen->term_ms || gen->killed)
+		return;
+	deadline = gen->term_ms + RETIRE_KILL_TIME * 1000LL;
+	if (now < deadline) {
+		schedule_check(deadline);
+		return;
+	}
+	signal_generation(gen, SIGKILL, "SIGKILL");
+	gen->killed = 1;
+}
+
+
+/**
+ * With --idle-stop, stop the child when it has had no connections open and
+ * written no output for idle_stop_ms.  It is started again by the next
+ * connection.
+ *
+ * The connections are counted from /proc/net now and then, so one that opens
+ * and closes between looks is not seen, unless the child writes something.
+ */
+static void check_idle(long long now)
+{
+	long long sample_ms;
+	long long last_ms;
+
+	if (! idle_stop_ms || child->term_ms || old_child)
+		return;
+	if (now < idle_check_ms) {
+		schedule_check(idle_check_ms);
+		return;
+	}
+	sample_ms = idle_stop_ms / 10;
+	if (sample_ms < 1000)
+		sample_ms = 1000;
+	if (sample_ms > 10000)
+		sample_ms = 10000;
+	idle_check_ms = now + sample_ms;
+	schedule_check(idle_check_ms);
+
+	/* If we can't count the connections, don't guess. */
+	if (listen_connections() != 0)
+		last_busy_ms = now;
+	last_ms = last_busy_ms;
+	if (child->last_output_ms > last_ms)
+		last_ms = child->last_output_ms;
+	if (now - last_ms < idle_stop_ms)
+		return;
+	logparent(CM_INFO, "%s[%d] has been idle for %.0f seconds\n",
+		  child_args[0], child->pid, (now - last_ms) / 1000.0);
+	idle_stopping = 1;
+	signal_generation(child, SIGTERM, "SIGTERM");
+	child->term_ms = now;
+}
+
+
+/**
+ * Stop the child until someone connects to one of our sockets.
+ */
+static void wait_for_connection(void)
+{
+	logparent(CM_INFO, "waiting for a connection to start %s\n",
+		  child_args[0]);
+	waiting_for_connection = 1;
+}
+
+
+/**
+ * Mark a generation as ready.  If there is an overlapping restart in progress,
+ * check_overlap_restart() will now retire the old generation.
+ */
+static void set_generation_ready(struct generation *gen, long long now)
+{
+	char name[200];
+	double secs;
+
+	if (gen->ready && ! gen->reloading)
+		return;
+	if (gen->reloading) {
+		logparent(CM_INFO, "%s[%d] finished reloading\n",
+			  child_args[0], gen->pid);
+	} else {
+		secs = (now - gen->start_ms) / 1000.0;
+		logparent(CM_INFO, "%s[%d] is ready after %.3f seconds\n",
+			  child_args[0], gen->pid, secs);
+		if (readiness_reported()) {
+			metrics_name(name, sizeof(name), "child_ready_seconds",
+				     get_child_log_name());
+			metrics_set(name, secs);
+		}
+	}
+	gen->ready = 1;
+	gen->reloading = 0;
+	if (gen == child)
+		notify_parent("READY=1");
+	if (readiness_reported()) {
+		metrics_name(name, sizeof(name), "child_ready",
+			     get_child_log_name());
+		metrics_set(name, 1);
+	}
+}
+
+
+/**
+ * Does the child tell us when it is ready, with sd_notify() or a readiness
+ * probe?  If not, we guess with ready_delay.
+ */
+static int readiness_reported(void)
+{
+	return notify_flag || probe_have(PROBE_READINESS);
+}
+
+
+/**
+ * A liveness probe has failed too many times.  Stop the child, and it will be
+ * restarted in the usual way when it exits.
+ */
+static void liveness_probe_failed(struct probe *p)
+{
+	char name[200];
+
+	if (child->pid <= 0 || child->term_ms)
+		return;
+	logparent(CM_WARN, "%s[%d] failed liveness probe %s, restarting it\n",
+		  child_args[0], child->pid, p->spec);
+	metrics_name(name, sizeof(name), "child_probe_restarts_total",
+		     get_child_log_name());
+	metrics_add(name, 1);
+	signal_generation(child, SIGTERM, "SIGTERM");
+	child->term_ms = mstime_now();
+}
+
+
+static void readiness_probe_changed(struct probe *p, int ready)
+{
+	char name[200];
+
+	if (child->pid <= 0)
+		return;
+	if (ready) {
+		set_generation_ready(child, mstime_now());
+	} else if (child->ready) {
+		logparent(CM_WARN, "%s[%d] is no longer ready\n",
+			  child_args[0], child->pid);
+		child->ready = 0;
+		metrics_name(name, sizeof(name), "child_ready",
+			     get_child_log_name());
+		metrics_set(name, 0);
+	}
+}
+
+
+/**
+ * Read and act on sd_notify(3) messages from one generation.
+ */
+static void read_notify_fd(struct generation *gen)
+{
+	struct notify_msg msg;
+	long long now;
+	int ret;
+	char name[200];
+
+	while ((ret = notify_recv(gen->notify_fd, child_uid, &msg)) >= 0) {
+		if (! ret)
+			continue;
+		now = mstime_now();
+		if (msg.mainpid && msg.mainpid != gen->main_pid) {
+			gen->main_pid = msg.mainpid;
+			logparent(CM_INFO, "%s[%d] main pid is %d\n",
+				  child_args[0], gen->pid, (int)gen->main_pid);
+		}
+		if (msg.has_status) {
+			logparent(CM_INFO, "%s[%d] status: %s\n",
+				  child_args[0], gen->pid, msg.status);
+		}
+		if (msg.watchdog) {
+			gen->watchdog_ms = now;
+		}
+		if (msg.reloading) {
+			logparent(CM_INFO, "%s[%d] is reloading\n",
+				  child_args[0], gen->pid);
+			gen->reloading = 1;
+			metrics_name(name, sizeof(name), "child_ready",
+				     get_child_log_name());
+			metrics_set(name, 0);
+		}
+		if (msg.ready) {
+			set_generation_ready(gen, now);
+		}
+		if (msg.has_load && gen == child) {
+			notify_parent("LOAD=%g", msg.load);
+		}
+		if (msg.stopping) {
+			logparent(CM_INFO, "%s[%d] is stopping\n",
+				  child_args[0], gen->pid);
+		}
+	}
+}
+
+
+/**
+ * Fork/exec one generation of the child process.
+ */
+static void start_child(struct generation *gen)
 {
 	pid_t pid;
 	int forkpty_errno;
 
 	logparent(CM_INFO, "starting %s\n", child_args[0]);
+	start_wanted = 0;
+	host_start_ms = 0;
+	waiting_for_connection = 0;
+	last_busy_ms = mstime_now();
+	run_hooks(HOOK_PRE_START, 0, -1, -1);
+
+	if (notify_flag) {
+		/* Without the socket, the child could never become ready. */
+		gen->notify_fd = notify_open(gen->notify_name,
+					     sizeof(gen->notify_name));
+		if (-1 == gen->notify_fd) {
+			start_failed(gen);
+			return;
+		}
+	}
 
-	pid = forkpty(&pty_fd, NULL, NULL, NULL);
+	pid = forkpty(&gen->pty_fd, NULL, NULL, NULL);
 	forkpty_errno = errno;
 
 	if (-1 == pid) {
-		child_pid = -1;
 		logparent(CM_ERROR, "cannot fork: %s\n",
 			  strerror(forkpty_errno));
-		child_wait_time = 60;
+		start_failed(gen);
 		return;
 	} else if (0 != pid) {
 		/* parent */
-		/* logparent(CM_INFO, "after forkpty, pty_fd==%d\n", pty_fd); */
-		child_pid = pid;
-		set_child_log_pid(child_pid);
-		fcntl(pty_fd, F_SETFL, O_NONBLOCK);
+		/* logparent(CM_INFO, "after forkpty, pty_fd==%d\n", gen->pty_fd); */
+		char name[200];
+
+		gen->pid = pid;
+		gen->pty_data_len = 0;
+		gen->start_ms = mstime_now();
+		gen->ready = 0;
+		gen->reloading = 0;
+		gen->term_ms = 0;
+		gen->killed = 0;
+		gen->watchdog_ms = gen->start_ms;
+		gen->main_pid = 0;
+		ring_clear(&gen->output);
+		gen->last_output_ms = gen->start_ms;
+		gen->last_cpu_ms = gen->start_ms;
+		gen->cpu_sample_ms = gen->start_ms;
+		gen->cpu_ticks = -1;
+		gen->silent = 0;
+		gen->paused = FREEZE_NONE;
+		set_child_log_pid(gen->pid);
+		metrics_name(name, sizeof(name), "child_starts_total",
+			     get_child_log_name());
+		metrics_add(name, 1);
+		if (gen == child) {
+			probe_start();
+			notify_parent("CHILD_PID=%d", (int)gen->pid);
+		}
+		run_hooks(HOOK_POST_START, gen->pid, -1, -1);
+		plugin_event(PM_EVENT_START, gen->pid, NULL, 0);
+		fcntl(gen->pty_fd, F_SETFL, O_NONBLOCK);
+		/* Don't let a later generation inherit this pty. */
+		fcntl(gen->pty_fd, F_SETFD, FD_CLOEXEC);
 		return;
 	}
 
@@ -1090,6 +2960,20 @@ static void start_child(void)
 		close(command_fifo_write_fd);
 	}
 	setup_env();
+	listen_setup_child();
+	statsd_setup_child();
+	if (gen->notify_fd >= 0) {
+		setenv("NOTIFY_SOCKET", gen->notify_name, 1);
+		if (watchdog_ms) {
+			char buf[30];
+			snprintf(buf, sizeof(buf), "%lld", watchdog_ms * 1000);
+			setenv("WATCHDOG_USEC", buf, 1);
+			snprintf(buf, sizeof(buf), "%d", (int)getpid());
+			setenv("WATCHDOG_PID", buf, 1);
+		}
+	}
+	/* Before we give up root, which may be needed to lower it. */
+	qos_child(1);
 	/* Set gid before uid, so that setting gid does not fail if we're no
 	   longer root. */
 	if (child_groupname && setgid(child_gid)) {
@@ -1115,6 +2999,27 @@ static void start_child(void)
 }
 
 
+/**
+ * The child could not be started, and nothing of it is running to tell us
+ * when to try again, so set an alarm for that.  A new generation for
+ * --overlap-restart is not retried, as the old one carries on.
+ */
+static void start_failed(struct generation *gen)
+{
+	gen->pid = -1;
+	gen->pty_fd = -1;
+	if (gen->notify_fd >= 0) {
+		close(gen->notify_fd);
+		gen->notify_fd = -1;
+	}
+	child_wait_time = START_RETRY_TIME;
+	if (old_child)
+		return;
+	logparent(CM_INFO, "waiting for %d seconds\n", START_RETRY_TIME);
+	alarm(START_RETRY_TIME);
+}
+
+
 static void make_signal_command_pipe(void)
 {
 	int ret;
@@ -1126,6 +3031,8 @@ static void make_signal_command_pipe(void)
 		exit(2);
 	}
 	fcntl(signal_command_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(signal_command_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(signal_command_pipe[1], F_SETFD, FD_CLOEXEC);
 }
 
 
@@ -1222,7 +3129,7 @@ static void make_command_fifo(void)
 	}
 
 	/* When we get here, the fifo exists. */
-	command_fifo_fd = open(command_fifo_name, O_RDONLY|O_NONBLOCK);
+	command_fifo_fd = open(command_fifo_name, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
 	if (-1 == command_fifo_fd) {
 		const char *er = strerror(errno);
 		fprintf(stderr, "%s: cannot open %s: %s\n",
@@ -1234,7 +3141,7 @@ static void make_command_fifo(void)
 	   from the fifo.  O_RDWR should work instead of opening the fifo
 	   twice, but POSIX says that O_RDWR is undefined when used with a
 	   fifo. */
-	command_fifo_write_fd = open(command_fifo_name, O_WRONLY);
+	command_fifo_write_fd = open(command_fifo_name, O_WRONLY|O_CLOEXEC);
 	if (-1 == command_fifo_write_fd) {
 		const char *er = strerror(errno);
 		fprintf(stderr, "%s: cannot open %s for writing: %s\n",
@@ -1254,21 +3161,57 @@ static void make_command_fifo(void)
 static void send_command(void)
 {
 	struct pmCommand *pmc = pmCommands;
-	char c = '\0';
+	char buf[COMMAND_ARG_LEN + 1];
+	char reply_dir[REPLY_NAME_LEN];
+	char reply_name[REPLY_NAME_LEN];
+	int reply_fd = -1;
+	size_t name_len;
+	const char *arg;
+	size_t len;
 	int ret;
 
+	/* The command name is the first word, and anything after it is the
+	   argument. */
+	name_len = strcspn(command_name, " \t");
+	arg = command_name + name_len;
+	arg += strspn(arg, " \t");
 	for (pmc=pmCommands; pmc->command; pmc++) {
-		if (!strcmp(pmc->command, command_name)) {
-			c = pmc->c;
+		if (strlen(pmc->command) == name_len
+		    && !strncmp(pmc->command, command_name, name_len)) {
 			break;
 		}
 	}
-	if (! c) {
+	if (! pmc->command) {
 		fprintf(stderr,
 			"%s: unknown command %s\n",
 			get_parent_log_name(), command_name);
 		exit(1);
 	}
+	if (pmc->has_arg && ! *arg) {
+		fprintf(stderr, "%s: command %s needs an argument\n",
+			get_parent_log_name(), pmc->command);
+		exit(1);
+	}
+	if (! pmc->has_arg && *arg) {
+		fprintf(stderr, "%s: command %s does not take an argument\n",
+			get_parent_log_name(), pmc->command);
+		exit(1);
+	}
+	if (strlen(arg) >= COMMAND_ARG_LEN - 1
+	    - (pmc->reply ? REPLY_NAME_LEN : 0)) {
+		fprintf(stderr, "%s: command argument too long\n",
+			get_parent_log_name());
+		exit(1);
+	}
+	buf[0] = pmc->c;
+	len = 1;
+	if (pmc->reply) {
+		reply_fd = make_reply_fifo(reply_dir, reply_name);
+		len += snprintf(buf + 1, sizeof(buf) - 1, "%s%s%s\n",
+				reply_name, *arg ? " " : "", arg);
+	} else if (pmc->has_arg) {
+		len += snprintf(buf + 1, sizeof(buf) - 1, "%s\n", arg);
+	}
 	/* Find the command fifo to send to. */
 	if (! command_fifo_name) {
 		fprintf(stderr,
@@ -1287,12 +3230,106 @@ static void send_command(void)
 		}
 		exit(1);
 	}
-	ret = write(command_fifo_fd, &c, 1);
+	ret = write(command_fifo_fd, buf, len);
 	if (-1 == ret) {
 		const char *er = strerror(errno);
 		fprintf(stderr, "%s: cannot write to %s: %s\n",
 			get_parent_log_name(), command_fifo_name, er);
+		if (pmc->reply)
+			remove_reply_fifo(reply_dir, reply_name);
 		exit(1);
 	}
+	if (pmc->reply) {
+		ret = copy_reply(reply_fd);
+		remove_reply_fifo(reply_dir, reply_name);
+		exit(ret);
+	}
 	exit(0);
 }
+
+
+/**
+ * Make a fifo for the reply to a command, in a new directory so that nobody
+ * else can put anything there.  We open it before sending the command, so the
+ * monitor can open it for writing without blocking.
+ */
+static int make_reply_fifo(char *dir, char *name)
+{
+	int fd;
+
+	strcpy(dir, "/tmp/process-monitor-XXXXXX");
+	if (! mkdtemp(dir)) {
+		fprintf(stderr, "%s: cannot make a directory for the reply: "
+			"%s\n", get_parent_log_name(), strerror(errno));
+		exit(1);
+	}
+	snprintf(name, REPLY_NAME_LEN, "%.40s/reply", dir);
+	if (mkfifo(name, 0600)) {
+		fprintf(stderr, "%s: cannot make %s: %s\n",
+			get_parent_log_name(), name, strerror(errno));
+		rmdir(dir);
+		exit(1);
+	}
+	fd = open(name, O_RDONLY|O_NONBLOCK);
+	if (-1 == fd) {
+		fprintf(stderr, "%s: cannot open %s: %s\n",
+			get_parent_log_name(), name, strerror(errno));
+		remove_reply_fifo(dir, name);
+		exit(1);
+	}
+	return fd;
+}
+
+
+static void remove_reply_fifo(const char *dir, const char *name)
+{
+	unlink(name);
+	rmdir(dir);
+}
+
+
+/**
+ * Copy the reply to stdout, until the monitor closes its end.  The whole
+ * reply has to arrive within REPLY_TIMEOUT seconds.
+ *
+ * \return the exit status for send_command().
+ */
+static int copy_reply(int fd)
+{
+	struct pollfd pfd;
+	long long deadline = mstime_now() + REPLY_TIMEOUT * 1000;
+	long long left;
+	char buf[4096];
+	ssize_t n;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (1) {
+		left = deadline - mstime_now();
+		if (left < 0)
+			left = 0;
+		switch (poll(&pfd, 1, (int) left)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll: %s\n", get_parent_log_name(),
+				strerror(errno));
+			return 1;
+		case 0:
+			fprintf(stderr, "%s: no reply from %s\n",
+				get_parent_log_name(), command_fifo_name);
+			return 1;
+		}
+		/* poll() blocks until a writer opens the fifo.  Once the
+		   last writer has closed it, there is only POLLHUP. */
+		if (! (pfd.revents & POLLIN))
+			return 0;
+		n = read(fd, buf, sizeof(buf));
+		if (-1 == n && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n <= 0)
+			return 0;
+		if (fwrite(buf, 1, n, stdout) != (size_t)n)
+			return 1;
+	}
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "procinfo.h"
+
+
+static char *stat_after_comm(char *stat);
+
+
+/**
+ * Read /proc/<pid>/<name> into buf.
+ *
+ * The contents are null terminated, and truncated if they don't fit.
+ *
+ * \return the number of bytes read, or -1 if the file cannot be read (eg the
+ * process has gone, or we don't have permission).
+ */
+ssize_t procinfo_read(pid_t pid, const char *name, char *buf, size_t len)
+{
+	char path[64];
+	ssize_t total = 0;
+	ssize_t ret = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return -1;
+	while ((size_t)total < len - 1) {
+		ret = read(fd, buf + total, len - 1 - total);
+		if (ret <= 0)
+			break;
+		total += ret;
+	}
+	close(fd);
+	if (-1 == ret && ! total)
+		return -1;
+	buf[total] = '\0';
+	return total;
+}
+
+
+/**
+ * The fields in /proc/<pid>/stat after the command name.  The command name is
+ * in parentheses and can contain spaces and parentheses itself, so we look for
+ * the last ')'.
+ */
+static char *stat_after_comm(char *stat)
+{
+	char *p = strrchr(stat, ')');
+
+	if (! p || ! p[1])
+		return NULL;
+	return p + 2;
+}
+
+
+/**
+ * Get the CPU time used by a process, including all of its threads.
+ *
+ * \return user + system time in clock ticks, or -1 if it cannot be read.
+ */
+long long procinfo_cpu_ticks(pid_t pid)
+{
+	char stat[1024];
+	char *fields;
+	unsigned long long utime, stime;
+
+	if (procinfo_read(pid, "stat", stat, sizeof(stat)) <= 0)
+		return -1;
+	fields = stat_after_comm(stat);
+	if (! fields)
+		return -1;
+	/* fields starts at field 3 (state).  utime and stime are fields 14
+	   and 15. */
+	if (2 != sscanf(fields,
+			"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			&utime, &stime))
+		return -1;
+	return (long long)(utime + stime);
+}
+
+
+/**
+ * Describe the threads of a process, one per line:
+ *
+ *   <tid> <state> <wchan> <name>
+ *
+ * \return the number of bytes placed in buf, which is null terminated.
+ */
+size_t procinfo_threads(pid_t pid, char *buf, size_t len)
+{
+	char path[64];
+	char name[300];
+	char stat[1024];
+	char wchan[128];
+	DIR *dir;
+	struct dirent *de;
+	size_t used = 0;
+	char *fields;
+	char *comm;
+	int n;
+
+	buf[0] = '\0';
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+	dir = opendir(path);
+	if (! dir)
+		return 0;
+	while ((de = readdir(dir)) && used < len - 1) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(name, sizeof(name), "task/%s/stat", de->d_name);
+		if (procinfo_read(pid, name, stat, sizeof(stat)) <= 0)
+			continue;
+		fields = stat_after_comm(stat);
+		if (! fields)
+			continue;
+		/* Cut the command name out of "tid (name) ...". */
+		fields[-2] = '\0';
+		comm = strchr(stat, '(');
+		comm = comm ? comm + 1 : "?";
+		snprintf(name, sizeof(name), "task/%s/wchan", de->d_name);
+		if (procinfo_read(pid, name, wchan, sizeof(wchan)) <= 0
+		    || ! wchan[0])
+			strcpy(wchan, "-");
+		n = snprintf(buf + used, len - used, "%s %c %s %s\n",
+			     de->d_name, fields[0], wchan, comm);
+		if (n < 0)
+			break;
+		used += n;
+		if (used >= len)
+			used = len - 1;
+	}
+	closedir(dir);
+	return used;
+}
@@ -0,0 +1,13 @@
+/* Information about processes, from /proc. */
+
+#ifndef __procinfo_h__
+#define __procinfo_h__
+
+#include <sys/types.h>
+
+extern long long procinfo_cpu_ticks(pid_t pid);
+extern ssize_t procinfo_read(pid_t pid, const char *name,
+			     char *buf, size_t len);
+extern size_t procinfo_threads(pid_t pid, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE		/* For SCHED_RESET_ON_FORK */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "qos.h"
+
+
+#define OOM_SCORE_ADJ_FILE "/proc/self/oom_score_adj"
+
+static int read_oom_score_adj(int *adj);
+static int write_oom_score_adj(int adj);
+
+static int qos_flag = 0;
+/** SCHED_RR priority for the monitor, or 0 to leave it alone. */
+static int priority = 0;
+static int child_oom_score_adj_set = 0;
+static int child_oom_score_adj = 0;
+/** What our oom_score_adj was before --qos changed it, for the processes we
+    start. */
+static int oom_score_adj_changed = 0;
+static int original_oom_score_adj = 0;
+
+
+void qos_enable(void)
+{
+	qos_flag = 1;
+}
+
+
+/**
+ * --qos-priority: run the monitor with SCHED_RR at this priority.
+ *
+ * \return 0, or -1 if arg is not a priority.
+ */
+int qos_set_priority(const char *arg)
+{
+	char *endptr;
+	long n;
+
+	n = strtol(arg, &endptr, 10);
+	if (*endptr || n < sched_get_priority_min(SCHED_RR)
+	    || n > sched_get_priority_max(SCHED_RR))
+		return -1;
+	priority = n;
+	return 0;
+}
+
+
+int qos_set_child_oom_score_adj(const char *arg)
+{
+	char *endptr;
+	long n;
+
+	n = strtol(arg, &endptr, 10);
+	if (! *arg || *endptr || n < -1000 || n > 1000)
+		return -1;
+	child_oom_score_adj = n;
+	child_oom_score_adj_set = 1;
+	return 0;
+}
+
+
+/**
+ * Apply --qos and --qos-priority to ourselves.  Call this after going into
+ * the background, because memory locks are not kept across fork().
+ *
+ * Each of these needs privileges that we may not have, so failures are
+ * warnings, and the monitor carries on without that protection.
+ */
+void qos_start(void)
+{
+	struct sched_param param;
+
+	if (qos_flag) {
+		/* Lock what we have now and anything we map later, so the
+		   main loop never waits for a page to be read back in. */
+		if (mlockall(MCL_CURRENT | MCL_FUTURE))
+			logparent(CM_WARN, "cannot lock memory: %s\n",
+				  strerror(errno));
+		if (! read_oom_score_adj(&original_oom_score_adj)) {
+			if (write_oom_score_adj(QOS_OOM_SCORE_ADJ))
+				logparent(CM_WARN, "cannot set oom_score_adj "
+					  "to %d: %s\n", QOS_OOM_SCORE_ADJ,
+					  strerror(errno));
+			else
+				oom_score_adj_changed = 1;
+		}
+	}
+	if (priority) {
+		/* SCHED_RESET_ON_FORK, so that nothing we start runs at
+		   real time priority. */
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		if (sched_setscheduler(0, SCHED_RR | SCHED_RESET_ON_FORK,
+				       &param))
+			logparent(CM_WARN, "cannot set SCHED_RR priority %d: "
+				  "%s\n", priority, strerror(errno));
+	}
+}
+
+
+/**
+ * Called in each process we fork, before exec(), so that it does not keep
+ * the monitor's oom_score_adj.  The main child gets
+ * --child-oom-score-adj if that was given.  Everything else (hooks, probes,
+ * sendmail, sub-monitors) goes back to what we had before --qos.
+ */
+void qos_child(int main_child)
+{
+	int adj;
+
+	if (main_child && child_oom_score_adj_set)
+		adj = child_oom_score_adj;
+	else if (oom_score_adj_changed)
+		adj = original_oom_score_adj;
+	else
+		return;
+	if (write_oom_score_adj(adj))
+		logparent(CM_WARN, "cannot set oom_score_adj to %d: %s\n",
+			  adj, strerror(errno));
+}
+
+
+static int read_oom_score_adj(int *adj)
+{
+	char buf[32];
+	ssize_t n;
+	int fd;
+
+	fd = open(OOM_SCORE_ADJ_FILE, O_RDONLY|O_CLOEXEC);
+	if (-1 == fd) {
+		logparent(CM_WARN, "cannot open %s: %s\n", OOM_SCORE_ADJ_FILE,
+			  strerror(errno));
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		logparent(CM_WARN, "cannot read %s\n", OOM_SCORE_ADJ_FILE);
+		return -1;
+	}
+	buf[n] = '\0';
+	*adj = atoi(buf);
+	return 0;
+}
+
+
+static int write_oom_score_adj(int adj)
+{
+	char buf[32];
+	int len;
+	int fd;
+	int ret = 0;
+
+	fd = open(OOM_SCORE_ADJ_FILE, O_WRONLY|O_CLOEXEC);
+	if (-1 == fd)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "%d\n", adj);
+	if (write(fd, buf, len) != len)
+		ret = -1;
+	close(fd);
+	return ret;
+}
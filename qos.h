@@ -0,0 +1,16 @@
+/* Keep the monitor responsive when the host is short of memory or CPU. */
+
+#ifndef __qos_h__
+#define __qos_h__
+
+/** The monitor's own oom_score_adj with --qos.  Not -1000, so that the
+    kernel can still kill it rather than panic when nothing else is left. */
+#define QOS_OOM_SCORE_ADJ -900
+
+extern void qos_enable(void);
+extern int qos_set_priority(const char *arg);
+extern int qos_set_child_oom_score_adj(const char *arg);
+extern void qos_start(void);
+extern void qos_child(int main_child);
+
+#endif
@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "ring.h"
+#include "xmalloc.h"
+
+
+void ring_init(struct ring *r, size_t size)
+{
+	r->data = NULL;
+	r->size = size;
+	r->head = 0;
+	r->len = 0;
+}
+
+
+void ring_write(struct ring *r, const char *data, size_t len)
+{
+	size_t n;
+
+	if (! r->size)
+		return;
+	if (! r->data)
+		r->data = xmalloc(r->size);
+	/* Only the last size bytes can survive. */
+	if (len > r->size) {
+		data += len - r->size;
+		len = r->size;
+	}
+	while (len) {
+		n = r->size - r->head;
+		if (n > len)
+			n = len;
+		memcpy(r->data + r->head, data, n);
+		r->head = (r->head + n) % r->size;
+		data += n;
+		len -= n;
+		r->len += n;
+	}
+	if (r->len > r->size)
+		r->len = r->size;
+}
+
+
+/**
+ * Copy the most recent bytes from the ring, oldest first.
+ *
+ * \param buf where to put the data.  It is not null terminated.
+ * \param len the most bytes to copy.
+ *
+ * \return the number of bytes copied.
+ */
+size_t ring_copy(const struct ring *r, char *buf, size_t len)
+{
+	size_t start;
+	size_t n;
+	size_t copied = 0;
+
+	if (len > r->len)
+		len = r->len;
+	start = (r->head + r->size - len) % (r->size ? r->size : 1);
+	while (copied < len) {
+		n = r->size - start;
+		if (n > len - copied)
+			n = len - copied;
+		memcpy(buf + copied, r->data + start, n);
+		copied += n;
+		start = (start + n) % r->size;
+	}
+	return copied;
+}
+
+
+void ring_clear(struct ring *r)
+{
+	r->head = 0;
+	r->len = 0;
+}
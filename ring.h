@@ -0,0 +1,24 @@
+/* Fixed size buffer holding the most recent bytes written to it. */
+
+#ifndef __ring_h__
+#define __ring_h__
+
+#include <stddef.h>
+
+/**
+ * A ring buffer.  When it is full, new data overwrites the oldest data.  The
+ * storage is allocated on the first write, so an unused ring costs nothing.
+ */
+struct ring {
+	char *data;
+	size_t size;		/* Capacity of data */
+	size_t head;		/* Where the next byte goes */
+	size_t len;		/* Bytes in use, up to size */
+};
+
+extern void ring_init(struct ring *r, size_t size);
+extern void ring_write(struct ring *r, const char *data, size_t len);
+extern size_t ring_copy(const struct ring *r, char *buf, size_t len);
+extern void ring_clear(struct ring *r);
+
+#endif
@@ -0,0 +1,827 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "mstime.h"
+#include "plugin.h"
+#include "ship.h"
+#include "xmalloc.h"
+
+
+/** Records waiting to be sent are kept in memory up to this size. */
+#define SHIP_BUFFER_LEN (256 * 1024)
+/** The most that is read back from the spool at once, so that the main loop
+    is never held up for long. */
+#define SHIP_LOAD_LEN (64 * 1024)
+/** Records for the spool are collected up to this size, and written once
+    each time round the main loop. */
+#define SHIP_SPOOL_WRITE_LEN (64 * 1024)
+/** Longest record, including its length. */
+#define SHIP_RECORD_LEN 16384
+/** The spool is kept in files of about this size, so the oldest can be
+    removed when it is full. */
+#define SHIP_SEGMENT_LEN (1024 * 1024)
+/** Spool files are numbered from here, leaving room below for records that
+    were in memory when we exited, which go before the rest. */
+#define SHIP_FIRST_SEQ 1000000000L
+/** Wait between attempts to connect, doubling each time. */
+#define SHIP_RETRY_MIN_MS 100
+#define SHIP_RETRY_MAX_MS 30000
+
+enum ship_state {
+	SHIP_IDLE,		/* Not connected, waiting for retry_ms */
+	SHIP_CONNECTING,
+	SHIP_CONNECTED,
+};
+
+static void sink(void *data, const struct pm_event *event);
+static void add_record(const char *rec, size_t len);
+static void start_connect(long long now);
+static void connected(void);
+static void disconnect(const char *why, int err);
+static void send_buffer(void);
+static void skip_sent_records(void);
+static void spool_scan(void);
+static int select_segment(const struct dirent *d);
+static void spool_path(char *buf, size_t len, long seq);
+static int spool_append(const char *rec, size_t len);
+static int spool_flush(void);
+static void spool_drop_oldest(void);
+static void spool_load(void);
+static void spool_finish_file(void);
+static void spool_at_exit(void);
+static void set_metrics(void);
+static size_t json_string(char *buf, size_t len, const char *s);
+
+static char *ship_spec = NULL;
+static struct sockaddr_storage ship_addr;
+static socklen_t ship_addr_len = 0;
+
+static enum ship_state state = SHIP_IDLE;
+static int ship_fd = -1;
+static long long retry_ms = 0;
+static long long retry_delay_ms = SHIP_RETRY_MIN_MS;
+/** Set once a failure to connect has been logged, until we connect. */
+static int failure_logged = 0;
+
+/**
+ * Records waiting to be sent, each a four byte length (big endian) and that
+ * many bytes.  sent is how much of buf has gone on this connection, and
+ * frame is where the record holding sent starts.  If the connection breaks
+ * part way through a record, the whole record is sent again on the next.
+ */
+static char *buf = NULL;
+static size_t buf_len = 0;
+static size_t sent = 0;
+static size_t frame = 0;
+
+/** The spool is the files first_seq to last_seq in spool_dir, each called
+    <child>-<seq>.  It is empty when first_seq > last_seq.  read_off is how
+    much of the first has been loaded into buf.  While buf holds records from
+    the spool, from_spool is set and load_off is where the first of them is
+    in that file, which is only removed once they have all been sent. */
+static char *spool_dir = NULL;
+static long long spool_max = SHIP_SPOOL_SIZE;
+static char prefix[256];
+static long first_seq = SHIP_FIRST_SEQ;
+static long last_seq = SHIP_FIRST_SEQ - 1;
+static off_t read_off = 0;
+static int from_spool = 0;
+static off_t load_off = 0;
+static int write_fd = -1;
+static off_t write_len = 0;
+/** Records for the end of the spool that have not been written yet.  They
+    are counted in write_len and spool_bytes already. */
+static char *pending = NULL;
+static size_t pending_len = 0;
+static long long spool_bytes = 0;
+
+/** Who registered spool_at_exit(), so a forked child that exits does not
+    run it. */
+static pid_t ship_pid = 0;
+static struct metric *connected_metric;
+static struct metric *spool_metric;
+static struct metric *dropped_metric;
+
+
+/**
+ * \param spec "unix:PATH", "tcp:PORT" (on 127.0.0.1) or "tcp:HOST:PORT",
+ * where HOST is a numeric address, so that reconnecting never waits for DNS.
+ *
+ * \return 0, or -1 if spec is no good (which has been logged).
+ */
+int ship_set_address(const char *spec)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)&ship_addr;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	const char *host = "127.0.0.1";
+	char *copy = NULL;
+	char *port;
+	int ret;
+
+	memset(&ship_addr, 0, sizeof(ship_addr));
+	if (! strncmp(spec, "unix:", 5)) {
+		if (strlen(spec + 5) >= sizeof(sun->sun_path) || ! spec[5]) {
+			logparent(CM_ERROR, "bad unix socket path: %s\n",
+				  spec + 5);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, spec + 5);
+		ship_addr_len = sizeof(struct sockaddr_un);
+		ship_spec = xstrdup(spec);
+		return 0;
+	}
+	if (strncmp(spec, "tcp:", 4)) {
+		logparent(CM_ERROR, "log collector must be unix:PATH or "
+			  "tcp:[HOST:]PORT, not %s\n", spec);
+		return -1;
+	}
+	copy = xstrdup(spec + 4);
+	port = strrchr(copy, ':');
+	if (port) {
+		*port++ = '\0';
+		host = copy;
+		if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+			host++;
+			copy[strlen(copy) - 1] = '\0';
+		}
+	} else {
+		port = copy;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		logparent(CM_ERROR, "bad log collector address %s: %s\n",
+			  spec, gai_strerror(ret));
+		free(copy);
+		return -1;
+	}
+	memcpy(&ship_addr, res->ai_addr, res->ai_addrlen);
+	ship_addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	free(copy);
+	ship_spec = xstrdup(spec);
+	return 0;
+}
+
+
+void ship_set_spool(const char *dir)
+{
+	free(spool_dir);
+	spool_dir = xstrdup(dir);
+}
+
+
+int ship_set_spool_size(const char *arg)
+{
+	char *endptr;
+	long long n;
+
+	n = strtoll(arg, &endptr, 10);
+	switch (*endptr) {
+	case 'k': case 'K': n *= 1024; endptr++; break;
+	case 'm': case 'M': n *= 1024 * 1024; endptr++; break;
+	case 'g': case 'G': n *= 1024 * 1024 * 1024; endptr++; break;
+	}
+	if (! *arg || *endptr || n < SHIP_SEGMENT_LEN)
+		return -1;
+	spool_max = n;
+	return 0;
+}
+
+
+/**
+ * Start shipping.  This is called after we have gone into the background, as
+ * it arranges to save unsent records when we exit.  Records left in the
+ * spool by an earlier run are sent first.
+ */
+void ship_start(void)
+{
+	char name[200];
+
+	if (! ship_spec)
+		return;
+	buf = xmalloc(SHIP_BUFFER_LEN);
+	metrics_name(name, sizeof(name), "ship_connected",
+		     get_child_log_name());
+	connected_metric = metrics_ref(name);
+	metrics_name(name, sizeof(name), "ship_spool_bytes",
+		     get_child_log_name());
+	spool_metric = metrics_ref(name);
+	metrics_name(name, sizeof(name), "ship_dropped_bytes_total",
+		     get_child_log_name());
+	dropped_metric = metrics_ref(name);
+	if (spool_dir) {
+		get_child_file_prefix(prefix, sizeof(prefix));
+		pending = xmalloc(SHIP_SPOOL_WRITE_LEN);
+		spool_scan();
+		ship_pid = getpid();
+		atexit(spool_at_exit);
+	}
+	plugin_add_sink(sink, NULL);
+	set_metrics();
+	start_connect(mstime_now());
+}
+
+
+void ship_fill_fds(fd_set *read_fds, fd_set *write_fds, int *nfds)
+{
+	if (ship_fd < 0)
+		return;
+	if (state == SHIP_CONNECTING || sent < buf_len)
+		FD_SET(ship_fd, write_fds);
+	if (state == SHIP_CONNECTED)
+		FD_SET(ship_fd, read_fds);
+	if (ship_fd > *nfds)
+		*nfds = ship_fd;
+}
+
+
+void ship_handle_fds(fd_set *read_fds, fd_set *write_fds)
+{
+	char discard[512];
+	socklen_t len;
+	ssize_t n;
+	int err;
+
+	if (ship_fd < 0)
+		return;
+	if (state == SHIP_CONNECTING) {
+		if (! FD_ISSET(ship_fd, write_fds))
+			return;
+		len = sizeof(err);
+		if (getsockopt(ship_fd, SOL_SOCKET, SO_ERROR, &err, &len))
+			err = errno;
+		if (err)
+			disconnect("cannot connect to", err);
+		else
+			connected();
+		return;
+	}
+	if (FD_ISSET(ship_fd, read_fds)) {
+		/* The collector has nothing to say, except by closing. */
+		n = read(ship_fd, discard, sizeof(discard));
+		if (0 == n || (-1 == n && errno != EAGAIN && errno != EINTR)) {
+			disconnect("lost connection to", n ? errno : 0);
+			return;
+		}
+	}
+	if (FD_ISSET(ship_fd, write_fds))
+		send_buffer();
+}
+
+
+/**
+ * Called each time round the main loop.  Write the records collected for the
+ * spool, load more from it if there is nothing else to send, and try to
+ * connect again when it is time.
+ *
+ * \return the next time this wants to be called, or 0.
+ */
+long long ship_check(long long now)
+{
+	if (! ship_spec)
+		return 0;
+	spool_flush();
+	if (state == SHIP_CONNECTED && ! buf_len && first_seq <= last_seq) {
+		spool_load();
+		/* Only the end of a file was found.  Try the next one next
+		   time round. */
+		if (! buf_len && first_seq <= last_seq)
+			return now;
+	}
+	if (state != SHIP_IDLE)
+		return 0;
+	if (now < retry_ms)
+		return retry_ms;
+	start_connect(now);
+	return state == SHIP_IDLE ? retry_ms : 0;
+}
+
+
+/**
+ * Make a record from an event: a JSON object with the time, the child's name
+ * and pid, the event, and the line of output or the exit status.
+ */
+static void sink(void *data, const struct pm_event *event)
+{
+	char rec[SHIP_RECORD_LEN];
+	size_t len = 4;
+	size_t body;
+
+	len += snprintf(rec + len, sizeof(rec) - len,
+			"{\"time\":%lld,\"child\":", event->time_ms);
+	len += json_string(rec + len, sizeof(rec) - len - 64,
+			   event->child_name);
+	len += snprintf(rec + len, sizeof(rec) - len, ",\"pid\":%d,",
+			(int)event->pid);
+	switch (event->type) {
+	case PM_EVENT_START:
+		len += snprintf(rec + len, sizeof(rec) - len,
+				"\"event\":\"start\"}");
+		break;
+	case PM_EVENT_OUTPUT:
+		len += snprintf(rec + len, sizeof(rec) - len,
+				"\"event\":\"output\",\"line\":");
+		len += json_string(rec + len, sizeof(rec) - len - 2,
+				   event->line);
+		rec[len++] = '}';
+		break;
+	case PM_EVENT_EXIT:
+		if (WIFSIGNALED(event->status))
+			len += snprintf(rec + len, sizeof(rec) - len,
+					"\"event\":\"exit\",\"signal\":%d}",
+					WTERMSIG(event->status));
+		else
+			len += snprintf(rec + len, sizeof(rec) - len,
+					"\"event\":\"exit\",\"status\":%d}",
+					WEXITSTATUS(event->status));
+		break;
+	}
+	body = len - 4;
+	rec[0] = (body >> 24) & 0xff;
+	rec[1] = (body >> 16) & 0xff;
+	rec[2] = (body >> 8) & 0xff;
+	rec[3] = body & 0xff;
+	add_record(rec, len);
+}
+
+
+/**
+ * Queue a record.  Records go to the spool while we are not connected, while
+ * memory is full, and while there is anything in the spool, so that they
+ * are sent in order.  Without a spool, a record that does not fit in memory
+ * is dropped.
+ */
+static void add_record(const char *rec, size_t len)
+{
+	if (spool_dir && (state != SHIP_CONNECTED || first_seq <= last_seq
+			  || buf_len + len > SHIP_BUFFER_LEN)) {
+		if (! spool_append(rec, len))
+			return;
+	} else if (buf_len + len <= SHIP_BUFFER_LEN) {
+		memcpy(buf + buf_len, rec, len);
+		buf_len += len;
+		return;
+	}
+	metrics_ref_add(dropped_metric, len);
+}
+
+
+static void start_connect(long long now)
+{
+	int err;
+
+	ship_fd = socket(ship_addr.ss_family,
+			 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == ship_fd) {
+		disconnect("cannot make a socket for", errno);
+		return;
+	}
+	if (! connect(ship_fd, (struct sockaddr *)&ship_addr, ship_addr_len)) {
+		connected();
+		return;
+	}
+	err = errno;
+	if (err == EINPROGRESS) {
+		state = SHIP_CONNECTING;
+		return;
+	}
+	disconnect("cannot connect to", err);
+}
+
+
+static void connected(void)
+{
+	logparent(CM_INFO, "connected to log collector %s\n", ship_spec);
+	state = SHIP_CONNECTED;
+	failure_logged = 0;
+	retry_delay_ms = SHIP_RETRY_MIN_MS;
+	set_metrics();
+	if (buf_len == 0)
+		spool_load();
+}
+
+
+/**
+ * Close the connection, and try again later.  A record that was partly sent
+ * is sent again in full.
+ */
+static void disconnect(const char *why, int err)
+{
+	if (ship_fd >= 0)
+		close(ship_fd);
+	ship_fd = -1;
+	if (state == SHIP_CONNECTED || ! failure_logged) {
+		logparent(CM_WARN, "%s log collector %s%s%s\n", why,
+			  ship_spec, err ? ": " : "",
+			  err ? strerror(err) : "");
+		if (spool_dir)
+			logparent(CM_INFO, "spooling log records in %s until "
+				  "the collector is back\n", spool_dir);
+		failure_logged = 1;
+	}
+	state = SHIP_IDLE;
+	sent = frame;
+	retry_ms = mstime_now() + retry_delay_ms;
+	retry_delay_ms *= 2;
+	if (retry_delay_ms > SHIP_RETRY_MAX_MS)
+		retry_delay_ms = SHIP_RETRY_MAX_MS;
+	set_metrics();
+}
+
+
+/**
+ * Send what we can of the buffer, all in one write, so that records that
+ * arrive together go to the collector together.
+ */
+static void send_buffer(void)
+{
+	ssize_t n;
+
+	while (sent < buf_len) {
+		n = send(ship_fd, buf + sent, buf_len - sent, MSG_NOSIGNAL);
+		if (-1 == n) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				disconnect("lost connection to", errno);
+			break;
+		}
+		sent += n;
+		skip_sent_records();
+		if (sent == buf_len && state == SHIP_CONNECTED) {
+			/* At most one read of the spool each time, and what
+			   it loads is sent when the socket is next ready. */
+			buf_len = sent = frame = 0;
+			from_spool = 0;
+			spool_load();
+			return;
+		}
+	}
+	if (state == SHIP_CONNECTED)
+		skip_sent_records();
+}
+
+
+/**
+ * Move frame past the records that have been sent in full, and remove them
+ * from buf.
+ */
+static void skip_sent_records(void)
+{
+	const unsigned char *p;
+	size_t len;
+
+	while (frame + 4 <= sent) {
+		p = (const unsigned char *)buf + frame;
+		len = ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		if (frame + 4 + len > sent)
+			break;
+		frame += 4 + len;
+	}
+	if (frame) {
+		if (from_spool)
+			load_off += frame;
+		memmove(buf, buf + frame, buf_len - frame);
+		buf_len -= frame;
+		sent -= frame;
+		frame = 0;
+	}
+}
+
+
+/**
+ * Find what an earlier run left in the spool.
+ */
+static void spool_scan(void)
+{
+	struct dirent **names;
+	struct stat st;
+	char path[1024];
+	long seq;
+	int n;
+	int i;
+
+	n = scandir(spool_dir, &names, select_segment, alphasort);
+	if (n < 0) {
+		logparent(CM_WARN, "cannot read %s: %s\n", spool_dir,
+			  strerror(errno));
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		seq = strtol(names[i]->d_name + strlen(prefix), NULL, 10);
+		if (i == 0)
+			first_seq = seq;
+		last_seq = seq;
+		spool_path(path, sizeof(path), seq);
+		if (! stat(path, &st))
+			spool_bytes += st.st_size;
+		free(names[i]);
+	}
+	free(names);
+	if (n)
+		logparent(CM_INFO, "%lld bytes of log records to send from "
+			  "%s\n", spool_bytes, spool_dir);
+}
+
+
+/**
+ * For scandir(): this child's spool files, whose names all have the same
+ * length, so they sort in order.
+ */
+static int select_segment(const struct dirent *d)
+{
+	size_t len = strlen(prefix);
+	const char *p;
+
+	if (strncmp(d->d_name, prefix, len) || strlen(d->d_name) != len + 10)
+		return 0;
+	for (p = d->d_name + len; *p; p++) {
+		if (*p < '0' || *p > '9')
+			return 0;
+	}
+	return 1;
+}
+
+
+static void spool_path(char *path, size_t len, long seq)
+{
+	snprintf(path, len, "%s/%s%010ld", spool_dir, prefix, seq);
+}
+
+
+/**
+ * Add a record to the end of the spool, removing the oldest file if that
+ * makes it too big.  It is written by spool_flush().
+ *
+ * \return 0, or -1 if it could not be written.
+ */
+static int spool_append(const char *rec, size_t len)
+{
+	char path[1024];
+
+	if (write_fd >= 0 && write_len + (off_t)len > SHIP_SEGMENT_LEN) {
+		spool_flush();
+		close(write_fd);
+		write_fd = -1;
+	}
+	if (-1 == write_fd) {
+		spool_path(path, sizeof(path), last_seq + 1);
+		write_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND
+				|O_CLOEXEC, 0600);
+		if (-1 == write_fd) {
+			logparent(CM_WARN, "cannot open %s: %s\n", path,
+				  strerror(errno));
+			return -1;
+		}
+		last_seq++;
+		write_len = 0;
+	}
+	if (pending_len + len > SHIP_SPOOL_WRITE_LEN && spool_flush())
+		return -1;
+	memcpy(pending + pending_len, rec, len);
+	pending_len += len;
+	write_len += len;
+	spool_bytes += len;
+	while (spool_bytes > spool_max && first_seq < last_seq)
+		spool_drop_oldest();
+	set_metrics();
+	return 0;
+}
+
+
+/**
+ * Write the records collected by spool_append() to the newest spool file.
+ * If that fails, they are dropped.
+ *
+ * \return 0, or -1 if they could not be written.
+ */
+static int spool_flush(void)
+{
+	if (! pending_len)
+		return 0;
+	if (write_all(write_fd, pending, pending_len)) {
+		logparent(CM_WARN, "cannot write to %s: %s\n", spool_dir,
+			  strerror(errno));
+		metrics_ref_add(dropped_metric, pending_len);
+		write_len -= pending_len;
+		spool_bytes -= pending_len;
+		pending_len = 0;
+		set_metrics();
+		return -1;
+	}
+	pending_len = 0;
+	return 0;
+}
+
+
+static void spool_drop_oldest(void)
+{
+	char path[1024];
+	struct stat st;
+	off_t size = 0;
+
+	spool_path(path, sizeof(path), first_seq);
+	if (! stat(path, &st))
+		size = st.st_size;
+	unlink(path);
+	logparent(CM_WARN, "log spool %s is full, dropped %lld bytes\n",
+		  spool_dir, (long long)(size - read_off));
+	metrics_ref_add(dropped_metric, size - read_off);
+	spool_bytes -= size - read_off;
+	read_off = 0;
+	first_seq++;
+	/* What was loaded from it is still to be sent, but no longer has a
+	   place in the spool, so it is kept as if it had never been there. */
+	from_spool = 0;
+	load_off = 0;
+}
+
+
+/**
+ * Put whole records from the oldest spool file in the empty buffer, with one
+ * read of at most SHIP_LOAD_LEN.  When there are none left in that file, it
+ * is removed instead, and ship_check() loads from the next.
+ */
+static void spool_load(void)
+{
+	const unsigned char *p;
+	char path[1024];
+	size_t whole;
+	size_t len;
+	ssize_t n;
+	int fd;
+
+	if (first_seq <= last_seq && ! buf_len) {
+		if (first_seq == last_seq)
+			spool_flush();
+		spool_path(path, sizeof(path), first_seq);
+		fd = open(path, O_RDONLY|O_CLOEXEC);
+		n = fd >= 0 ? pread(fd, buf, SHIP_LOAD_LEN, read_off) : -1;
+		if (fd >= 0)
+			close(fd);
+		if (n < 0) {
+			logparent(CM_WARN, "cannot read %s: %s\n", path,
+				  strerror(errno));
+			n = 0;
+		}
+		whole = 0;
+		while (whole + 4 <= (size_t)n) {
+			p = (const unsigned char *)buf + whole;
+			len = ((size_t)p[0] << 24) | (p[1] << 16)
+				| (p[2] << 8) | p[3];
+			if (whole + 4 + len > (size_t)n)
+				break;
+			whole += 4 + len;
+		}
+		if (! whole) {
+			/* The end of the file, or a record cut short when
+			   an earlier run died, which is left out. */
+			if (n) {
+				metrics_ref_add(dropped_metric, n);
+				spool_bytes -= n;
+			}
+			spool_finish_file();
+		} else {
+			buf_len = whole;
+			from_spool = 1;
+			load_off = read_off;
+			read_off += whole;
+			spool_bytes -= whole;
+		}
+	}
+	if (first_seq > last_seq) {
+		first_seq = SHIP_FIRST_SEQ;
+		last_seq = SHIP_FIRST_SEQ - 1;
+		spool_bytes = 0;
+	}
+	set_metrics();
+}
+
+
+static void spool_finish_file(void)
+{
+	char path[1024];
+
+	if (first_seq == last_seq && write_fd >= 0) {
+		close(write_fd);
+		write_fd = -1;
+	}
+	spool_path(path, sizeof(path), first_seq);
+	unlink(path);
+	first_seq++;
+	read_off = 0;
+}
+
+
+/**
+ * Keep the records that have not been sent for the next run.  Those in
+ * memory go in a spool file before the others, so they are sent first.  If
+ * part of the oldest spool file has been sent, the rest of it is moved to
+ * that file, so it is not sent twice.
+ */
+static void spool_at_exit(void)
+{
+	char path[1024];
+	char data[8192];
+	off_t off;
+	ssize_t n;
+	int out;
+	int in;
+
+	if (getpid() != ship_pid)
+		return;
+	spool_flush();
+	off = from_spool ? load_off + (off_t)frame : read_off;
+	if (! off && (from_spool || frame == buf_len))
+		return;
+	spool_path(path, sizeof(path), first_seq - 1);
+	out = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (-1 == out)
+		return;
+	if (! from_spool)
+		write_all(out, buf + frame, buf_len - frame);
+	if (off && first_seq <= last_seq) {
+		spool_path(path, sizeof(path), first_seq);
+		in = open(path, O_RDONLY|O_CLOEXEC);
+		n = -1;
+		while (in >= 0 && (n = pread(in, data, sizeof(data), off)) > 0) {
+			if (write_all(out, data, n)) {
+				n = -1;
+				break;
+			}
+			off += n;
+		}
+		if (in >= 0)
+			close(in);
+		/* Only once it has all been copied. */
+		if (! n)
+			unlink(path);
+	}
+	close(out);
+}
+
+
+static void set_metrics(void)
+{
+	metrics_ref_set(connected_metric, state == SHIP_CONNECTED);
+	metrics_ref_set(spool_metric, spool_bytes);
+}
+
+
+/**
+ * Write s as a JSON string, in quotes, truncated to fit in len.
+ *
+ * \return the number of bytes written.
+ */
+static size_t json_string(char *out, size_t len, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t n = 0;
+
+	out[n++] = '"';
+	for (; s && *s && n + 8 < len; s++) {
+		c = *s;
+		if (c == '"' || c == '\\') {
+			out[n++] = '\\';
+			out[n++] = c;
+		} else if (c == '\n') {
+			out[n++] = '\\';
+			out[n++] = 'n';
+		} else if (c == '\t') {
+			out[n++] = '\\';
+			out[n++] = 't';
+		} else if (c < 0x20 || c == 0x7f) {
+			out[n++] = '\\';
+			out[n++] = 'u';
+			out[n++] = '0';
+			out[n++] = '0';
+			out[n++] = hex[c >> 4];
+			out[n++] = hex[c & 0xf];
+		} else {
+			out[n++] = c;
+		}
+	}
+	out[n++] = '"';
+	return n;
+}
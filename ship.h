@@ -0,0 +1,19 @@
+/* Send the child's log to a collector, spilling to disk while it is down. */
+
+#ifndef __ship_h__
+#define __ship_h__
+
+#include <sys/select.h>
+
+/** Default for --ship-spool-size, in bytes. */
+#define SHIP_SPOOL_SIZE (64LL * 1024 * 1024)
+
+extern int ship_set_address(const char *spec);
+extern void ship_set_spool(const char *dir);
+extern int ship_set_spool_size(const char *arg);
+extern void ship_start(void);
+extern void ship_fill_fds(fd_set *read_fds, fd_set *write_fds, int *nfds);
+extern void ship_handle_fds(fd_set *read_fds, fd_set *write_fds);
+extern long long ship_check(long long now);
+
+#endif
@@ -0,0 +1,52 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+#include "xmalloc.h"
+
+
+/** Records are aligned to this, and must be big enough for the free list
+    link. */
+#define SLAB_ALIGN 16
+
+struct slab_block {
+	struct slab_block *next;
+	/* The records follow, at SLAB_ALIGN from the start. */
+};
+
+
+/**
+ * \return a zeroed record.
+ */
+void *slab_alloc(struct slab *s)
+{
+	struct slab_block *b;
+	size_t size;
+	char *p;
+	int i;
+
+	size = (s->size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	if (! s->free_list) {
+		b = xmalloc(SLAB_ALIGN + size * s->per_block);
+		b->next = s->blocks;
+		s->blocks = b;
+		p = (char *)b + SLAB_ALIGN;
+		for (i = s->per_block - 1; i >= 0; i--) {
+			*(void **)(p + i * size) = s->free_list;
+			s->free_list = p + i * size;
+		}
+	}
+	p = s->free_list;
+	s->free_list = *(void **)p;
+	memset(p, 0, s->size);
+	return p;
+}
+
+
+void slab_free(struct slab *s, void *p)
+{
+	if (! p)
+		return;
+	*(void **)p = s->free_list;
+	s->free_list = p;
+}
@@ -0,0 +1,28 @@
+/* Pools of fixed size records that are reused instead of freed. */
+
+#ifndef __slab_h__
+#define __slab_h__
+
+#include <stddef.h>
+
+struct slab_block;
+
+/**
+ * Records of one size, taken from blocks of per_block at a time.  Freed
+ * records go on a list for the next slab_alloc(), and the blocks are never
+ * given back, so once a slab has grown to the most records that are ever in
+ * use at once, it makes no more calls to malloc().
+ */
+struct slab {
+	size_t size;
+	int per_block;
+	void *free_list;
+	struct slab_block *blocks;
+};
+
+#define SLAB_INIT(type, per_block) { sizeof(type), (per_block), NULL, NULL }
+
+extern void *slab_alloc(struct slab *s);
+extern void slab_free(struct slab *s, void *p);
+
+#endif
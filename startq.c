@@ -0,0 +1,154 @@
+#include <stdlib.h>
+
+#include "startq.h"
+#include "manager.h"
+#include "xmalloc.h"
+
+
+static int before(struct managed *a, struct managed *b);
+static void sift_up(int i);
+static void sift_down(int i);
+static void place(struct managed *m, int i);
+
+static struct start_limits limits = { 0, 0 };
+/** A binary heap of the children waiting to start, with the one to start
+    next at the top.  Each child knows its place in it (queue_pos, counting
+    from 1), so it can be removed from the middle. */
+static struct managed **heap = NULL;
+static int heap_len = 0;
+static int heap_max = 0;
+/** Keeps the queue in order of arrival for children of equal priority. */
+static unsigned long long serial = 0;
+static long long last_start_ms = 0;
+
+
+void startq_set_limits(const struct start_limits *new_limits)
+{
+	limits = *new_limits;
+}
+
+
+/**
+ * Queue a child to start.  Nothing happens if it is already queued.
+ */
+void startq_add(struct managed *m)
+{
+	if (m->queue_pos)
+		return;
+	if (heap_len == heap_max) {
+		heap_max = heap_max * 2 + 16;
+		heap = xrealloc(heap, heap_max * sizeof(struct managed *));
+	}
+	m->queue_serial = serial++;
+	place(m, heap_len++);
+	sift_up(heap_len - 1);
+}
+
+
+/**
+ * Take a child out of the queue, if it is in it.
+ */
+void startq_remove(struct managed *m)
+{
+	int i = m->queue_pos - 1;
+
+	if (! m->queue_pos)
+		return;
+	m->queue_pos = 0;
+	heap_len--;
+	if (i == heap_len)
+		return;
+	place(heap[heap_len], i);
+	sift_up(i);
+	sift_down(i);
+}
+
+
+int startq_len(void)
+{
+	return heap_len;
+}
+
+
+/**
+ * Find the next child that may start now, and take it out of the queue.
+ *
+ * \param starting how many children are starting already.
+ * \param when if no child may start now only because of the rate limit, set
+ * to the time when one can.
+ *
+ * \return the child, or NULL.
+ */
+struct managed *startq_next(int starting, long long now, long long *when)
+{
+	struct managed *m;
+	long long next_ms;
+
+	if (! heap_len)
+		return NULL;
+	if (limits.max_starting && starting >= limits.max_starting)
+		return NULL;
+	if (limits.rate > 0) {
+		next_ms = last_start_ms + (long long)(1000 / limits.rate);
+		if (now < next_ms) {
+			*when = next_ms;
+			return NULL;
+		}
+	}
+	last_start_ms = now;
+	m = heap[0];
+	startq_remove(m);
+	return m;
+}
+
+
+/**
+ * Should a start before b?  Higher priorities first, and then first come
+ * first served.
+ */
+static int before(struct managed *a, struct managed *b)
+{
+	if (a->priority != b->priority)
+		return a->priority > b->priority;
+	return a->queue_serial < b->queue_serial;
+}
+
+
+static void sift_up(int i)
+{
+	struct managed *m = heap[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (! before(m, heap[parent]))
+			break;
+		place(heap[parent], i);
+		i = parent;
+	}
+	place(m, i);
+}
+
+
+static void sift_down(int i)
+{
+	struct managed *m = heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < heap_len) {
+		if (child + 1 < heap_len && before(heap[child + 1], heap[child]))
+			child++;
+		if (! before(heap[child], m))
+			break;
+		place(heap[child], i);
+		i = child;
+	}
+	place(m, i);
+}
+
+
+static void place(struct managed *m, int i)
+{
+	heap[i] = m;
+	m->queue_pos = i + 1;
+}
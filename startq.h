@@ -0,0 +1,26 @@
+/* Limit how many children start at once, and how fast. */
+
+#ifndef __startq_h__
+#define __startq_h__
+
+struct managed;
+
+/**
+ * Limits on child starts, from the top of the configuration file.  0 means no
+ * limit.
+ */
+struct start_limits {
+	/** Children that have been allowed to start and are not ready yet. */
+	int max_starting;
+	/** Starts per second. */
+	double rate;
+};
+
+extern void startq_set_limits(const struct start_limits *limits);
+extern void startq_add(struct managed *m);
+extern void startq_remove(struct managed *m);
+extern int startq_len(void);
+extern struct managed *startq_next(int starting, long long now,
+				   long long *when);
+
+#endif
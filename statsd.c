@@ -0,0 +1,391 @@
+#define _GNU_SOURCE		/* For struct ucred */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "arena.h"
+#include "log.h"
+#include "metrics.h"
+#include "statsd.h"
+
+
+/** Longest statsd metric name we keep. */
+#define STATSD_NAME_LEN 128
+#define STATSD_BUCKETS 256
+/** Most datagrams read on one trip around the main loop, so a busy child
+    can't keep us from everything else. */
+#define STATSD_READ_MAX 256
+/** Asked for, so bursts are not dropped between trips around the loop. */
+#define STATSD_RCVBUF (1024 * 1024)
+
+enum statsd_mode {
+	STATSD_NONE,
+	STATSD_UNIX,
+	STATSD_UDP,
+};
+
+/**
+ * One metric from the child, found by its statsd name and type.  Counters and
+ * gauges have one of our metrics, and timers have a count and a sum.
+ */
+struct child_stat {
+	char name[STATSD_NAME_LEN];
+	char type;
+	struct metric *value;
+	struct metric *count;
+	struct child_stat *next;
+};
+
+static void read_datagrams(void);
+static void parse_line(char *line);
+static struct child_stat *find_stat(const char *name, char type);
+static void dropped(void);
+
+static enum statsd_mode mode = STATSD_NONE;
+static int statsd_fd = -1;
+static uid_t child_uid = 0;
+/** What the child is told, in STATSD_SOCKET or STATSD_PORT. */
+static char address[64];
+
+/** The stats never go away, so they come from an arena. */
+static struct arena arena = ARENA_INIT;
+static struct child_stat *buckets[STATSD_BUCKETS];
+static int n_stats = 0;
+static struct metric *dropped_metric = NULL;
+
+
+int statsd_set_mode(const char *arg)
+{
+	if (! strcmp(arg, "unix"))
+		mode = STATSD_UNIX;
+	else if (! strcmp(arg, "udp"))
+		mode = STATSD_UDP;
+	else
+		return -1;
+	return 0;
+}
+
+
+int statsd_enabled(void)
+{
+	return mode != STATSD_NONE;
+}
+
+
+/**
+ * Open the socket that the child sends to.  It stays open while we run, so
+ * every generation of the child sends to the same place.  Failure is a
+ * configuration error, so we log it and exit.
+ *
+ * A unix socket is in the abstract namespace, like the notify socket, and
+ * only takes datagrams from root, us or the child's uid.  A UDP socket is on
+ * 127.0.0.1, for statsd clients that can't use a unix socket, and takes
+ * anything sent to it.
+ */
+void statsd_open(uid_t uid)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	socklen_t len;
+	int size = STATSD_RCVBUF;
+	int one = 1;
+	char name[200];
+
+	if (mode == STATSD_NONE)
+		return;
+	child_uid = uid;
+	if (mode == STATSD_UNIX) {
+		snprintf(address, sizeof(address),
+			 "@process-monitor/%d/statsd", (int)getpid());
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		/* sun_path[0] stays '\0' for the abstract namespace. */
+		strncpy(sun.sun_path + 1, address + 1,
+			sizeof(sun.sun_path) - 2);
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(address);
+		statsd_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK
+				   | SOCK_CLOEXEC, 0);
+		if (statsd_fd >= 0
+		    && bind(statsd_fd, (struct sockaddr *)&sun, len))
+			goto error;
+		if (statsd_fd >= 0)
+			setsockopt(statsd_fd, SOL_SOCKET, SO_PASSCRED, &one,
+				   sizeof(one));
+	} else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		statsd_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK
+				   | SOCK_CLOEXEC, 0);
+		len = sizeof(sin);
+		if (statsd_fd >= 0
+		    && (bind(statsd_fd, (struct sockaddr *)&sin, len)
+			|| getsockname(statsd_fd, (struct sockaddr *)&sin,
+				       &len)))
+			goto error;
+		snprintf(address, sizeof(address), "%d",
+			 (int)ntohs(sin.sin_port));
+	}
+	if (-1 == statsd_fd)
+		goto error;
+	setsockopt(statsd_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	metrics_name(name, sizeof(name), "statsd_dropped_total",
+		     get_child_log_name());
+	dropped_metric = metrics_ref(name);
+	logparent(CM_INFO, "statsd socket is %s%s\n",
+		  mode == STATSD_UDP ? "127.0.0.1:" : "", address);
+	return;
+
+ error:
+	logparent(CM_ERROR, "cannot make statsd socket: %s\n",
+		  strerror(errno));
+	exit(1);
+}
+
+
+/**
+ * In the child, say where to send metrics.
+ */
+void statsd_setup_child(void)
+{
+	switch (mode) {
+	case STATSD_UNIX:
+		setenv("STATSD_SOCKET", address, 1);
+		break;
+	case STATSD_UDP:
+		setenv("STATSD_HOST", "127.0.0.1", 1);
+		setenv("STATSD_PORT", address, 1);
+		break;
+	case STATSD_NONE:
+		break;
+	}
+}
+
+
+void statsd_fill_fds(fd_set *read_fds, int *nfds)
+{
+	if (statsd_fd < 0)
+		return;
+	FD_SET(statsd_fd, read_fds);
+	if (statsd_fd > *nfds)
+		*nfds = statsd_fd;
+}
+
+
+void statsd_handle_fds(fd_set *read_fds)
+{
+	if (statsd_fd >= 0 && FD_ISSET(statsd_fd, read_fds))
+		read_datagrams();
+}
+
+
+static void read_datagrams(void)
+{
+	char buf[8192];
+	char cmsgbuf[CMSG_SPACE(sizeof(struct ucred))];
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct ucred *cred;
+	ssize_t len;
+	char *line;
+	char *next;
+	int i;
+
+	for (i = 0; i < STATSD_READ_MAX; i++) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf) - 1;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cmsgbuf;
+		mh.msg_controllen = sizeof(cmsgbuf);
+		len = recvmsg(statsd_fd, &mh, MSG_DONTWAIT);
+		if (-1 == len) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK
+			    && errno != EINTR)
+				logparent(CM_WARN, "cannot read statsd "
+					  "socket: %s\n", strerror(errno));
+			return;
+		}
+		if (mode == STATSD_UNIX) {
+			cred = NULL;
+			for (cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+			     cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET
+				    && cmsg->cmsg_type == SCM_CREDENTIALS)
+					cred = (struct ucred *)CMSG_DATA(cmsg);
+			}
+			if (! cred || (cred->uid != 0 && cred->uid != getuid()
+				       && cred->uid != child_uid)) {
+				dropped();
+				continue;
+			}
+		}
+		buf[len] = '\0';
+		for (line = buf; line && *line; line = next) {
+			next = strchr(line, '\n');
+			if (next)
+				*next++ = '\0';
+			parse_line(line);
+		}
+	}
+}
+
+
+/**
+ * Add one line in the statsd format, "name:value|type[|@rate][|#tags]", to
+ * its metric.  Counters (c) are added up, gauges (g) are set, or changed if
+ * the value starts with + or -, and timers (ms, h, d) add to a count and a
+ * sum.  Tags are ignored, and sets (s) are not kept.
+ */
+static void parse_line(char *line)
+{
+	struct child_stat *st;
+	char *colon;
+	char *bar;
+	char *rate_field;
+	char *endptr;
+	double value;
+	double rate = 1;
+	int relative;
+	char type;
+
+	if (! *line)
+		return;
+	colon = strchr(line, ':');
+	bar = colon ? strchr(colon, '|') : NULL;
+	if (! bar || colon == line) {
+		dropped();
+		return;
+	}
+	*colon = '\0';
+	*bar = '\0';
+	relative = colon[1] == '+' || colon[1] == '-';
+	value = strtod(colon + 1, &endptr);
+	if (endptr == colon + 1 || *endptr) {
+		dropped();
+		return;
+	}
+	type = bar[1];
+	if (type == 'm' && bar[2] == 's')
+		bar++;
+	else if (type == 'h' || type == 'd')
+		type = 'm';
+	else if (type == 'm')
+		type = '\0';
+	if ((type != 'c' && type != 'g' && type != 'm')
+	    || (bar[2] && bar[2] != '|')) {
+		dropped();
+		return;
+	}
+	rate_field = strstr(bar + 2, "|@");
+	if (rate_field) {
+		rate = strtod(rate_field + 2, &endptr);
+		if (rate <= 0 || rate > 1)
+			rate = 1;
+	}
+
+	st = find_stat(line, type);
+	if (! st)
+		return;
+	switch (type) {
+	case 'c':
+		metrics_ref_add(st->value, value / rate);
+		break;
+	case 'g':
+		if (relative)
+			metrics_ref_add(st->value, value);
+		else
+			metrics_ref_set(st->value, value);
+		break;
+	case 'm':
+		metrics_ref_add(st->count, 1 / rate);
+		metrics_ref_add(st->value, value / rate);
+		break;
+	}
+}
+
+
+/**
+ * Find the stat for a name and type, making it if it's new.  Our metric is
+ * process_monitor_statsd_<name>, with anything that Prometheus does not allow
+ * in a name changed to '_'.
+ *
+ * \return the stat, or NULL if it is new and there are too many already.
+ */
+static struct child_stat *find_stat(const char *name, char type)
+{
+	unsigned int hash = 2166136261u;
+	char metric[STATSD_NAME_LEN + 16];
+	char full[STATSD_NAME_LEN + 128];
+	const char *p;
+	struct child_stat *st;
+	size_t n;
+
+	for (p = name; *p; p++)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	hash = (hash ^ (unsigned char)type) * 16777619u;
+	for (st = buckets[hash % STATSD_BUCKETS]; st; st = st->next) {
+		if (st->type == type && ! strcmp(st->name, name))
+			return st;
+	}
+	if (n_stats == STATSD_MAX_METRICS || strlen(name) >= STATSD_NAME_LEN) {
+		dropped();
+		return NULL;
+	}
+
+	st = arena_alloc(&arena, sizeof(struct child_stat));
+	strcpy(st->name, name);
+	st->type = type;
+	strcpy(metric, "statsd_");
+	n = strlen(metric);
+	for (p = name; *p; p++) {
+		if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+		    || (*p >= '0' && *p <= '9'))
+			metric[n++] = *p;
+		else
+			metric[n++] = '_';
+	}
+	metric[n] = '\0';
+	switch (type) {
+	case 'c':
+		strcpy(metric + n, "_total");
+		break;
+	case 'm':
+		strcpy(metric + n, "_sum");
+		break;
+	}
+	metrics_name(full, sizeof(full), metric, get_child_log_name());
+	st->value = metrics_ref(full);
+	st->count = NULL;
+	if (type == 'm') {
+		strcpy(metric + n, "_count");
+		metrics_name(full, sizeof(full), metric, get_child_log_name());
+		st->count = metrics_ref(full);
+	}
+	st->next = buckets[hash % STATSD_BUCKETS];
+	buckets[hash % STATSD_BUCKETS] = st;
+	n_stats++;
+	return st;
+}
+
+
+/**
+ * Count a line or datagram that we could not use.  They are not logged, as a
+ * broken client could send a great many.
+ */
+static void dropped(void)
+{
+	metrics_ref_add(dropped_metric, 1);
+}
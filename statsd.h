@@ -0,0 +1,20 @@
+/* Take statsd metrics from the child, and add them to our own metrics. */
+
+#ifndef __statsd_h__
+#define __statsd_h__
+
+#include <sys/types.h>
+#include <sys/select.h>
+
+/** Most distinct metric names kept for the child.  Names past this are
+    dropped, so a child can't make us grow without limit. */
+#define STATSD_MAX_METRICS 1000
+
+extern int statsd_set_mode(const char *arg);
+extern int statsd_enabled(void);
+extern void statsd_open(uid_t child_uid);
+extern void statsd_setup_child(void);
+extern void statsd_fill_fds(fd_set *read_fds, int *nfds);
+extern void statsd_handle_fds(fd_set *read_fds);
+
+#endif
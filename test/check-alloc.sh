@@ -0,0 +1,34 @@
+#!/bin/sh
+# Check that process-monitor makes no heap allocations while it reads and
+# logs a busy child's output, once it has settled down.
+#
+# Usage: check-alloc.sh PROCESS-MONITOR MALLOC-COUNT.SO
+
+PM=$1
+SHIM=$2
+LOG=$(mktemp)
+trap 'rm -f "$LOG"' EXIT
+
+if ! ldd "$PM" > /dev/null 2>&1; then
+	echo "check-alloc: skipped, $PM is statically linked"
+	exit 0
+fi
+
+LD_PRELOAD=$SHIM MALLOC_COUNT_WINDOW=1000-3000 MALLOC_COUNT_LOG=$LOG \
+	"$PM" -- /bin/sh -c 'i=0; while :; do echo line $i; i=$((i+1)); done' \
+	> /dev/null 2>&1 &
+pid=$!
+sleep 4
+kill $pid
+wait $pid
+
+n=$(awk -v pid=$pid '$1 == pid { print $2 }' "$LOG")
+if [ -z "$n" ]; then
+	echo "check-alloc: FAIL, no count from process-monitor[$pid]"
+	exit 1
+fi
+if [ "$n" -ne 0 ]; then
+	echo "check-alloc: FAIL, $n heap allocations while logging output"
+	exit 1
+fi
+echo "check-alloc: ok"
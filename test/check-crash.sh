@@ -0,0 +1,45 @@
+#!/bin/sh
+# Check that a crash of the child is recorded in --crash-dir, and that only
+# the newest --crash-keep records are kept.  Another child's records, whose
+# name starts with this child's, must be left alone.
+#
+# Usage: check-crash.sh PROCESS-MONITOR
+
+PM=$1
+DIR=$(mktemp -d)
+LOG=$(mktemp)
+trap 'rm -rf "$DIR" "$LOG"' EXIT
+ulimit -c 0
+
+OTHER="$DIR/crashy-web-20260101-000000-1"
+echo "exited with status 1" > "$OTHER"
+
+"$PM" --crash-dir "$DIR" --crash-keep 2 -m 1 -M 1 -L crashy \
+	-- /bin/sh -c 'kill -SEGV $$' > "$LOG" 2>&1 &
+pid=$!
+sleep 4.5
+kill $pid
+wait $pid
+sleep 0.5
+
+written=$(grep -c "writing crash record" "$LOG")
+kept=$(ls "$DIR" | grep -c '^crashy-[0-9]')
+if [ "$written" -lt 3 ]; then
+	echo "check-crash: FAIL, only $written crash records written"
+	exit 1
+fi
+if [ "$kept" -ne 2 ]; then
+	echo "check-crash: FAIL, $kept of $written records kept, not 2"
+	exit 1
+fi
+if [ ! -f "$OTHER" ]; then
+	echo "check-crash: FAIL, crashy-web's record was pruned"
+	exit 1
+fi
+for f in "$DIR"/crashy-[0-9]*; do
+	if ! head -1 "$f" | grep -q "killed by signal 11"; then
+		echo "check-crash: FAIL, $f does not say signal 11"
+		exit 1
+	fi
+done
+echo "check-crash: ok"
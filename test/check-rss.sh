@@ -0,0 +1,34 @@
+#!/bin/sh
+# Check that an idle process-monitor stays within its memory budget, so that
+# a host can run many of them.
+#
+# Usage: check-rss.sh PROCESS-MONITOR RSS-KB PRIVATE-DIRTY-KB
+
+PM=$1
+RSS_BUDGET=$2
+DIRTY_BUDGET=$3
+
+# A binary that has just been linked is dirty in the page cache, and its
+# pages would count as the monitor's own until they are written back.
+sync
+"$PM" -- /bin/sleep 1000 > /dev/null 2>&1 &
+pid=$!
+sleep 1
+if [ ! -r /proc/$pid/smaps_rollup ]; then
+	kill $pid
+	wait $pid
+	echo "check-rss: skipped, no /proc/PID/smaps_rollup"
+	exit 0
+fi
+rss=$(awk '$1 == "Rss:" { print $2 }' /proc/$pid/smaps_rollup)
+dirty=$(awk '$1 == "Private_Dirty:" { print $2 }' /proc/$pid/smaps_rollup)
+kill $pid
+wait $pid
+
+echo "check-rss: idle Rss $rss kB (budget $RSS_BUDGET kB)," \
+     "Private_Dirty $dirty kB (budget $DIRTY_BUDGET kB)"
+if [ "$rss" -gt "$RSS_BUDGET" ] || [ "$dirty" -gt "$DIRTY_BUDGET" ]; then
+	echo "check-rss: FAIL, over budget"
+	exit 1
+fi
+echo "check-rss: ok"
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Check that the child's output is spooled while the log collector is down,
+# and sent in order, exactly once, when it comes back.
+#
+# Usage: check-ship.sh PROCESS-MONITOR
+
+PM=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+if ! command -v python3 > /dev/null; then
+	echo "check-ship: skipped, the collector needs python3"
+	exit 0
+fi
+
+# A collector that writes the line of each output record to a file.
+cat > "$DIR/collector.py" <<'PY'
+import json, os, socket, struct, sys
+s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+s.bind(sys.argv[1])
+s.listen(1)
+out = open(sys.argv[2], "a", buffering=1)
+while True:
+    c, _ = s.accept()
+    data = b""
+    while True:
+        d = c.recv(65536)
+        if not d:
+            break
+        data += d
+        while len(data) >= 4:
+            n = struct.unpack(">I", data[:4])[0]
+            if len(data) < 4 + n:
+                break
+            rec = json.loads(data[4:4 + n])
+            data = data[4 + n:]
+            if rec["event"] == "output":
+                out.write(rec["line"] + "\n")
+    c.close()
+PY
+
+mkdir "$DIR/spool"
+"$PM" --ship "unix:$DIR/sock" --ship-spool "$DIR/spool" -L shipped \
+	-- /bin/sh -c 'i=0; while [ $i -lt 300 ]; do echo line $i;
+		i=$((i+1)); /bin/sleep 0.01; done; exec /bin/sleep 100' \
+	> "$DIR/log" 2>&1 &
+pid=$!
+sleep 1.5
+spooled=$(cat "$DIR"/spool/* 2> /dev/null | wc -c)
+python3 "$DIR/collector.py" "$DIR/sock" "$DIR/recv" &
+collector=$!
+sleep 5
+kill $pid
+wait $pid
+kill $collector
+wait $collector 2> /dev/null
+
+if [ "$spooled" -eq 0 ]; then
+	echo "check-ship: FAIL, nothing was spooled while the collector was down"
+	exit 1
+fi
+i=0
+while [ $i -lt 300 ]; do
+	echo line $i
+	i=$((i+1))
+done > "$DIR/expected"
+if ! cmp -s "$DIR/expected" "$DIR/recv"; then
+	echo "check-ship: FAIL, the collector did not get lines 0 to 299" \
+	     "in order, once each"
+	exit 1
+fi
+echo "check-ship: ok"
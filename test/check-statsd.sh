@@ -0,0 +1,44 @@
+#!/bin/sh
+# Check that statsd lines from the child update the metrics file: counters
+# with a sample rate, gauges set and changed, and timers, and that lines
+# that can't be used are counted as dropped.
+#
+# Usage: check-statsd.sh PROCESS-MONITOR
+
+PM=$1
+PROM=$(mktemp)
+trap 'rm -f "$PROM" "$PROM.tmp"' EXIT
+
+if [ ! -x /bin/bash ]; then
+	echo "check-statsd: skipped, the child needs bash for /dev/udp"
+	exit 0
+fi
+
+"$PM" --statsd udp --metrics-file "$PROM" -L st -- /bin/bash -c '
+	send() { printf "%s" "$1" > /dev/udp/$STATSD_HOST/$STATSD_PORT; }
+	send "hits:1|c"; send "hits:1|c"; send "hits:2|c|@0.5"
+	send "depth:7|g"; send "depth:-2|g"; send "depth:+4|g"
+	send "lat:10|ms|@0.5"; send "lat:20|ms"
+	send "bad line"; send "x:1|zz"; send "y:abc|c"
+	exec /bin/sleep 100' > /dev/null 2>&1 &
+pid=$!
+sleep 1.5
+kill $pid
+wait $pid
+
+fail=0
+expect() {
+	got=$(awk -v m="process_monitor_$1{child=\"st\"}" '$1 == m { print $2 }' \
+		"$PROM")
+	if [ "$got" != "$2" ]; then
+		echo "check-statsd: FAIL, $1 is ${got:-missing}, not $2"
+		fail=1
+	fi
+}
+expect statsd_hits_total 6
+expect statsd_depth 9
+expect statsd_lat_count 3
+expect statsd_lat_sum 40
+expect statsd_dropped_total 3
+[ $fail -eq 0 ] && echo "check-statsd: ok"
+exit $fail
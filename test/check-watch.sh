@@ -0,0 +1,38 @@
+#!/bin/sh
+# Check that a burst of changes to a --watch file gives exactly one restart,
+# and only once --watch-delay has passed since the last change.
+#
+# Usage: check-watch.sh PROCESS-MONITOR
+
+PM=$1
+DIR=$(mktemp -d)
+LOG=$(mktemp)
+trap 'rm -rf "$DIR" "$LOG"' EXIT
+
+echo 1 > "$DIR/conf"
+"$PM" --watch "$DIR/conf" --watch-delay 1 -m 1 -- /bin/sleep 1000 \
+	> "$LOG" 2>&1 &
+pid=$!
+sleep 1
+echo 2 > "$DIR/conf"
+sleep 0.1
+echo 3 > "$DIR/conf.new"
+mv "$DIR/conf.new" "$DIR/conf"
+sleep 0.1
+echo 4 >> "$DIR/conf"
+sleep 0.3
+early=$(grep -c "restarting" "$LOG")
+sleep 2
+kill $pid
+wait $pid
+
+restarts=$(grep -c "restarting" "$LOG")
+if [ "$early" -ne 0 ]; then
+	echo "check-watch: FAIL, restarted before --watch-delay"
+	exit 1
+fi
+if [ "$restarts" -ne 1 ]; then
+	echo "check-watch: FAIL, $restarts restarts for one burst of changes"
+	exit 1
+fi
+echo "check-watch: ok"
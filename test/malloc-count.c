@@ -0,0 +1,92 @@
+/* Count heap allocations, for check-alloc.sh.
+ *
+ * Preload with LD_PRELOAD.  Only calls made between FROM and TO milliseconds
+ * after the program started are counted, where MALLOC_COUNT_WINDOW=FROM-TO,
+ * and at exit "<pid> <count>" is appended to the file MALLOC_COUNT_LOG. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static long long start_ms;
+static long long from_ms = -1;
+static long long to_ms = -1;
+static unsigned long count = 0;
+
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+static void counted(void)
+{
+	long long t;
+
+	if (from_ms < 0)
+		return;
+	t = now_ms() - start_ms;
+	if (t >= from_ms && t < to_ms)
+		count++;
+}
+
+
+void *malloc(size_t size)
+{
+	counted();
+	return __libc_malloc(size);
+}
+
+
+void *calloc(size_t n, size_t size)
+{
+	counted();
+	return __libc_calloc(n, size);
+}
+
+
+void *realloc(void *p, size_t size)
+{
+	counted();
+	return __libc_realloc(p, size);
+}
+
+
+__attribute__((constructor)) static void malloc_count_init(void)
+{
+	const char *window = getenv("MALLOC_COUNT_WINDOW");
+
+	start_ms = now_ms();
+	if (window && sscanf(window, "%lld-%lld", &from_ms, &to_ms) != 2)
+		from_ms = -1;
+}
+
+
+__attribute__((destructor)) static void malloc_count_fini(void)
+{
+	const char *path = getenv("MALLOC_COUNT_LOG");
+	char buf[64];
+	int len;
+	int fd;
+
+	if (! path || from_ms < 0)
+		return;
+	fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+	if (fd < 0)
+		return;
+	len = snprintf(buf, sizeof(buf), "%d %lu\n", (int)getpid(), count);
+	if (write(fd, buf, len) != len)
+		count = 0;
+	close(fd);
+}
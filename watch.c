@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "mstime.h"
+#include "watch.h"
+#include "xmalloc.h"
+
+
+/** Events that mean a file may have changed.  IN_MODIFY only holds off the
+    change until the writer has finished. */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM \
+		      | IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MODIFY)
+/** A file still being written holds off a change for at most this many
+    delays, in case the writer has died with it open. */
+#define WATCH_MAX_DELAYS 30
+
+/**
+ * A path from --watch.  A directory is watched for anything in it changing.
+ * Anything else (including a symlink to a directory, as used to switch
+ * releases) is watched through its parent directory, so that replacing it
+ * with rename() is seen.
+ */
+struct watch {
+	char *path;
+	/** The name in the parent directory, or NULL if path is a watched
+	    directory. */
+	char *name;
+	int wd;
+	/** Set between IN_MODIFY and the writer closing the file. */
+	int writing;
+	struct watch *next;
+};
+
+static void read_events(void);
+static void handle_event(const struct inotify_event *ev);
+
+static struct watch *watches = NULL;
+static struct watch **watches_tail = &watches;
+static int inotify_fd = -1;
+static long long delay_ms = WATCH_DELAY_MS;
+/** When the first and the latest of a burst of events were seen, or 0. */
+static long long first_ms = 0;
+static long long last_ms = 0;
+/** The path of the latest event, for the log. */
+static const char *changed = NULL;
+
+
+void watch_add(const char *path)
+{
+	struct watch *w;
+
+	w = xmalloc(sizeof(struct watch));
+	w->path = xstrdup(path);
+	w->name = NULL;
+	w->wd = -1;
+	w->writing = 0;
+	w->next = NULL;
+	*watches_tail = w;
+	watches_tail = &w->next;
+}
+
+
+int watch_set_delay(const char *arg)
+{
+	char *endptr;
+	double secs;
+
+	secs = strtod(arg, &endptr);
+	if (! *arg || *endptr || secs < 0)
+		return -1;
+	delay_ms = (long long)(secs * 1000);
+	return 0;
+}
+
+
+/**
+ * Start watching.  A path that can't be watched is a configuration error, so
+ * we log it and exit.
+ */
+void watch_start(void)
+{
+	char dir[1024];
+	struct watch *w;
+	struct stat st;
+	char *copy;
+
+	if (! watches)
+		return;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (-1 == inotify_fd) {
+		logparent(CM_ERROR, "cannot start inotify: %s\n",
+			  strerror(errno));
+		exit(1);
+	}
+	for (w = watches; w; w = w->next) {
+		if (! lstat(w->path, &st) && S_ISDIR(st.st_mode)) {
+			snprintf(dir, sizeof(dir), "%s", w->path);
+		} else {
+			/* The file need not exist yet, but its directory
+			   must. */
+			copy = xstrdup(w->path);
+			w->name = xstrdup(basename(copy));
+			free(copy);
+			copy = xstrdup(w->path);
+			snprintf(dir, sizeof(dir), "%s", dirname(copy));
+			free(copy);
+		}
+		/* Watching one directory twice gives the same wd. */
+		w->wd = inotify_add_watch(inotify_fd, dir, WATCH_EVENTS);
+		if (-1 == w->wd) {
+			logparent(CM_ERROR, "cannot watch %s: %s\n", dir,
+				  strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+
+void watch_fill_fds(fd_set *read_fds, int *nfds)
+{
+	if (inotify_fd < 0)
+		return;
+	FD_SET(inotify_fd, read_fds);
+	if (inotify_fd > *nfds)
+		*nfds = inotify_fd;
+}
+
+
+void watch_handle_fds(fd_set *read_fds)
+{
+	if (inotify_fd >= 0 && FD_ISSET(inotify_fd, read_fds))
+		read_events();
+}
+
+
+/**
+ * See whether a burst of changes has finished: nothing has happened for
+ * --watch-delay, and nothing is still being written.
+ *
+ * \return the path that changed last, once, when the burst has finished, or
+ * NULL.  *when is set to the time to look again, or 0.
+ */
+const char *watch_check(long long now, long long *when)
+{
+	const char *path;
+	struct watch *w;
+	int writing = 0;
+
+	*when = 0;
+	if (! last_ms)
+		return NULL;
+	if (now < last_ms + delay_ms) {
+		*when = last_ms + delay_ms;
+		return NULL;
+	}
+	for (w = watches; w; w = w->next)
+		writing |= w->writing;
+	if (writing && now < first_ms + WATCH_MAX_DELAYS * delay_ms) {
+		*when = now + (delay_ms ? delay_ms : 100);
+		return NULL;
+	}
+	if (writing) {
+		logparent(CM_WARN, "%s is still open for writing\n", changed);
+		for (w = watches; w; w = w->next)
+			w->writing = 0;
+	}
+	path = changed;
+	first_ms = 0;
+	last_ms = 0;
+	changed = NULL;
+	return path;
+}
+
+
+static void read_events(void)
+{
+	/* Aligned as the man page says, for struct inotify_event. */
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	while (1) {
+		n = read(inotify_fd, buf, sizeof(buf));
+		if (-1 == n && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			handle_event(ev);
+		}
+	}
+}
+
+
+static void handle_event(const struct inotify_event *ev)
+{
+	long long now = mstime_now();
+	struct watch *w;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* We don't know what changed, so assume it was ours. */
+		logparent(CM_WARN, "inotify queue overflowed\n");
+		if (! first_ms)
+			first_ms = now;
+		last_ms = now;
+		changed = watches->path;
+		return;
+	}
+	for (w = watches; w; w = w->next) {
+		if (w->wd != ev->wd)
+			continue;
+		if (ev->mask & IN_IGNORED) {
+			/* The directory has gone. */
+			logparent(CM_WARN, "no longer watching %s\n",
+				  w->path);
+			w->wd = -1;
+			w->writing = 0;
+			continue;
+		}
+		if (w->name && (! ev->len || strcmp(w->name, ev->name)))
+			continue;
+		if (ev->mask & IN_MODIFY)
+			w->writing = 1;
+		else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO
+				     | IN_MOVED_FROM | IN_DELETE))
+			w->writing = 0;
+		if (! first_ms)
+			first_ms = now;
+		last_ms = now;
+		changed = w->path;
+	}
+}
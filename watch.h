@@ -0,0 +1,18 @@
+/* Watch files for changes with inotify, and say when they have settled. */
+
+#ifndef __watch_h__
+#define __watch_h__
+
+#include <sys/select.h>
+
+/** Default for --watch-delay, in ms. */
+#define WATCH_DELAY_MS 2000
+
+extern void watch_add(const char *path);
+extern int watch_set_delay(const char *arg);
+extern void watch_start(void);
+extern void watch_fill_fds(fd_set *read_fds, int *nfds);
+extern void watch_handle_fds(fd_set *read_fds);
+extern const char *watch_check(long long now, long long *when);
+
+#endif
@@ -41,3 +41,13 @@ void *xrealloc(void *ptr, size_t size)
 	}
 	return p;
 }
+
+
+char *xstrdup(const char *s)
+{
+	char *p;
+
+	p = xmalloc(strlen(s) + 1);
+	strcpy(p, s);
+	return p;
+}
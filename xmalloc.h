@@ -5,5 +5,6 @@
 
 void *xmalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
+char *xstrdup(const char *s);
 
 #endif